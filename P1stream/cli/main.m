@@ -229,6 +229,10 @@ static void create_video_sources(P1Context *ctx, NSDictionary *dict)
             factory = p1_display_video_source_create;
         else if ([type isEqualToString:@"capture"])
             factory = p1_capture_video_source_create;
+        else if ([type isEqualToString:@"pattern"])
+            factory = p1_pattern_video_source_create;
+        else if ([type isEqualToString:@"file"])
+            factory = p1_file_video_source_create;
 
         if (factory == NULL) {
             fprintf(stderr, "Invalid video source type.\n");
@@ -1,5 +1,6 @@
 #include "p1stream_priv.h"
 
+#include <errno.h>
 #include <math.h>
 #include <stdlib.h>
 #include <memory.h>
@@ -209,9 +210,8 @@ static void *p1_audio_main(void *data)
     P1Object *audioobj = (P1Object *) data;
     P1Context *ctx = audioobj->ctx;
     P1ContextFull *ctxf = (P1ContextFull *) ctx;
-    P1Connection *conn = ctx->conn;
-    P1Object *connobj = (P1Object *) conn;
     int ret;
+    int i;
 
     p1_object_lock(audioobj);
 
@@ -232,6 +232,7 @@ static void *p1_audio_main(void *data)
     audiof->mix_time = p1_get_time() - p1_audio_samples_to_time(ctxf, buf_center);
     audiof->out_pos = 0;
     audiof->out_time = audiof->mix_time;
+    memset(audiof->conn_pos, 0, sizeof(audiof->conn_pos));
 
     audioobj->state.current = P1_STATE_RUNNING;
     p1_object_notify(audioobj);
@@ -282,7 +283,13 @@ static void *p1_audio_main(void *data)
         // Streaming. The state test is a preliminary check. The state may change,
         // and the connection code does a final check itself, but checking here as
         // well saves us a bunch of processing.
-        if (connobj->state.current == P1_STATE_RUNNING) {
+        bool streaming = false;
+        for (i = 0; i < P1_NUM_CONNECTIONS; i++) {
+            P1Object *connobj = (P1Object *) p1_get_conn(ctx, i);
+            if (connobj->state.current == P1_STATE_RUNNING)
+                streaming = true;
+        }
+        if (streaming) {
             // Resample into the output buffer.
             p1_audio_resample(audiof, samples);
 
@@ -292,6 +299,7 @@ static void *p1_audio_main(void *data)
         else {
             // Clear output buffer.
             audiof->out_pos = 0;
+            memset(audiof->conn_pos, 0, sizeof(audiof->conn_pos));
         }
 
         // Remove the old samples.
@@ -359,37 +367,41 @@ static void p1_audio_shift_mix_buffer(P1AudioFull *audiof, size_t samples)
     memset(mix + mix_remaining, 0, samples * sizeof(float));
 }
 
-// Flush samples from the output buffer to the connection.
+// Flush samples from the output buffer to the connections. Each connection
+// encodes audio itself, and may take a different amount of samples.
 static void p1_audio_flush_out_buffer(P1AudioFull *audiof)
 {
     P1Audio *audio = (P1Audio *) audiof;
     P1Object *audioobj = (P1Object *) audio;
     P1Context *ctx = audioobj->ctx;
     P1ContextFull *ctxf = (P1ContextFull *) ctx;
-    P1Connection *conn = ctx->conn;
-    P1ConnectionFull *connf = (P1ConnectionFull *) conn;
+    size_t total_samples = audiof->out_pos;
+    size_t samples;
+    size_t pos;
+    int i;
 
-    // Send as many frames as we can.
-    size_t out_available = audiof->out_pos;
-    if (out_available == 0)
+    if (audiof->out_pos == 0)
         return;
 
-    int16_t *out = audiof->out;
-    size_t out_time = audiof->out_time;
-
-    size_t total_samples = 0;
-    size_t samples;
-    do {
-        samples = p1_conn_stream_audio(connf, out_time, out, out_available);
-        if (samples == 0)
-            break;
-
-        out += samples;
-        out_available -= samples;
-        out_time += p1_audio_samples_to_time(ctxf, samples);
+    // Send as many frames as we can.
+    for (i = 0; i < P1_NUM_CONNECTIONS; i++) {
+        P1ConnectionFull *connf = p1_get_conn(ctx, i);
+
+        pos = audiof->conn_pos[i];
+        while (pos < audiof->out_pos) {
+            samples = p1_conn_stream_audio(connf,
+                audiof->out_time + p1_audio_samples_to_time(ctxf, pos),
+                audiof->out + pos, audiof->out_pos - pos);
+            if (samples == 0)
+                break;
+
+            pos += samples;
+        }
+        audiof->conn_pos[i] = pos;
 
-        total_samples += samples;
-    } while(out_available);
+        if (pos < total_samples)
+            total_samples = pos;
+    }
 
     // Move remaining data up in the out buffer.
     if (total_samples == 0)
@@ -397,10 +409,13 @@ static void p1_audio_flush_out_buffer(P1AudioFull *audiof)
 
     size_t out_remaining = audiof->out_pos - total_samples;
     if (out_remaining)
-        memmove(out, out + total_samples, out_remaining * sizeof(int16_t));
+        memmove(audiof->out, audiof->out + total_samples, out_remaining * sizeof(int16_t));
+
+    for (i = 0; i < P1_NUM_CONNECTIONS; i++)
+        audiof->conn_pos[i] -= total_samples;
 
     audiof->out_pos = out_remaining;
-    audiof->out_time = out_time;
+    audiof->out_time += p1_audio_samples_to_time(ctxf, total_samples);
 }
 
 
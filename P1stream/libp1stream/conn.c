@@ -2,7 +2,9 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <sys/socket.h>
+#include <arpa/inet.h>
 
 // This is used for RTMP logging.
 static P1Object *current_conn = NULL;
@@ -16,12 +18,24 @@ static const int audio_bit_rate = 128 * 1024;
 static const int audio_out_min_size = 6144 / 8 * audio_num_channels;
 // Complete output buffer size, roughly two seconds.
 static const int audio_out_size = audio_out_min_size * 128;
+// Default number of pictures queued for the video encoder.
+static const int default_video_ring_size = 3;
+// Default quantizer offsets for static and changed macroblocks, when change
+// statistics are enabled. These are neutral, because the effect of offsets on
+// quality and bit rate has not been measured.
+static const float default_change_qp_static = 0.0f;
+static const float default_change_qp_changed = 0.0f;
 
 static bool p1_conn_parse_x264_param(P1Config *cfg, const char *key, const char *val, void *data);
 
 static bool p1_conn_stream_video_config(P1ConnectionFull *connf);
 static bool p1_conn_stream_audio_config(P1ConnectionFull *connf);
 
+static void *p1_conn_video_main(void *data);
+static bool p1_conn_encode_video(P1ConnectionFull *connf, x264_picture_t *pic);
+static void p1_conn_change_map(P1ConnectionFull *connf, x264_picture_t *pic);
+static void p1_conn_copy_picture(x264_picture_t *dst, const x264_picture_t *src, int height);
+
 static P1Packet *p1_conn_create_packet(P1ConnectionFull *connf, uint8_t type, uint32_t body_size);
 static bool p1_conn_submit_packet(P1ConnectionFull *connf, P1Packet *pkt, int64_t time);
 
@@ -33,6 +47,7 @@ static void p1_conn_stop_audio(P1ConnectionFull *connf);
 
 static bool p1_conn_start_video(P1ConnectionFull *connf);
 static void p1_conn_stop_video(P1ConnectionFull *connf);
+static void p1_conn_stop_video_thread(P1ConnectionFull *connf);
 
 static void p1_conn_signal(P1ConnectionFull *connf);
 static void p1_conn_clear(P1ListNode *head);
@@ -41,11 +56,13 @@ static void p1_conn_x264_log_callback(void *data, int level, const char *fmt, va
 static void p1_conn_rtmp_log_callback(int level, const char *fmt, va_list);
 
 
-bool p1_conn_init(P1ConnectionFull *connf, P1Context *ctx)
+bool p1_conn_init(P1ConnectionFull *connf, P1Context *ctx, int rendition)
 {
     P1Object *connobj = (P1Object *) connf;
     int ret;
 
+    connf->rendition = rendition;
+
     if (!p1_object_init(connobj, P1_OTYPE_CONNECTION, ctx))
         goto fail_object;
 
@@ -67,9 +84,20 @@ bool p1_conn_init(P1ConnectionFull *connf, P1Context *ctx)
         goto fail_video_lock;
     }
 
+    ret = pthread_cond_init(&connf->video_cond, NULL);
+    if (ret != 0) {
+        p1_log(connobj, P1_LOG_ERROR, "Failed to initialize condition variable: %s", strerror(ret));
+        goto fail_video_cond;
+    }
+
     return true;
 
 fail_params:
+    ret = pthread_cond_destroy(&connf->video_cond);
+    if (ret != 0)
+        p1_log(connobj, P1_LOG_ERROR, "Failed to destroy condition variable: %s", strerror(ret));
+
+fail_video_cond:
     ret = pthread_mutex_destroy(&connf->video_lock);
     if (ret != 0)
         p1_log(connobj, P1_LOG_ERROR, "Failed to destroy mutex: %s", strerror(ret));
@@ -104,6 +132,10 @@ void p1_conn_destroy(P1ConnectionFull *connf)
     if (ret != 0)
         p1_log(connobj, P1_LOG_ERROR, "Failed to destroy mutex: %s", strerror(ret));
 
+    ret = pthread_cond_destroy(&connf->video_cond);
+    if (ret != 0)
+        p1_log(connobj, P1_LOG_ERROR, "Failed to destroy condition variable: %s", strerror(ret));
+
     ret = pthread_cond_destroy(&connf->cond);
     if (ret != 0)
         p1_log(connobj, P1_LOG_ERROR, "Failed to destroy condition variable: %s", strerror(ret));
@@ -121,15 +153,48 @@ void p1_conn_config(P1ConnectionFull *connf, P1Config *cfg)
 
     p1_object_reset_config_flags(connobj);
 
-    // Grab URL.
-    if (!cfg->get_string(cfg, "url", connf->cfg_url, sizeof(connf->cfg_url))) {
-        p1_log(connobj, P1_LOG_ERROR, "Missing stream URL");
-        p1_object_clear_flag(connobj, P1_FLAG_CONFIG_VALID);
+    // Grab URL. Renditions without one are simply not used.
+    connf->cfg_enabled = cfg->get_string(cfg, "url", connf->cfg_url, sizeof(connf->cfg_url));
+    if (!connf->cfg_enabled) {
+        connf->cfg_url[0] = '\0';
+        if (connf->rendition == 0) {
+            p1_log(connobj, P1_LOG_ERROR, "Missing stream URL");
+            p1_object_clear_flag(connobj, P1_FLAG_CONFIG_VALID);
+        }
     }
 
     if (!cfg->get_int(cfg, "buffer-size", &connf->cfg_buffer_size))
         connf->cfg_buffer_size = 32 * 1024 * 1024;  // 32 MiB
 
+    // Pictures waiting for the encoder, and which to drop when it lags.
+    if (!cfg->get_int(cfg, "video-queue-size", &connf->cfg_video_ring_size))
+        connf->cfg_video_ring_size = default_video_ring_size;
+    if (connf->cfg_video_ring_size < 1) {
+        p1_log(connobj, P1_LOG_ERROR, "Invalid video queue size");
+        p1_object_clear_flag(connobj, P1_FLAG_CONFIG_VALID);
+    }
+
+    connf->cfg_video_ring_drop = P1_VIDEO_RING_DROP_OLDEST;
+    if (cfg->get_string(cfg, "video-queue-drop", s_tmp, sizeof(s_tmp))) {
+        if (strcmp(s_tmp, "newest") == 0) {
+            connf->cfg_video_ring_drop = P1_VIDEO_RING_DROP_NEWEST;
+        }
+        else if (strcmp(s_tmp, "oldest") != 0) {
+            p1_log(connobj, P1_LOG_ERROR, "Invalid video queue drop policy '%s'", s_tmp);
+            p1_object_clear_flag(connobj, P1_FLAG_CONFIG_VALID);
+        }
+    }
+
+    // Statistics on the share of macroblocks that change between pictures.
+    // Non-zero quantizer offsets additionally steer x264 bits to the changed
+    // macroblocks. This is experimental, the offsets are unmeasured.
+    if (!cfg->get_bool(cfg, "video-change-stats", &connf->cfg_change_stats))
+        connf->cfg_change_stats = false;
+    if (!cfg->get_float(cfg, "video-change-qp-static", &connf->cfg_change_qp_static))
+        connf->cfg_change_qp_static = default_change_qp_static;
+    if (!cfg->get_float(cfg, "video-change-qp-changed", &connf->cfg_change_qp_changed))
+        connf->cfg_change_qp_changed = default_change_qp_changed;
+
     // x264 already logs errors, except for x264_param_parse.
 
     x264_param_default(vp);
@@ -176,6 +241,13 @@ void p1_conn_config(P1ConnectionFull *connf, P1Config *cfg)
             p1_object_set_flag(connobj, P1_FLAG_NEEDS_RESTART);
         if (connf->cfg_buffer_size != connf->buffer_size)
             p1_object_set_flag(connobj, P1_FLAG_NEEDS_RESTART);
+        if (connf->cfg_video_ring_size != connf->video_ring_size ||
+            connf->cfg_video_ring_drop != connf->video_ring_drop)
+            p1_object_set_flag(connobj, P1_FLAG_NEEDS_RESTART);
+        if (connf->cfg_change_stats != connf->change_stats ||
+            connf->cfg_change_qp_static != connf->change_qp_static ||
+            connf->cfg_change_qp_changed != connf->change_qp_changed)
+            p1_object_set_flag(connobj, P1_FLAG_NEEDS_RESTART);
     }
 
     p1_object_notify(connobj);
@@ -209,12 +281,16 @@ void p1_conn_notify(P1ConnectionFull *connf, P1Notification *n)
     P1Object *audioobj = (P1Object *) ctx->audio;
     P1Object *videoobj = (P1Object *) ctx->video;
     P1Object *vclockobj = (P1Object *) ctx->video->clock;
+    P1VideoFull *videof = (P1VideoFull *) ctx->video;
 
     p1_object_reset_notify_flags(connobj);
 
+    // Renditions also need the video mixer to produce their pictures.
     if (audioobj->state.current  != P1_STATE_RUNNING ||
         videoobj->state.current  != P1_STATE_RUNNING ||
-        !vclockobj || vclockobj->state.current != P1_STATE_RUNNING) {
+        !vclockobj || vclockobj->state.current != P1_STATE_RUNNING ||
+        !connf->cfg_enabled ||
+        (connf->rendition != 0 && videof->renditions[connf->rendition - 1].width == 0)) {
         p1_object_clear_flag(connobj, P1_FLAG_CAN_START);
 
         if (connobj->state.current == P1_STATE_STARTING ||
@@ -330,12 +406,14 @@ static bool p1_conn_stream_video_config(P1ConnectionFull *connf)
     return p1_conn_submit_packet(connf, pkt, 0);
 }
 
-// Encode and send video data
+// Queue a picture for the encoder thread. The picture is copied, so the
+// caller may reuse it immediately.
 void p1_conn_stream_video(P1ConnectionFull *connf, int64_t time, x264_picture_t *pic)
 {
     P1Object *connobj = (P1Object *) connf;
+    x264_picture_t *slot;
+    int ret;
 
-    // Encode and build packet using fine-grained lock.
     p1_lock(connobj, &connf->video_lock);
 
     if (connobj->state.current != P1_STATE_RUNNING) {
@@ -343,8 +421,108 @@ void p1_conn_stream_video(P1ConnectionFull *connf, int64_t time, x264_picture_t
         return;
     }
 
-    pic->i_dts = time;
-    pic->i_pts = time;
+    // Make room if the encoder is lagging.
+    if (connf->video_ring_used == connf->video_ring_size) {
+        if (!connf->video_ring_lagging) {
+            p1_log(connobj, P1_LOG_WARNING, "Video encoder lagging, dropping frames!");
+            connf->video_ring_lagging = true;
+        }
+        connf->video_ring_dropped++;
+
+        if (connf->video_ring_drop == P1_VIDEO_RING_DROP_NEWEST) {
+            p1_unlock(connobj, &connf->video_lock);
+            return;
+        }
+
+        connf->video_ring_read = (connf->video_ring_read + 1) % connf->video_ring_size;
+        connf->video_ring_used--;
+    }
+
+    slot = &connf->video_ring[(connf->video_ring_read + connf->video_ring_used) % connf->video_ring_size];
+    p1_conn_copy_picture(slot, pic, connf->video_height);
+    slot->i_dts = time;
+    slot->i_pts = time;
+    connf->video_ring_used++;
+
+    ret = pthread_cond_signal(&connf->video_cond);
+    if (ret != 0)
+        p1_log(connobj, P1_LOG_ERROR, "Failed to signal encoder thread: %s", strerror(ret));
+
+    p1_unlock(connobj, &connf->video_lock);
+}
+
+// The main loop of the encoder thread.
+static void *p1_conn_video_main(void *data)
+{
+    P1ConnectionFull *connf = (P1ConnectionFull *) data;
+    P1Object *connobj = (P1Object *) data;
+    x264_picture_t tmp;
+    x264_picture_t *slot;
+    int ret;
+
+    p1_lock(connobj, &connf->video_lock);
+
+    while (true) {
+        while (!connf->video_thread_stop && connf->video_ring_used == 0) {
+            ret = pthread_cond_wait(&connf->video_cond, &connf->video_lock);
+            if (ret != 0) {
+                p1_log(connobj, P1_LOG_ERROR, "Failed to wait on condition: %s", strerror(ret));
+                break;
+            }
+        }
+
+        if (connf->video_thread_stop)
+            break;
+
+        // Take the oldest picture by swapping buffers with the slot, so the
+        // slot can be reused while we encode. With the change map, the last
+        // encoded picture is kept for comparison, and the one before it goes
+        // back to the slot.
+        slot = &connf->video_ring[connf->video_ring_read];
+        if (connf->change_stats) {
+            tmp = connf->video_prev;
+            connf->video_prev = connf->video_pic;
+        }
+        else {
+            tmp = connf->video_pic;
+        }
+        connf->video_pic = *slot;
+        *slot = tmp;
+
+        connf->video_ring_read = (connf->video_ring_read + 1) % connf->video_ring_size;
+        connf->video_ring_used--;
+        if (connf->video_ring_used == 0)
+            connf->video_ring_lagging = false;
+
+        p1_unlock(connobj, &connf->video_lock);
+
+        if (connf->change_stats)
+            p1_conn_change_map(connf, &connf->video_pic);
+
+        if (!p1_conn_encode_video(connf, &connf->video_pic)) {
+            p1_object_lock(connobj);
+            if (connobj->state.current == P1_STATE_RUNNING) {
+                connobj->state.current = P1_STATE_STOPPING;
+                connobj->state.flags |= P1_FLAG_ERROR;
+                p1_object_notify(connobj);
+                p1_conn_signal(connf);
+            }
+            p1_object_unlock(connobj);
+        }
+
+        p1_lock(connobj, &connf->video_lock);
+    }
+
+    p1_unlock(connobj, &connf->video_lock);
+
+    return NULL;
+}
+
+// Encode and send video data. Only called on the encoder thread.
+static bool p1_conn_encode_video(P1ConnectionFull *connf, x264_picture_t *pic)
+{
+    P1Object *connobj = (P1Object *) connf;
+    int64_t time;
 
     x264_nal_t *nals;
     int len;
@@ -352,7 +530,14 @@ void p1_conn_stream_video(P1ConnectionFull *connf, int64_t time, x264_picture_t
     int ret = x264_encoder_encode(connf->video_enc, &nals, &len, pic, &out_pic);
     if (ret < 0) {
         p1_log(connobj, P1_LOG_ERROR, "Failed to H.264 encode frame");
-        goto fail;
+        return false;
+    }
+
+    // Pictures still in the lookahead are already past this keyframe.
+    if (connf->change_stats) {
+        connf->video_prev_valid = true;
+        if (ret > 0 && out_pic.b_keyframe)
+            connf->change_frames_since_key = x264_encoder_delayed_frames(connf->video_enc);
     }
 
     time = out_pic.i_dts;
@@ -360,15 +545,13 @@ void p1_conn_stream_video(P1ConnectionFull *connf, int64_t time, x264_picture_t
     uint32_t size = 0;
     for (int i = 0; i < len; i++)
         size += nals[i].i_payload;
-    if (size == 0) {
-        p1_unlock(connobj, &connf->video_lock);
-        return;
-    }
+    if (size == 0)
+        return true;
 
     const uint32_t tag_size = size + 5;
     P1Packet *pkt = p1_conn_create_packet(connf, RTMP_PACKET_TYPE_VIDEO, tag_size);
     if (pkt == NULL)
-        goto fail;
+        return false;
     char *body = pkt->meta.m_body;
 
     body[0] = (out_pic.b_keyframe ? 0x10 : 0x20) | 0x07; // keyframe/IDR, AVC
@@ -377,7 +560,7 @@ void p1_conn_stream_video(P1ConnectionFull *connf, int64_t time, x264_picture_t
     // Calculate composition time.
     int64_t cts = out_pic.i_pts - out_pic.i_dts;
     if (cts < 0) {
-        p1_log(connobj, P1_LOG_ERROR, "Negative CTS: %lld", cts);
+        p1_log(connobj, P1_LOG_ERROR, "Negative CTS: %lld", (long long) cts);
         cts = 0;
     }
     // Encode.
@@ -387,8 +570,6 @@ void p1_conn_stream_video(P1ConnectionFull *connf, int64_t time, x264_picture_t
 
     memcpy(body + 5, nals[0].p_payload, size);
 
-    p1_unlock(connobj, &connf->video_lock);
-
     // Stream using full lock.
     p1_object_lock(connobj);
 
@@ -399,21 +580,65 @@ void p1_conn_stream_video(P1ConnectionFull *connf, int64_t time, x264_picture_t
 
     p1_object_unlock(connobj);
 
-    return;
+    return true;
+}
 
-fail:
-    p1_unlock(connobj, &connf->video_lock);
+// Count the macroblocks of a picture that changed since the previous, and set
+// quantizer offsets from them if configured. Only called on the encoder thread.
+static void p1_conn_change_map(P1ConnectionFull *connf, x264_picture_t *pic)
+{
+    int changed, i;
 
-    p1_object_lock(connobj);
-    if (connobj->state.current == P1_STATE_RUNNING) {
-        connobj->state.current = P1_STATE_STOPPING;
-        connobj->state.flags |= P1_FLAG_ERROR;
-        p1_object_notify(connobj);
-        p1_conn_signal(connf);
-    }
-    p1_object_unlock(connobj);
+    pic->prop.quant_offsets = NULL;
+    pic->prop.quant_offsets_free = NULL;
+
+    // There's nothing to compare the first picture to. Expected keyframes are
+    // left alone, because static areas are not refreshed until the next.
+    connf->change_frames_since_key++;
+    if (!connf->video_prev_valid || connf->change_frames_since_key >= connf->change_keyint)
+        return;
+
+    changed = p1_video_change_map(connf->change_mbs, pic, &connf->video_prev,
+                                  connf->video_width, connf->video_height);
+
+    connf->change_frames++;
+    connf->change_mbs_total += connf->change_mb_count;
+    connf->change_mbs_changed += changed;
+
+    // Offsets only shift bits around when there's a mix.
+    if (changed == 0 || changed == connf->change_mb_count ||
+        (connf->change_qp_static == 0.0f && connf->change_qp_changed == 0.0f))
+        return;
+
+    for (i = 0; i < connf->change_mb_count; i++)
+        connf->change_offsets[i] = connf->change_mbs[i] ? connf->change_qp_changed : connf->change_qp_static;
+
+    // x264 reads the offsets during x264_encoder_encode, so we can simply
+    // reuse the array for the next picture.
+    pic->prop.quant_offsets = connf->change_offsets;
 }
 
+// Copy the planes of an NV12 picture.
+static void p1_conn_copy_picture(x264_picture_t *dst, const x264_picture_t *src, int height)
+{
+    int plane, y, rows;
+    size_t row_size;
+
+    for (plane = 0; plane < 2; plane++) {
+        rows = plane ? height / 2 : height;
+        row_size = (size_t) (dst->img.i_stride[plane] < src->img.i_stride[plane] ?
+                             dst->img.i_stride[plane] : src->img.i_stride[plane]);
+
+        if (dst->img.i_stride[plane] == src->img.i_stride[plane]) {
+            memcpy(dst->img.plane[plane], src->img.plane[plane], row_size * rows);
+            continue;
+        }
+
+        for (y = 0; y < rows; y++)
+            memcpy(dst->img.plane[plane] + y * dst->img.i_stride[plane],
+                   src->img.plane[plane] + y * src->img.i_stride[plane], row_size);
+    }
+}
 
 
 // Send audio configuration. This happens during the starting state, so we
@@ -676,9 +901,11 @@ static void *p1_conn_main(void *data)
     p1_object_unlock(connobj);
     ret = RTMP_Connect(r, NULL);
     if (ret) {
+#ifdef SO_NOSIGPIPE
         int tmp = 1;
         ret = setsockopt(r->m_sb.sb_socket, SOL_SOCKET, SO_NOSIGPIPE, &tmp, sizeof(int));
         ret = (ret == 0);
+#endif
         if (ret)
             ret = RTMP_ConnectStream(r, 0);
     }
@@ -730,6 +957,8 @@ static void *p1_conn_main(void *data)
     p1_log(connobj, P1_LOG_INFO, "Disconnected.");
 
 cleanup:
+    p1_conn_stop_video_thread(connf);
+
     p1_lock(connobj, &connf->audio_lock);
     p1_lock(connobj, &connf->video_lock);
 
@@ -894,8 +1123,21 @@ static bool p1_conn_start_video(P1ConnectionFull *connf)
     P1Context *ctx = connobj->ctx;
     P1ContextFull *ctxf = (P1ContextFull *) ctx;
     P1Video *video = ctx->video;
+    P1VideoFull *videof = (P1VideoFull *) video;
     P1VideoClock *vclock = video->clock;
     x264_param_t vp;
+    int ret;
+    int i;
+
+    // Renditions encode their own picture size.
+    if (connf->rendition == 0) {
+        connf->video_width = video->width;
+        connf->video_height = video->height;
+    }
+    else {
+        connf->video_width = videof->renditions[connf->rendition - 1].width;
+        connf->video_height = videof->renditions[connf->rendition - 1].height;
+    }
 
     memcpy(&connf->video_params, &connf->cfg_video_params, sizeof(x264_param_t));
     memcpy(&vp, &connf->video_params, sizeof(x264_param_t));
@@ -910,8 +1152,9 @@ static bool p1_conn_start_video(P1ConnectionFull *connf)
     vp.b_aud = 1;
     vp.b_annexb = 0;
 
-    vp.i_width = video->width;
-    vp.i_height = video->height;
+    vp.i_width = connf->video_width;
+    vp.i_height = connf->video_height;
+    vp.i_csp = X264_CSP_NV12;
 
     vp.i_fps_num = vclock->fps_num;
     vp.i_fps_den = vclock->fps_den;
@@ -924,14 +1167,148 @@ static bool p1_conn_start_video(P1ConnectionFull *connf)
     connf->video_enc = x264_encoder_open(&vp);
     if (connf->video_enc == NULL) {
         p1_log(connobj, P1_LOG_ERROR, "Failed to open x264 encoder");
-        return false;
+        goto fail_enc;
+    }
+
+    // Allocate the picture queue, plus one picture held by the encoder.
+    connf->video_ring_size = connf->cfg_video_ring_size;
+    connf->video_ring_drop = connf->cfg_video_ring_drop;
+    connf->video_ring_read = 0;
+    connf->video_ring_used = 0;
+    connf->video_ring_dropped = 0;
+    connf->video_ring_lagging = false;
+
+    connf->video_ring = calloc(connf->video_ring_size, sizeof(x264_picture_t));
+    if (connf->video_ring == NULL) {
+        p1_log(connobj, P1_LOG_ERROR, "Failed to allocate video queue");
+        goto fail_queue;
+    }
+
+    for (i = 0; i <= connf->video_ring_size; i++) {
+        x264_picture_t *pic = (i == connf->video_ring_size) ?
+            &connf->video_pic : &connf->video_ring[i];
+
+        ret = x264_picture_alloc(pic, X264_CSP_NV12, connf->video_width, connf->video_height);
+        if (ret < 0) {
+            p1_log(connobj, P1_LOG_ERROR, "Failed to alloc x264 picture buffer");
+            goto fail_pics;
+        }
+    }
+
+    // Change map buffers, plus the previous picture.
+    connf->change_stats = connf->cfg_change_stats;
+    connf->change_qp_static = connf->cfg_change_qp_static;
+    connf->change_qp_changed = connf->cfg_change_qp_changed;
+    if (connf->change_stats) {
+        if (connf->change_qp_static == 0.0f && connf->change_qp_changed == 0.0f)
+            p1_log(connobj, P1_LOG_WARNING, "Change statistics cost a picture copy and comparison per frame, "
+                   "but without quantizer offsets they don't affect encoding");
+
+        connf->video_prev_valid = false;
+        connf->change_mb_count = ((connf->video_width + 15) / 16) * ((connf->video_height + 15) / 16);
+        connf->change_keyint = vp.i_keyint_max;
+        connf->change_frames_since_key = 0;
+        connf->change_frames = 0;
+        connf->change_mbs_total = 0;
+        connf->change_mbs_changed = 0;
+
+        ret = x264_picture_alloc(&connf->video_prev, X264_CSP_NV12, connf->video_width, connf->video_height);
+        if (ret < 0) {
+            p1_log(connobj, P1_LOG_ERROR, "Failed to alloc x264 picture buffer");
+            goto fail_pics;
+        }
+
+        connf->change_mbs = malloc(connf->change_mb_count);
+        connf->change_offsets = malloc(connf->change_mb_count * sizeof(float));
+        if (connf->change_mbs == NULL || connf->change_offsets == NULL) {
+            p1_log(connobj, P1_LOG_ERROR, "Failed to allocate change map");
+            goto fail_change;
+        }
+    }
+
+    // The thread blocks on the video lock until startup is complete.
+    connf->video_thread_stop = false;
+    ret = pthread_create(&connf->video_thread, NULL, p1_conn_video_main, connf);
+    if (ret != 0) {
+        p1_log(connobj, P1_LOG_ERROR, "Failed to start encoder thread: %s", strerror(ret));
+        goto fail_change;
     }
 
     return true;
+
+fail_change:
+    if (connf->change_stats) {
+        free(connf->change_mbs);
+        free(connf->change_offsets);
+        connf->change_mbs = NULL;
+        connf->change_offsets = NULL;
+        x264_picture_clean(&connf->video_prev);
+    }
+
+fail_pics:
+    while (i-- > 0) {
+        x264_picture_clean((i == connf->video_ring_size) ?
+            &connf->video_pic : &connf->video_ring[i]);
+    }
+
+    free(connf->video_ring);
+
+fail_queue:
+    x264_encoder_close(connf->video_enc);
+
+fail_enc:
+    return false;
+}
+
+// Stop the encoder thread. Called before cleanup acquires the encoding locks,
+// because the thread needs the full lock to submit packets.
+static void p1_conn_stop_video_thread(P1ConnectionFull *connf)
+{
+    P1Object *connobj = (P1Object *) connf;
+    int ret;
+
+    p1_lock(connobj, &connf->video_lock);
+    connf->video_thread_stop = true;
+    ret = pthread_cond_signal(&connf->video_cond);
+    if (ret != 0)
+        p1_log(connobj, P1_LOG_ERROR, "Failed to signal encoder thread: %s", strerror(ret));
+    p1_unlock(connobj, &connf->video_lock);
+
+    p1_object_unlock(connobj);
+    ret = pthread_join(connf->video_thread, NULL);
+    if (ret != 0)
+        p1_log(connobj, P1_LOG_ERROR, "Failed to stop encoder thread: %s", strerror(ret));
+    p1_object_lock(connobj);
 }
 
 static void p1_conn_stop_video(P1ConnectionFull *connf)
 {
+    P1Object *connobj = (P1Object *) connf;
+    int i;
+
+    if (connf->video_ring_dropped != 0)
+        p1_log(connobj, P1_LOG_WARNING, "Dropped %llu video frames while encoder was lagging",
+               (unsigned long long) connf->video_ring_dropped);
+
+    for (i = 0; i < connf->video_ring_size; i++)
+        x264_picture_clean(&connf->video_ring[i]);
+    x264_picture_clean(&connf->video_pic);
+    free(connf->video_ring);
+    connf->video_ring = NULL;
+
+    if (connf->change_stats) {
+        if (connf->change_mbs_total != 0)
+            p1_log(connobj, P1_LOG_INFO, "Change statistics: %.1f%% of macroblocks changed over %llu frames",
+                   100.0 * connf->change_mbs_changed / connf->change_mbs_total,
+                   (unsigned long long) connf->change_frames);
+
+        x264_picture_clean(&connf->video_prev);
+        free(connf->change_mbs);
+        free(connf->change_offsets);
+        connf->change_mbs = NULL;
+        connf->change_offsets = NULL;
+    }
+
     x264_encoder_close(connf->video_enc);
 }
 
@@ -0,0 +1,285 @@
+#include "p1stream_priv.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Ticks are scheduled at absolute deadlines, computed from the start time and
+// the frame count with integer math, so the clock does not drift no matter
+// how long it runs or how late individual wakeups are.
+
+// Lateness after which the schedule restarts from the current time, instead
+// of skipping deadlines one by one. (After a suspend, for example.)
+static const int64_t max_catch_up = 1000000000;
+
+typedef struct _P1TimerVideoClock P1TimerVideoClock;
+
+struct _P1TimerVideoClock {
+    P1VideoClock super;
+
+    int cfg_fps_num;
+    int cfg_fps_den;
+
+    pthread_t thread;
+    bool thread_started;
+
+    // The schedule. Deadline n is origin + n * period, where the period is
+    // fps_den / fps_num seconds. The origin moves forward a whole number of
+    // seconds every fps_num frames, so n stays small.
+    int64_t origin;
+    uint32_t frame;
+
+    P1TimerClockStats stats;
+};
+
+static bool p1_timer_video_clock_init(P1TimerVideoClock *tvclock, P1Context *ctx);
+static void p1_timer_video_clock_config(P1Plugin *pel, P1Config *cfg);
+static void p1_timer_video_clock_free(P1Plugin *pel);
+static void p1_timer_video_clock_start(P1Plugin *pel);
+static void p1_timer_video_clock_stop(P1Plugin *pel);
+static void p1_timer_video_clock_join(P1TimerVideoClock *tvclock);
+static int64_t p1_timer_video_clock_deadline(P1TimerVideoClock *tvclock);
+static void p1_timer_video_clock_advance(P1TimerVideoClock *tvclock);
+static void *p1_timer_video_clock_main(void *data);
+
+
+P1VideoClock *p1_timer_video_clock_create(P1Context *ctx)
+{
+    P1TimerVideoClock *tvclock = calloc(1, sizeof(P1TimerVideoClock));
+
+    if (tvclock) {
+        if (!p1_timer_video_clock_init(tvclock, ctx)) {
+            free(tvclock);
+            tvclock = NULL;
+        }
+    }
+
+    return (P1VideoClock *) tvclock;
+}
+
+void p1_timer_video_clock_stats(P1VideoClock *vclock, P1TimerClockStats *stats)
+{
+    P1TimerVideoClock *tvclock = (P1TimerVideoClock *) vclock;
+    P1Object *obj = (P1Object *) vclock;
+
+    p1_object_lock(obj);
+    *stats = tvclock->stats;
+    p1_object_unlock(obj);
+}
+
+static bool p1_timer_video_clock_init(P1TimerVideoClock *tvclock, P1Context *ctx)
+{
+    P1VideoClock *vclock = (P1VideoClock *) tvclock;
+    P1Plugin *pel = (P1Plugin *) tvclock;
+
+    if (!p1_video_clock_init(vclock, ctx))
+        return false;
+
+    pel->config = p1_timer_video_clock_config;
+    pel->free = p1_timer_video_clock_free;
+    pel->start = p1_timer_video_clock_start;
+    pel->stop = p1_timer_video_clock_stop;
+
+    return true;
+}
+
+static void p1_timer_video_clock_config(P1Plugin *pel, P1Config *cfg)
+{
+    P1TimerVideoClock *tvclock = (P1TimerVideoClock *) pel;
+    P1VideoClock *vclock = (P1VideoClock *) pel;
+    P1Object *obj = (P1Object *) pel;
+
+    if (!cfg->get_int(cfg, "fps-num", &tvclock->cfg_fps_num))
+        tvclock->cfg_fps_num = 30;
+    if (!cfg->get_int(cfg, "fps-den", &tvclock->cfg_fps_den))
+        tvclock->cfg_fps_den = 1;
+
+    // Deadlines are calculated as frame * fps_den * 10^9 / fps_num, with
+    // frame < fps_num, and this must fit in 64 bits.
+    if (tvclock->cfg_fps_num <= 0 || tvclock->cfg_fps_den <= 0 ||
+        (uint64_t) tvclock->cfg_fps_num * tvclock->cfg_fps_den > INT64_MAX / 1000000000) {
+        p1_log(obj, P1_LOG_ERROR, "Invalid frame rate %d/%d", tvclock->cfg_fps_num, tvclock->cfg_fps_den);
+        p1_object_clear_flag(obj, P1_FLAG_CONFIG_VALID);
+        return;
+    }
+
+    if ((uint32_t) tvclock->cfg_fps_num != vclock->fps_num ||
+        (uint32_t) tvclock->cfg_fps_den != vclock->fps_den)
+        p1_object_set_flag(obj, P1_FLAG_NEEDS_RESTART);
+}
+
+static void p1_timer_video_clock_free(P1Plugin *pel)
+{
+    P1TimerVideoClock *tvclock = (P1TimerVideoClock *) pel;
+
+    p1_timer_video_clock_join(tvclock);
+    free(tvclock);
+}
+
+static void p1_timer_video_clock_start(P1Plugin *pel)
+{
+    P1TimerVideoClock *tvclock = (P1TimerVideoClock *) pel;
+    P1VideoClock *vclock = (P1VideoClock *) pel;
+    P1Object *obj = (P1Object *) pel;
+    int ret;
+
+    // Reap the thread of a previous run.
+    p1_timer_video_clock_join(tvclock);
+
+    vclock->fps_num = (uint32_t) tvclock->cfg_fps_num;
+    vclock->fps_den = (uint32_t) tvclock->cfg_fps_den;
+    memset(&tvclock->stats, 0, sizeof(P1TimerClockStats));
+
+    // The first tick is one frame from now.
+    tvclock->origin = (int64_t) p1_get_time();
+    tvclock->frame = 0;
+    p1_timer_video_clock_advance(tvclock);
+
+    ret = pthread_create(&tvclock->thread, NULL, p1_timer_video_clock_main, tvclock);
+    if (ret != 0) {
+        p1_log(obj, P1_LOG_ERROR, "Failed to start clock thread: %s", strerror(ret));
+        obj->state.current = P1_STATE_IDLE;
+        obj->state.flags |= P1_FLAG_ERROR;
+    }
+    else {
+        // Thread will continue start, and set state to running.
+        tvclock->thread_started = true;
+        obj->state.current = P1_STATE_STARTING;
+    }
+
+    p1_object_notify(obj);
+}
+
+static void p1_timer_video_clock_stop(P1Plugin *pel)
+{
+    P1Object *obj = (P1Object *) pel;
+
+    // Just set to stopping, the thread will do the rest after its next
+    // wakeup, which is at most a frame away.
+    obj->state.current = P1_STATE_STOPPING;
+    p1_object_notify(obj);
+}
+
+static void p1_timer_video_clock_join(P1TimerVideoClock *tvclock)
+{
+    P1Object *obj = (P1Object *) tvclock;
+    int ret;
+
+    if (!tvclock->thread_started)
+        return;
+
+    ret = pthread_join(tvclock->thread, NULL);
+    if (ret != 0)
+        p1_log(obj, P1_LOG_ERROR, "Failed to stop clock thread: %s", strerror(ret));
+
+    tvclock->thread_started = false;
+}
+
+// Get the current deadline, in nanoseconds.
+static int64_t p1_timer_video_clock_deadline(P1TimerVideoClock *tvclock)
+{
+    P1VideoClock *vclock = (P1VideoClock *) tvclock;
+
+    return tvclock->origin + (int64_t) ((uint64_t) tvclock->frame * vclock->fps_den * 1000000000 / vclock->fps_num);
+}
+
+// Move to the next deadline.
+static void p1_timer_video_clock_advance(P1TimerVideoClock *tvclock)
+{
+    P1VideoClock *vclock = (P1VideoClock *) tvclock;
+
+    if (++tvclock->frame == vclock->fps_num) {
+        tvclock->frame = 0;
+        tvclock->origin += (int64_t) vclock->fps_den * 1000000000;
+    }
+}
+
+// The main loop of the clock thread.
+static void *p1_timer_video_clock_main(void *data)
+{
+    P1TimerVideoClock *tvclock = (P1TimerVideoClock *) data;
+    P1VideoClock *vclock = (P1VideoClock *) data;
+    P1Object *obj = (P1Object *) data;
+    P1TimerClockStats *stats = &tvclock->stats;
+    struct timespec ts;
+    int64_t deadline, now, lateness;
+    int skipped;
+    int ret;
+
+    p1_object_lock(obj);
+
+    if (obj->state.current == P1_STATE_STARTING) {
+        obj->state.current = P1_STATE_RUNNING;
+        p1_object_notify(obj);
+    }
+
+    while (obj->state.current == P1_STATE_RUNNING) {
+        deadline = p1_timer_video_clock_deadline(tvclock);
+
+        p1_object_unlock(obj);
+
+        ts.tv_sec = deadline / 1000000000;
+        ts.tv_nsec = deadline % 1000000000;
+        do {
+            ret = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        } while (ret == EINTR);
+        now = (int64_t) p1_get_time();
+
+        p1_object_lock(obj);
+
+        if (ret != 0) {
+            p1_log(obj, P1_LOG_ERROR, "Failed to wait for clock deadline: %s", strerror(ret));
+            obj->state.flags |= P1_FLAG_ERROR;
+            break;
+        }
+
+        if (obj->state.current != P1_STATE_RUNNING)
+            break;
+
+        lateness = now - deadline;
+        stats->ticks++;
+        stats->lateness_total += lateness;
+        if (lateness > stats->lateness_max)
+            stats->lateness_max = lateness;
+
+        // Skip deadlines that have already passed, rather than ticking in a
+        // burst. The mixer repeats frames to fill the gap.
+        p1_timer_video_clock_advance(tvclock);
+        if (lateness > max_catch_up) {
+            p1_log(obj, P1_LOG_WARNING, "Clock fell behind by %.1f ms, restarting schedule", lateness / 1e6);
+            stats->missed += (uint64_t) (lateness / 1e9 * vclock->fps_num / vclock->fps_den);
+            tvclock->origin = now;
+            tvclock->frame = 0;
+            p1_timer_video_clock_advance(tvclock);
+        }
+        else {
+            skipped = 0;
+            while (p1_timer_video_clock_deadline(tvclock) <= now) {
+                p1_timer_video_clock_advance(tvclock);
+                skipped++;
+            }
+            if (skipped != 0) {
+                stats->missed += skipped;
+                p1_log(obj, P1_LOG_DEBUG, "Clock woke %.3f ms late, skipped %d deadlines",
+                       lateness / 1e6, skipped);
+            }
+        }
+
+        p1_object_unlock(obj);
+        p1_video_clock_tick(vclock, deadline);
+        p1_object_lock(obj);
+    }
+
+    if (stats->ticks != 0) {
+        p1_log(obj, P1_LOG_INFO, "Clock ticked %llu times, lateness mean %.3f ms, max %.3f ms, %llu deadlines missed",
+               (unsigned long long) stats->ticks, stats->lateness_total / 1e6 / stats->ticks,
+               stats->lateness_max / 1e6, (unsigned long long) stats->missed);
+    }
+
+    obj->state.current = P1_STATE_IDLE;
+    p1_object_notify(obj);
+
+    p1_object_unlock(obj);
+
+    return NULL;
+}
@@ -0,0 +1,281 @@
+#define _GNU_SOURCE
+#include "p1stream_priv.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Maximum number of released buffers kept around for reuse.
+static const int max_free_buffers = 4;
+
+struct _P1FramePool {
+    P1Object *obj;
+    pthread_mutex_t lock;
+
+    // Released buffers, ready for reuse.
+    P1FrameBuffer *free_list;
+    int num_free;
+
+    // Buffers handed out and not yet released. The pool itself is freed once
+    // these are gone.
+    int outstanding;
+    bool dead;
+};
+
+static P1FrameBuffer *p1_frame_buffer_map(P1FramePool *pool, int fd, int width, int height, size_t stride);
+static void p1_frame_buffer_destroy(P1FrameBuffer *fb);
+static void p1_frame_buffer_release_ref(void *ref);
+static void p1_frame_pool_destroy(P1FramePool *pool);
+
+
+P1FramePool *p1_frame_pool_create(P1Object *obj)
+{
+    P1FramePool *pool;
+    int ret;
+
+    pool = calloc(1, sizeof(P1FramePool));
+    if (pool == NULL) {
+        p1_log(obj, P1_LOG_ERROR, "Failed to allocate frame pool");
+        goto fail_alloc;
+    }
+
+    pool->obj = obj;
+
+    ret = pthread_mutex_init(&pool->lock, NULL);
+    if (ret != 0) {
+        p1_log(obj, P1_LOG_ERROR, "Failed to initialize mutex: %s", strerror(ret));
+        goto fail_lock;
+    }
+
+    return pool;
+
+fail_lock:
+    free(pool);
+
+fail_alloc:
+    return NULL;
+}
+
+void p1_frame_pool_free(P1FramePool *pool)
+{
+    P1FrameBuffer *fb;
+    bool idle;
+
+    p1_lock(pool->obj, &pool->lock);
+
+    pool->dead = true;
+    while ((fb = pool->free_list) != NULL) {
+        pool->free_list = fb->next;
+        p1_frame_buffer_destroy(fb);
+    }
+    pool->num_free = 0;
+    idle = (pool->outstanding == 0);
+
+    p1_unlock(pool->obj, &pool->lock);
+
+    // Otherwise, the last release frees the pool.
+    if (idle)
+        p1_frame_pool_destroy(pool);
+}
+
+P1FrameBuffer *p1_frame_pool_get(P1FramePool *pool, int width, int height)
+{
+    P1Object *obj = pool->obj;
+    size_t stride = (size_t) width * 4;
+    P1FrameBuffer **prev;
+    P1FrameBuffer *fb;
+    int fd;
+
+    if (width <= 0 || height <= 0) {
+        p1_log(obj, P1_LOG_ERROR, "Invalid frame dimensions %dx%d", width, height);
+        return NULL;
+    }
+
+    // Look for a released buffer of the same size.
+    p1_lock(obj, &pool->lock);
+    for (prev = &pool->free_list; (fb = *prev) != NULL; prev = &fb->next) {
+        if (fb->width == width && fb->height == height && fb->stride == stride) {
+            *prev = fb->next;
+            pool->num_free--;
+            pool->outstanding++;
+            break;
+        }
+    }
+    p1_unlock(obj, &pool->lock);
+
+    if (fb != NULL) {
+        fb->next = NULL;
+        fb->refcount = 1;
+        return fb;
+    }
+
+    fd = memfd_create("p1stream-frame", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        p1_log(obj, P1_LOG_ERROR, "Failed to create shared memory: %s", strerror(errno));
+        return NULL;
+    }
+
+    if (ftruncate(fd, (off_t) (stride * height)) != 0) {
+        p1_log(obj, P1_LOG_ERROR, "Failed to size shared memory: %s", strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    // Whoever we pass the descriptor to can't resize it under our mapping.
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) != 0) {
+        p1_log(obj, P1_LOG_ERROR, "Failed to seal shared memory: %s", strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    return p1_frame_buffer_map(pool, fd, width, height, stride);
+}
+
+P1FrameBuffer *p1_frame_pool_import(P1FramePool *pool, int fd, int width, int height, size_t stride)
+{
+    P1Object *obj = pool->obj;
+    P1FrameBuffer *fb;
+    struct stat st;
+    int seals;
+
+    if (width <= 0 || height <= 0 || stride < (size_t) width * 4) {
+        p1_log(obj, P1_LOG_ERROR, "Invalid frame dimensions %dx%d", width, height);
+        goto fail;
+    }
+
+    if (fstat(fd, &st) != 0) {
+        p1_log(obj, P1_LOG_ERROR, "Failed to stat shared memory: %s", strerror(errno));
+        goto fail;
+    }
+
+    // Without the seal, the producer could shrink the file, and our next read
+    // of the mapping would crash.
+    seals = fcntl(fd, F_GET_SEALS);
+    if (seals < 0 || !(seals & F_SEAL_SHRINK)) {
+        p1_log(obj, P1_LOG_ERROR, "Shared memory is not sealed against shrinking");
+        goto fail;
+    }
+
+    if ((size_t) st.st_size < stride * height) {
+        p1_log(obj, P1_LOG_ERROR, "Shared memory too small for %dx%d frame", width, height);
+        goto fail;
+    }
+
+    fb = p1_frame_buffer_map(pool, fd, width, height, stride);
+    if (fb != NULL)
+        fb->imported = true;
+
+    return fb;
+
+fail:
+    close(fd);
+    return NULL;
+}
+
+void p1_frame_buffer_retain(P1FrameBuffer *fb)
+{
+    __atomic_add_fetch(&fb->refcount, 1, __ATOMIC_RELAXED);
+}
+
+void p1_frame_buffer_release(P1FrameBuffer *fb)
+{
+    P1FramePool *pool = fb->pool;
+    bool destroy_pool = false;
+
+    if (__atomic_sub_fetch(&fb->refcount, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    // The pool object may be gone at this point, so don't log.
+    pthread_mutex_lock(&pool->lock);
+
+    // Imported buffers are never handed out again, their producer may still
+    // be writing to them.
+    pool->outstanding--;
+    if (pool->dead || fb->imported || pool->num_free == max_free_buffers) {
+        p1_frame_buffer_destroy(fb);
+        destroy_pool = (pool->dead && pool->outstanding == 0);
+    }
+    else {
+        fb->next = pool->free_list;
+        pool->free_list = fb;
+        pool->num_free++;
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    if (destroy_pool)
+        p1_frame_pool_destroy(pool);
+}
+
+void p1_video_source_frame_buffer(P1VideoSource *vsrc, P1FrameBuffer *fb)
+{
+    p1_video_source_frame_ref(vsrc, fb->width, fb->height, fb->stride, fb->data,
+                              p1_frame_buffer_release_ref, fb);
+}
+
+
+// Map a shared memory file descriptor, and wrap it in a buffer with a single
+// reference. Closes the descriptor on failure.
+static P1FrameBuffer *p1_frame_buffer_map(P1FramePool *pool, int fd, int width, int height, size_t stride)
+{
+    P1Object *obj = pool->obj;
+    P1FrameBuffer *fb;
+    size_t size = stride * height;
+    void *data;
+
+    fb = calloc(1, sizeof(P1FrameBuffer));
+    if (fb == NULL) {
+        p1_log(obj, P1_LOG_ERROR, "Failed to allocate frame buffer");
+        goto fail_alloc;
+    }
+
+    data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        p1_log(obj, P1_LOG_ERROR, "Failed to map shared memory: %s", strerror(errno));
+        goto fail_map;
+    }
+
+    fb->pool = pool;
+    fb->fd = fd;
+    fb->data = data;
+    fb->size = size;
+    fb->width = width;
+    fb->height = height;
+    fb->stride = stride;
+    fb->refcount = 1;
+
+    p1_lock(obj, &pool->lock);
+    pool->outstanding++;
+    p1_unlock(obj, &pool->lock);
+
+    return fb;
+
+fail_map:
+    free(fb);
+
+fail_alloc:
+    close(fd);
+    return NULL;
+}
+
+static void p1_frame_buffer_destroy(P1FrameBuffer *fb)
+{
+    munmap(fb->data, fb->size);
+    close(fb->fd);
+    free(fb);
+}
+
+static void p1_frame_buffer_release_ref(void *ref)
+{
+    p1_frame_buffer_release((P1FrameBuffer *) ref);
+}
+
+static void p1_frame_pool_destroy(P1FramePool *pool)
+{
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
@@ -0,0 +1,205 @@
+#include "p1stream_priv.h"
+
+#include <string.h>
+#include <signal.h>
+
+
+bool p1_init_platform(P1ContextFull *ctxf)
+{
+    // Our timestamps are already in nanoseconds.
+    ctxf->timebase_num = 1;
+    ctxf->timebase_den = 1;
+
+    // There's no SO_NOSIGPIPE here, so a dropped RTMP connection would
+    // otherwise kill the process. Let writes fail with EPIPE instead.
+    signal(SIGPIPE, SIG_IGN);
+
+    return true;
+}
+
+
+#if P1_HAVE_GL
+
+static EGLDisplay p1_video_get_egl_display();
+static bool p1_egl_has_extension(const char *extensions, const char *name);
+
+bool p1_video_init_platform(P1VideoFull *videof)
+{
+    P1Video *video = (P1Video *) videof;
+    P1Object *videoobj = (P1Object *) videof;
+    EGLint major, minor;
+    EGLConfig config;
+    EGLint num_configs;
+    GLenum gl_err;
+
+    videof->gl.display = p1_video_get_egl_display();
+    if (videof->gl.display == EGL_NO_DISPLAY) {
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to get EGL display: EGL error 0x%x", eglGetError());
+        goto fail;
+    }
+
+    if (!eglInitialize(videof->gl.display, &major, &minor)) {
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to initialize EGL: EGL error 0x%x", eglGetError());
+        goto fail;
+    }
+
+    // We never render to a surface, only to our frame buffer object.
+    if (!p1_egl_has_extension(eglQueryString(videof->gl.display, EGL_EXTENSIONS), "EGL_KHR_surfaceless_context")) {
+        p1_log(videoobj, P1_LOG_ERROR, "EGL %d.%d does not support surfaceless contexts", major, minor);
+        goto fail_display;
+    }
+
+    if (!eglBindAPI(EGL_OPENGL_API)) {
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to bind OpenGL API: EGL error 0x%x", eglGetError());
+        goto fail_display;
+    }
+
+    const EGLint config_attribs[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_RED_SIZE, 8,
+        EGL_GREEN_SIZE, 8,
+        EGL_BLUE_SIZE, 8,
+        EGL_NONE
+    };
+    if (!eglChooseConfig(videof->gl.display, config_attribs, &config, 1, &num_configs) || num_configs < 1) {
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to choose EGL config: EGL error 0x%x", eglGetError());
+        goto fail_display;
+    }
+
+    const EGLint context_attribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 3,
+        EGL_CONTEXT_MINOR_VERSION, 2,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    videof->gl.context = eglCreateContext(videof->gl.display, config, EGL_NO_CONTEXT, context_attribs);
+    if (videof->gl.context == EGL_NO_CONTEXT) {
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to create GL context: EGL error 0x%x", eglGetError());
+        goto fail_display;
+    }
+
+    if (!p1_video_activate_gl(videof))
+        goto fail_context;
+
+    p1_log(videoobj, P1_LOG_INFO, "Using EGL %d.%d with %s", major, minor,
+           (const char *) glGetString(GL_RENDERER));
+
+    // Render target, which takes the place of the IOSurface on OS X.
+    glGenTextures(1, &videof->tex);
+    glGenFramebuffers(1, &videof->fbo);
+    glBindTexture(GL_TEXTURE_RECTANGLE, videof->tex);
+    glBindFramebuffer(GL_FRAMEBUFFER, videof->fbo);
+    if ((gl_err = glGetError()) != GL_NO_ERROR) {
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to create GL objects: OpenGL error %d", gl_err);
+        goto fail_context;
+    }
+
+    glTexImage2D(GL_TEXTURE_RECTANGLE, 0, GL_RGBA8, video->width, video->height, 0,
+                 GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, NULL);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_RECTANGLE, videof->tex, 0);
+    if ((gl_err = glGetError()) != GL_NO_ERROR) {
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to bind GL texture to frame buffer: OpenGL error %d", gl_err);
+        goto fail_context;
+    }
+
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        p1_log(videoobj, P1_LOG_ERROR, "Frame buffer is incomplete");
+        goto fail_context;
+    }
+
+    return true;
+
+fail_context:
+    eglMakeCurrent(videof->gl.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(videof->gl.display, videof->gl.context);
+
+fail_display:
+    eglTerminate(videof->gl.display);
+
+fail:
+    return false;
+}
+
+void p1_video_destroy_platform(P1VideoFull *videof)
+{
+    P1Object *videoobj = (P1Object *) videof;
+
+    eglMakeCurrent(videof->gl.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+
+    if (!eglDestroyContext(videof->gl.display, videof->gl.context))
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to destroy GL context: EGL error 0x%x", eglGetError());
+
+    if (!eglTerminate(videof->gl.display))
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to terminate EGL: EGL error 0x%x", eglGetError());
+}
+
+bool p1_video_preview(P1VideoFull *videof)
+{
+    P1Video *video = (P1Video *) videof;
+    const uint8_t *data;
+
+    if (video->preview_type == P1_PREVIEW_RAW_DATA) {
+        data = p1_video_gl_readback(videof, videof->out_write);
+        if (data == NULL)
+            return false;
+
+        P1PreviewRawData info = {
+            .width = video->width,
+            .height = video->height,
+            .data = data
+        };
+        video->preview_fn(&info, video->preview_user_data);
+    }
+
+    if (video->preview_type == P1_PREVIEW_SCALED) {
+        data = p1_video_gl_readback(videof, videof->out_write);
+        if (data == NULL)
+            return false;
+
+        return p1_video_preview_scaled(videof, data, (size_t) video->width * 4);
+    }
+
+    return true;
+}
+
+// Prefer the Mesa surfaceless platform, which needs no window system or
+// render node. Otherwise, use the default display.
+static EGLDisplay p1_video_get_egl_display()
+{
+    PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display;
+    const char *extensions;
+    EGLDisplay display;
+
+    extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+    if (p1_egl_has_extension(extensions, "EGL_MESA_platform_surfaceless")) {
+        get_platform_display = (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+        if (get_platform_display != NULL) {
+            display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+            if (display != EGL_NO_DISPLAY)
+                return display;
+        }
+    }
+
+    return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+}
+
+// Check for a name in a space separated extension string.
+static bool p1_egl_has_extension(const char *extensions, const char *name)
+{
+    size_t len = strlen(name);
+    const char *p = extensions;
+
+    if (p == NULL)
+        return false;
+
+    while ((p = strstr(p, name)) != NULL) {
+        if ((p == extensions || p[-1] == ' ') && (p[len] == ' ' || p[len] == '\0'))
+            return true;
+        p += len;
+    }
+
+    return false;
+}
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef p1stream_linux_h
+#define p1stream_linux_h
+
+// Linux support is headless. If built with EGL, the GL video backend renders
+// using a surfaceless context, for example on Mesa llvmpipe. Otherwise, the
+// video mixer always uses the software backend. Only raw data previews are
+// supported.
+
+
+// Frame buffers in shared memory, for video sources that want to hand frames
+// to the mixer without a copy. Buffers are reference counted, and return to
+// the pool they came from once the last reference is released.
+//
+// Each buffer is backed by a memfd, so the file descriptor can be passed to
+// another process over a UNIX socket. That process can then map it and write
+// frames directly. The memfd is sealed against resizing, because a mapping
+// of a file that shrinks faults on access. Imported descriptors must be
+// sealed against shrinking too, and are not reused once released, since the
+// producer may still be writing to them.
+
+typedef struct _P1FramePool P1FramePool;
+typedef struct _P1FrameBuffer P1FrameBuffer;
+
+struct _P1FrameBuffer {
+    P1FramePool *pool;
+
+    // Shared memory file descriptor, and its mapping. Pixel data is in
+    // little-endian BGRA format.
+    int fd;
+    uint8_t *data;
+    size_t size;
+
+    int width;
+    int height;
+    size_t stride;
+    // Whether the memory came from another process.
+    bool imported;
+
+    // Use p1_frame_buffer_retain and p1_frame_buffer_release.
+    int refcount;
+    P1FrameBuffer *next;
+};
+
+// Create a pool. The object is used for logging, usually the source.
+P1FramePool *p1_frame_pool_create(P1Object *obj);
+// Free the pool. Buffers still referenced are freed when released.
+void p1_frame_pool_free(P1FramePool *pool);
+
+// Get a buffer for a frame of the given size, with a single reference. Reuses
+// a released buffer of the same size if possible.
+P1FrameBuffer *p1_frame_pool_get(P1FramePool *pool, int width, int height);
+// Wrap a shared memory file descriptor received from another process. The
+// descriptor must carry F_SEAL_SHRINK. The pool takes ownership of the
+// descriptor, and closes it when the buffer is released.
+P1FrameBuffer *p1_frame_pool_import(P1FramePool *pool, int fd, int width, int height, size_t stride);
+
+void p1_frame_buffer_retain(P1FrameBuffer *fb);
+void p1_frame_buffer_release(P1FrameBuffer *fb);
+
+// Pass a frame buffer to the mixer, from the source frame method. This hands
+// over the caller's reference.
+void p1_video_source_frame_buffer(P1VideoSource *vsrc, P1FrameBuffer *fb);
+
+
+// Video clock that ticks at a configured frame rate, for use without a
+// display. Ticks are timed with absolute CLOCK_MONOTONIC deadlines, so the
+// clock does not drift, and the tick time is the deadline itself.
+//
+// Configuration keys are fps-num and fps-den, defaulting to 30/1.
+P1VideoClock *p1_timer_video_clock_create(P1Context *ctx);
+
+// Lateness statistics of the timer clock, reset when it starts.
+typedef struct _P1TimerClockStats P1TimerClockStats;
+
+struct _P1TimerClockStats {
+    // Ticks emitted.
+    uint64_t ticks;
+    // Deadlines skipped, because a wakeup came after the next deadline.
+    uint64_t missed;
+
+    // Time between deadline and wakeup, in nanoseconds.
+    int64_t lateness_max;
+    int64_t lateness_total;
+};
+
+void p1_timer_video_clock_stats(P1VideoClock *vclock, P1TimerClockStats *stats);
+
+#endif
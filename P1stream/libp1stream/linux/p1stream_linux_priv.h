@@ -0,0 +1,58 @@
+#ifndef p1stream_linux_priv_h
+#define p1stream_linux_priv_h
+
+#include <time.h>
+
+// The GL video backend is available if EGL and desktop GL headers are. It
+// renders using a surfaceless EGL context, and always converts on the CPU.
+#if !defined(P1_HAVE_GL) && __has_include(<EGL/egl.h>) && __has_include(<GL/glcorearb.h>)
+#   define P1_HAVE_GL 1
+#endif
+
+#if P1_HAVE_GL
+#   define GL_GLEXT_PROTOTYPES 1
+#   include <EGL/egl.h>
+#   include <EGL/eglext.h>
+#   include <GL/glcorearb.h>
+
+typedef struct _P1GLContext P1GLContext;
+#endif
+
+
+bool p1_init_platform(P1ContextFull *ctxf);
+#define p1_destroy_platform(_ctxf)
+
+// Timestamps are CLOCK_MONOTONIC, in nanoseconds.
+#define p1_get_time() ({                                                    \
+    struct timespec _p1_ts;                                                 \
+    clock_gettime(CLOCK_MONOTONIC, &_p1_ts);                                \
+    (uint64_t) _p1_ts.tv_sec * 1000000000 + (uint64_t) _p1_ts.tv_nsec;      \
+})
+
+
+#if P1_HAVE_GL
+
+struct _P1GLContext {
+    EGLDisplay display;
+    EGLContext context;
+};
+
+bool p1_video_init_platform(P1VideoFull *videof);
+void p1_video_destroy_platform(P1VideoFull *videof);
+
+#define p1_video_activate_gl(_videof) ({                                    \
+    P1VideoFull *_p1_videof = (P1VideoFull *) (_videof);                    \
+    P1Object *_p1_videoobj = (P1Object *) _p1_videof;                       \
+    EGLBoolean _p1_ret = eglMakeCurrent(_p1_videof->gl.display,             \
+        EGL_NO_SURFACE, EGL_NO_SURFACE, _p1_videof->gl.context);            \
+    bool _p1_ok = (_p1_ret == EGL_TRUE);                                    \
+    if (!_p1_ok)                                                            \
+        p1_log(_p1_videoobj, P1_LOG_ERROR, "Failed to activate GL context: EGL error 0x%x", eglGetError());   \
+    _p1_ok;                                                                 \
+})
+
+bool p1_video_preview(P1VideoFull *videof);
+
+#endif
+
+#endif
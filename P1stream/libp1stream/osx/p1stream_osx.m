@@ -174,7 +174,7 @@ bool p1_video_preview(P1VideoFull *videof)
         return true;
     }
 
-    if (video->preview_type == P1_PREVIEW_RAW_DATA) {
+    if (video->preview_type == P1_PREVIEW_RAW_DATA || video->preview_type == P1_PREVIEW_SCALED) {
         ret = IOSurfaceLock(videof->gl.surface, kIOSurfaceLockReadOnly, &seed);
         if (ret != kIOReturnSuccess) {
             p1_log(videoobj, P1_LOG_DEBUG, "Failed to lock IOSurface: IOKit error %d", ret);
@@ -182,12 +182,18 @@ bool p1_video_preview(P1VideoFull *videof)
         }
 
         uint8_t *ptr = IOSurfaceGetBaseAddress(videof->gl.surface);
-        P1PreviewRawData info = {
-            .width = video->width,
-            .height = video->height,
-            .data = ptr
-        };
-        video->preview_fn(&info, video->preview_user_data);
+        bool result = true;
+        if (video->preview_type == P1_PREVIEW_SCALED) {
+            result = p1_video_preview_scaled(videof, ptr, IOSurfaceGetBytesPerRow(videof->gl.surface));
+        }
+        else {
+            P1PreviewRawData info = {
+                .width = video->width,
+                .height = video->height,
+                .data = ptr
+            };
+            video->preview_fn(&info, video->preview_user_data);
+        }
 
         ret = IOSurfaceUnlock(videof->gl.surface, kIOSurfaceLockReadOnly, &seed);
         if (ret != kIOReturnSuccess) {
@@ -195,7 +201,7 @@ bool p1_video_preview(P1VideoFull *videof)
             return false;
         }
 
-        return true;
+        return result;
     }
 
     return true;
@@ -207,17 +213,72 @@ bool p1_video_source_frame_iosurface(P1VideoSource *vsrc, IOSurfaceRef buffer)
     P1Object *obj = (P1Object *) vsrc;
     P1Video *video = obj->ctx->video;
     P1VideoFull *videof = (P1VideoFull *) video;
+    P1VideoSourcePriv *priv = vsrc->priv;
+    uint32_t seed;
+    IOReturn ret;
+    bool result;
 
     GLsizei width = (GLsizei) IOSurfaceGetWidth(buffer);
     GLsizei height = (GLsizei) IOSurfaceGetHeight(buffer);
+
+    // Try to convert straight into the output picture.
+    if (vsrc == videof->passthrough_src && width == video->width && height == video->height) {
+        ret = IOSurfaceLock(buffer, kIOSurfaceLockReadOnly, &seed);
+        if (ret != kIOReturnSuccess) {
+            p1_log(obj, P1_LOG_ERROR, "Failed to lock IOSurface: IOKit error %d", ret);
+            return false;
+        }
+
+        result = p1_video_passthrough(videof, vsrc, width, height,
+                                      IOSurfaceGetBytesPerRow(buffer),
+                                      IOSurfaceGetBaseAddress(buffer));
+
+        ret = IOSurfaceUnlock(buffer, kIOSurfaceLockReadOnly, &seed);
+        if (ret != kIOReturnSuccess)
+            p1_log(obj, P1_LOG_DEBUG, "Failed to unlock IOSurface: IOKit error %d", ret);
+
+        if (result)
+            return true;
+    }
+
+    // Other backends read the pixel data directly.
+    if (videof->backend != &p1_video_gl_backend) {
+        ret = IOSurfaceLock(buffer, kIOSurfaceLockReadOnly, &seed);
+        if (ret != kIOReturnSuccess) {
+            p1_log(obj, P1_LOG_ERROR, "Failed to lock IOSurface: IOKit error %d", ret);
+            return false;
+        }
+
+        result = videof->backend->upload(videof, vsrc, width, height,
+                                         IOSurfaceGetBytesPerRow(buffer),
+                                         IOSurfaceGetBaseAddress(buffer));
+
+        ret = IOSurfaceUnlock(buffer, kIOSurfaceLockReadOnly, &seed);
+        if (ret != kIOReturnSuccess)
+            p1_log(obj, P1_LOG_DEBUG, "Failed to unlock IOSurface: IOKit error %d", ret);
+
+        if (result)
+            p1_video_source_stored(vsrc, width, height);
+        else
+            priv->frame_stored = false;
+        return result;
+    }
+
+    glBindTexture(GL_TEXTURE_RECTANGLE, priv->texture);
     CGLError err = CGLTexImageIOSurface2D(
         videof->gl.cglContext, GL_TEXTURE_RECTANGLE,
         GL_RGBA8, width, height,
         GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, buffer, 0);
     if (err != kCGLNoError) {
         p1_log(obj, P1_LOG_ERROR, "Failed to upload IOSurface: Core Graphics error %d", err);
+        priv->frame_stored = false;
         return false;
     }
 
+    // The texture is now backed by the IOSurface, and no longer has storage
+    // of its own for uploads.
+    priv->texture_width = priv->texture_height = 0;
+
+    p1_video_source_stored(vsrc, width, height);
     return true;
 }
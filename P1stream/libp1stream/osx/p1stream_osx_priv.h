@@ -13,6 +13,10 @@
 typedef struct _P1GLContext P1GLContext;
 typedef struct _P1CLContext P1CLContext;
 
+// The GL video backend is available, and can convert using OpenCL.
+#define P1_HAVE_GL 1
+#define P1_HAVE_CL 1
+
 
 bool p1_init_platform(P1ContextFull *ctxf);
 #define p1_destroy_platform(_ctxf)
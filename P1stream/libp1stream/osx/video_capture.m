@@ -19,6 +19,8 @@ struct _P1CaptureVideoSource {
     CFTypeRef session;
 
     CVPixelBufferRef frame;
+    // Whether the frame is new since it was last passed to the mixer.
+    bool frame_new;
 };
 
 static bool p1_capture_video_source_init(P1CaptureVideoSource *cvsrc, P1Context *ctx);
@@ -26,6 +28,7 @@ static void p1_capture_video_source_config(P1Plugin *pel, P1Config *cfg);
 static void p1_capture_video_source_start(P1Plugin *pel);
 static void p1_capture_video_source_stop(P1Plugin *pel);
 static bool p1_capture_video_source_frame(P1VideoSource *vsrc);
+static void p1_capture_video_source_visibility(P1VideoSource *vsrc, bool hidden);
 static void p1_capture_video_source_kill_session(P1CaptureVideoSource *cvsrc);
 
 
@@ -73,6 +76,7 @@ static bool p1_capture_video_source_init(P1CaptureVideoSource *cvsrc, P1Context
     pel->start = p1_capture_video_source_start;
     pel->stop = p1_capture_video_source_stop;
     vsrc->frame = p1_capture_video_source_frame;
+    vsrc->visibility = p1_capture_video_source_visibility;
 
     return true;
 }
@@ -198,6 +202,11 @@ static bool p1_capture_video_source_frame(P1VideoSource *vsrc)
 
     frame = cvsrc->frame;
     if (frame) {
+        // Nothing to do if the mixer still has our last frame.
+        if (!cvsrc->frame_new && p1_video_source_frame_unchanged(vsrc))
+            return true;
+        cvsrc->frame_new = false;
+
         IOSurfaceRef surface = CVPixelBufferGetIOSurface(frame);
         if (surface != NULL) {
             return p1_video_source_frame_iosurface(vsrc, surface);
@@ -215,6 +224,25 @@ static bool p1_capture_video_source_frame(P1VideoSource *vsrc)
     return true;
 }
 
+// While covered, disable the output connections. The session keeps running,
+// so frames resume quickly, but none are delivered or converted.
+static void p1_capture_video_source_visibility(P1VideoSource *vsrc, bool hidden)
+{
+    P1CaptureVideoSource *cvsrc = (P1CaptureVideoSource *) vsrc;
+
+    if (cvsrc->session == NULL)
+        return;
+
+    @autoreleasepool {
+        AVCaptureSession *session = (__bridge AVCaptureSession *) cvsrc->session;
+
+        for (AVCaptureOutput *output in session.outputs) {
+            for (AVCaptureConnection *connection in output.connections)
+                connection.enabled = !hidden;
+        }
+    }
+}
+
 static void p1_capture_video_source_kill_session(P1CaptureVideoSource *cvsrc)
 {
     P1Object *obj = (P1Object *) cvsrc;
@@ -229,6 +257,8 @@ static void p1_capture_video_source_kill_session(P1CaptureVideoSource *cvsrc)
         CFRelease(cvsrc->frame);
     CFRelease(cvsrc->session);
     CFRelease(cvsrc->delegate);
+    cvsrc->session = NULL;
+    cvsrc->delegate = NULL;
 }
 
 
@@ -275,6 +305,7 @@ didOutputSampleBuffer:(CMSampleBufferRef)sampleBuffer
     else {
         CFRetain(frame);
         cvsrc->frame = frame;
+        cvsrc->frame_new = true;
     }
 
     p1_object_unlock(obj);
@@ -17,6 +17,10 @@ struct _P1DisplayVideoSource {
     CGDisplayStreamRef display_stream;
 
     IOSurfaceRef frame;
+    // Whether the frame is new since it was last passed to the mixer, and
+    // the area that changed in the meantime.
+    bool frame_new;
+    CGRect dirty;
 };
 
 static bool p1_display_video_source_init(P1DisplayVideoSource *dvsrc, P1Context *ctx);
@@ -29,7 +33,8 @@ static bool p1_display_video_source_frame(P1VideoSource *vsrc);
 static void p1_display_video_source_callback(
     P1DisplayVideoSource *dvsrc,
     CGDisplayStreamFrameStatus status,
-    IOSurfaceRef frame);
+    IOSurfaceRef frame,
+    CGDisplayStreamUpdateRef update);
 
 
 P1VideoSource *p1_display_video_source_create(P1Context *ctx)
@@ -97,7 +102,7 @@ static void p1_display_video_source_start(P1Plugin *pel)
             IOSurfaceRef frameSurface,
             CGDisplayStreamUpdateRef updateRef)
         {
-            p1_display_video_source_callback(dvsrc, status, frameSurface);
+            p1_display_video_source_callback(dvsrc, status, frameSurface, updateRef);
         });
     if (dvsrc->display_stream == NULL) {
         p1_log(obj, P1_LOG_ERROR, "Failed to create display stream");
@@ -156,19 +161,38 @@ static void p1_display_video_source_halt(P1DisplayVideoSource *dvsrc)
 static bool p1_display_video_source_frame(P1VideoSource *vsrc)
 {
     P1DisplayVideoSource *dvsrc = (P1DisplayVideoSource *) vsrc;
+    CGRect dirty = dvsrc->dirty;
 
-    if (dvsrc->frame)
-        return p1_video_source_frame_iosurface(vsrc, dvsrc->frame);
-    else
+    if (!dvsrc->frame)
         return true;
+
+    // Idle display, nothing to do if the mixer still has our last frame.
+    if (!dvsrc->frame_new && p1_video_source_frame_unchanged(vsrc))
+        return true;
+
+    // Dirty rects are in display coordinates, which match the stream size.
+    if (dvsrc->frame_new && !CGRectIsNull(dirty) && !CGRectIsInfinite(dirty)) {
+        p1_video_source_damage(vsrc,
+                               (int) floor(CGRectGetMinX(dirty)), (int) floor(CGRectGetMinY(dirty)),
+                               (int) ceil(CGRectGetWidth(dirty)), (int) ceil(CGRectGetHeight(dirty)));
+    }
+
+    dvsrc->frame_new = false;
+    dvsrc->dirty = CGRectNull;
+
+    return p1_video_source_frame_iosurface(vsrc, dvsrc->frame);
 }
 
 static void p1_display_video_source_callback(
     P1DisplayVideoSource *dvsrc,
     CGDisplayStreamFrameStatus status,
-    IOSurfaceRef frame)
+    IOSurfaceRef frame,
+    CGDisplayStreamUpdateRef update)
 {
     P1Object *obj = (P1Object *) dvsrc;
+    const CGRect *rects;
+    size_t num_rects;
+    size_t i;
 
     p1_object_lock(obj);
 
@@ -180,11 +204,25 @@ static void p1_display_video_source_callback(
         dvsrc->frame = NULL;
     }
 
-    // A new frame arrived, retain it.
+    // A new frame arrived, retain it. Collect dirty rects until the mixer
+    // picks it up. Without them, the whole frame is dirty.
     if (status == kCGDisplayStreamFrameStatusFrameComplete) {
         dvsrc->frame = frame;
         CFRetain(frame);
         IOSurfaceIncrementUseCount(frame);
+
+        if (!dvsrc->frame_new)
+            dvsrc->dirty = CGRectNull;
+        dvsrc->frame_new = true;
+
+        rects = update ? CGDisplayStreamUpdateGetRects(update, kCGDisplayStreamUpdateDirtyRects, &num_rects) : NULL;
+        if (rects == NULL) {
+            dvsrc->dirty = CGRectInfinite;
+        }
+        else {
+            for (i = 0; i < num_rects; i++)
+                dvsrc->dirty = CGRectUnion(dvsrc->dirty, rects[i]);
+        }
     }
 
     // State handling.
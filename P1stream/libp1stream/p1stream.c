@@ -1,5 +1,8 @@
 #include "p1stream_priv.h"
 
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <sys/poll.h>
 
@@ -15,6 +18,13 @@ static void p1_ctrl_notify_objects(P1Context *ctx, P1Notification *n);
 static bool p1_ctrl_progress_objects(P1Context *ctx);
 static P1Action p1_ctrl_determine_action(P1Object *obj, bool can_interrupt);
 static void p1_ctrl_log_notification(P1Notification *notification);
+static bool p1_prefix_config_get_string(P1Config *cfg, const char *key, char *buf, size_t bufsize);
+static bool p1_prefix_config_get_int(P1Config *cfg, const char *key, int *out);
+static bool p1_prefix_config_get_uint32(P1Config *cfg, const char *key, uint32_t *out);
+static bool p1_prefix_config_get_float(P1Config *cfg, const char *key, float *out);
+static bool p1_prefix_config_get_bool(P1Config *cfg, const char *key, bool *out);
+static bool p1_prefix_config_each_string(P1Config *cfg, const char *prefix, P1ConfigIterString iter, void *data);
+static bool p1_prefix_config_iter_string(P1Config *cfg, const char *key, const char *val, void *data);
 
 // Based on state and target, one of these actions is taken.
 enum _P1Action {
@@ -126,6 +136,10 @@ void p1_object_notify(P1Object *obj)
 void p1_plugin_free(P1Plugin *pel)
 {
     P1Object *obj = (P1Object *) pel;
+    P1VideoSourcePriv *vsrc_priv = NULL;
+
+    if (obj->type == P1_OTYPE_VIDEO_SOURCE)
+        vsrc_priv = ((P1VideoSource *) pel)->priv;
 
     p1_object_destroy(obj);
 
@@ -133,18 +147,21 @@ void p1_plugin_free(P1Plugin *pel)
         pel->free(pel);
     else
         free(pel);
+
+    p1_video_source_free_priv(vsrc_priv);
 }
 
 P1Context *p1_create()
 {
     P1Context *ctx = calloc(1,
         sizeof(P1ContextFull) + sizeof(P1VideoFull) +
-        sizeof(P1AudioFull) + sizeof(P1ConnectionFull));
+        sizeof(P1AudioFull) + sizeof(P1ConnectionFull) * P1_NUM_CONNECTIONS);
 
     P1ContextFull *ctxf = (P1ContextFull *) ctx;
     P1VideoFull *videof = (P1VideoFull *) (ctxf + 1);
     P1AudioFull *audiof = (P1AudioFull *) (videof + 1);
     P1ConnectionFull *connf = (P1ConnectionFull *) (audiof + 1);
+    int i;
 
     if (!ctx)
         goto fail_alloc;
@@ -160,12 +177,23 @@ P1Context *p1_create()
         goto fail_audio;
     ctx->audio = (P1Audio *) audiof;
 
-    if (!p1_conn_init(connf, ctx))
+    if (!p1_conn_init(connf, ctx, 0))
         goto fail_conn;
     ctx->conn = (P1Connection *) connf;
 
+    for (i = 0; i < P1_MAX_RENDITIONS; i++) {
+        if (!p1_conn_init(connf + i + 1, ctx, i + 1))
+            goto fail_renditions;
+        ctx->renditions[i] = (P1Connection *) (connf + i + 1);
+    }
+
     return ctx;
 
+fail_renditions:
+    while (i--)
+        p1_conn_destroy(connf + i + 1);
+    p1_conn_destroy(connf);
+
 fail_conn:
     p1_audio_destroy(audiof);
 
@@ -250,6 +278,7 @@ void p1_free(P1Context *ctx, P1FreeOptions options)
     P1ListNode *head;
     P1ListNode *node;
     P1ListNode *next;
+    int i;
 
     if ((options & P1_FREE_VIDEO_CLOCK) && ctx->video->clock != NULL)
         p1_plugin_free((P1Plugin *) ctx->video->clock);
@@ -272,6 +301,8 @@ void p1_free(P1Context *ctx, P1FreeOptions options)
         }
     }
 
+    for (i = 0; i < P1_MAX_RENDITIONS; i++)
+        p1_conn_destroy((P1ConnectionFull *) ctx->renditions[i]);
     p1_conn_destroy((P1ConnectionFull *) ctx->conn);
     p1_audio_destroy((P1AudioFull *) ctx->audio);
     p1_video_destroy((P1VideoFull *) ctx->video);
@@ -286,8 +317,8 @@ void p1_config(P1Context *ctx, P1Config *cfg)
     P1Object *audioobj = (P1Object *) audio;
     P1Video *video = ctx->video;
     P1Object *videoobj = (P1Object *) video;
-    P1Connection *conn = ctx->conn;
-    P1Object *connobj = (P1Object *) conn;
+    P1PrefixConfig pcfg;
+    int i;
 
     p1_object_lock(audioobj);
     p1_audio_config((P1AudioFull *) audio, cfg);
@@ -297,9 +328,36 @@ void p1_config(P1Context *ctx, P1Config *cfg)
     p1_video_config((P1VideoFull *) video, cfg);
     p1_object_unlock(videoobj);
 
-    p1_object_lock(connobj);
-    p1_conn_config((P1ConnectionFull *) conn, cfg);
-    p1_object_unlock(connobj);
+    for (i = 0; i < P1_NUM_CONNECTIONS; i++) {
+        P1ConnectionFull *connf = p1_get_conn(ctx, i);
+        P1Object *connobj = (P1Object *) connf;
+
+        p1_object_lock(connobj);
+        if (i == 0) {
+            p1_conn_config(connf, cfg);
+        }
+        else {
+            p1_rendition_config_init(&pcfg, cfg, i);
+            p1_conn_config(connf, (P1Config *) &pcfg);
+        }
+        p1_object_unlock(connobj);
+    }
+}
+
+void p1_rendition_config_init(P1PrefixConfig *pcfg, P1Config *cfg, int rendition)
+{
+    P1Config *super = (P1Config *) pcfg;
+
+    super->free = NULL;
+    super->get_string = p1_prefix_config_get_string;
+    super->get_int = p1_prefix_config_get_int;
+    super->get_uint32 = p1_prefix_config_get_uint32;
+    super->get_float = p1_prefix_config_get_float;
+    super->get_bool = p1_prefix_config_get_bool;
+    super->each_string = p1_prefix_config_each_string;
+
+    pcfg->cfg = cfg;
+    snprintf(pcfg->prefix, sizeof(pcfg->prefix), "rendition%d-", rendition);
 }
 
 static void p1_close_pipe(P1Object *ctxobj, int fd)
@@ -437,6 +495,10 @@ static void p1_log_default(P1Object *obj, P1LogLevel level, const char *fmt, va_
             break;
         case P1_OTYPE_CONNECTION:
             name = "conn";
+            if (((P1ConnectionFull *) obj)->rendition != 0) {
+                name = name_buf;
+                snprintf(name_buf, sizeof(name_buf), "conn %d", ((P1ConnectionFull *) obj)->rendition);
+            }
             break;
         case P1_OTYPE_VIDEO_CLOCK:
             name = "vclock";
@@ -589,11 +651,9 @@ static void p1_ctrl_notify_objects(P1Context *ctx, P1Notification *n)
     P1Video *video = ctx->video;
     P1VideoFull *videof = (P1VideoFull *) video;
     P1Object *videoobj = (P1Object *) video;
-    P1Connection *conn = ctx->conn;
-    P1ConnectionFull *connf = (P1ConnectionFull *) conn;
-    P1Object *connobj = (P1Object *) conn;
     P1ListNode *head;
     P1ListNode *node;
+    int i;
 
 #define P1_NOTIFY_PLUGIN(_ref, _type, _method) ({               \
     _type *_full = (_type *) (_ref);                            \
@@ -635,12 +695,15 @@ static void p1_ctrl_notify_objects(P1Context *ctx, P1Notification *n)
 
     p1_object_unlock(videoobj);
 
-    p1_object_lock(connobj);
-
-    // Notify connection.
-    p1_conn_notify(connf, n);
+    // Notify connections.
+    for (i = 0; i < P1_NUM_CONNECTIONS; i++) {
+        P1ConnectionFull *connf = p1_get_conn(ctx, i);
+        P1Object *connobj = (P1Object *) connf;
 
-    p1_object_unlock(connobj);
+        p1_object_lock(connobj);
+        p1_conn_notify(connf, n);
+        p1_object_unlock(connobj);
+    }
 
 #undef P1_NOTIFY_PLUGIN
 }
@@ -654,13 +717,11 @@ static bool p1_ctrl_progress_objects(P1Context *ctx)
     P1Video *video = ctx->video;
     P1VideoFull *videof = (P1VideoFull *) video;
     P1Object *videoobj = (P1Object *) video;
-    P1Connection *conn = ctx->conn;
-    P1ConnectionFull *connf = (P1ConnectionFull *) conn;
-    P1Object *connobj = (P1Object *) conn;
     P1VideoClock *vclock;
     P1ListNode *head;
     P1ListNode *node;
     bool wait = false;
+    int i;
 
 // After an action, check if we need to wait.
 #define P1_CHECK_WAIT(_obj)                                 \
@@ -749,15 +810,18 @@ static bool p1_ctrl_progress_objects(P1Context *ctx)
 
     p1_object_unlock(videoobj);
 
-    p1_object_lock(connobj);
+    // Progress connections.
+    for (i = 0; i < P1_NUM_CONNECTIONS; i++) {
+        P1ConnectionFull *connf = p1_get_conn(ctx, i);
+        P1Object *connobj = (P1Object *) connf;
+
+        p1_object_lock(connobj);
 
-    // Progress connnection.
-    {
         P1Action action = p1_ctrl_determine_action(connobj, true);
         P1_RUN_ACTION(action, connobj, connf, p1_conn_start, p1_conn_stop);
-    }
 
-    p1_object_unlock(connobj);
+        p1_object_unlock(connobj);
+    }
 
     return wait;
 
@@ -835,3 +899,73 @@ static void p1_ctrl_log_notification(P1Notification *n)
         p1_log(obj, P1_LOG_INFO, "target -> %s", target);
     }
 }
+
+// Prefixed configuration, which forwards to the underlying configuration.
+#define P1_PREFIX_CONFIG_KEY(_pcfg, _key, _buf) \
+    snprintf(_buf, sizeof(_buf), "%s%s", (_pcfg)->prefix, _key)
+
+static bool p1_prefix_config_get_string(P1Config *cfg, const char *key, char *buf, size_t bufsize)
+{
+    P1PrefixConfig *pcfg = (P1PrefixConfig *) cfg;
+    char full_key[128];
+
+    P1_PREFIX_CONFIG_KEY(pcfg, key, full_key);
+    return pcfg->cfg->get_string(pcfg->cfg, full_key, buf, bufsize);
+}
+
+static bool p1_prefix_config_get_int(P1Config *cfg, const char *key, int *out)
+{
+    P1PrefixConfig *pcfg = (P1PrefixConfig *) cfg;
+    char full_key[128];
+
+    P1_PREFIX_CONFIG_KEY(pcfg, key, full_key);
+    return pcfg->cfg->get_int(pcfg->cfg, full_key, out);
+}
+
+static bool p1_prefix_config_get_uint32(P1Config *cfg, const char *key, uint32_t *out)
+{
+    P1PrefixConfig *pcfg = (P1PrefixConfig *) cfg;
+    char full_key[128];
+
+    P1_PREFIX_CONFIG_KEY(pcfg, key, full_key);
+    return pcfg->cfg->get_uint32(pcfg->cfg, full_key, out);
+}
+
+static bool p1_prefix_config_get_float(P1Config *cfg, const char *key, float *out)
+{
+    P1PrefixConfig *pcfg = (P1PrefixConfig *) cfg;
+    char full_key[128];
+
+    P1_PREFIX_CONFIG_KEY(pcfg, key, full_key);
+    return pcfg->cfg->get_float(pcfg->cfg, full_key, out);
+}
+
+static bool p1_prefix_config_get_bool(P1Config *cfg, const char *key, bool *out)
+{
+    P1PrefixConfig *pcfg = (P1PrefixConfig *) cfg;
+    char full_key[128];
+
+    P1_PREFIX_CONFIG_KEY(pcfg, key, full_key);
+    return pcfg->cfg->get_bool(pcfg->cfg, full_key, out);
+}
+
+static bool p1_prefix_config_each_string(P1Config *cfg, const char *prefix, P1ConfigIterString iter, void *data)
+{
+    P1PrefixConfig *pcfg = (P1PrefixConfig *) cfg;
+    char full_prefix[128];
+
+    P1_PREFIX_CONFIG_KEY(pcfg, prefix, full_prefix);
+    pcfg->iter = iter;
+    pcfg->iter_data = data;
+    return pcfg->cfg->each_string(pcfg->cfg, full_prefix, p1_prefix_config_iter_string, pcfg);
+}
+
+// Strip the prefix before handing keys to the iterator.
+static bool p1_prefix_config_iter_string(P1Config *cfg, const char *key, const char *val, void *data)
+{
+    P1PrefixConfig *pcfg = (P1PrefixConfig *) data;
+
+    return pcfg->iter((P1Config *) pcfg, key + strlen(pcfg->prefix), val, pcfg->iter_data);
+}
+
+#undef P1_PREFIX_CONFIG_KEY
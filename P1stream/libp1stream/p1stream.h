@@ -2,10 +2,18 @@
 #define p1stream_h
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdarg.h>
+#include <string.h>
 #include <pthread.h>
 
+// Only BSD-derived systems define this one.
+#ifndef __printflike
+#   define __printflike(fmtarg, firstvararg) \
+        __attribute__((__format__ (__printf__, fmtarg, firstvararg)))
+#endif
+
 
 // The P1stream interface consist of a context that models a simple media
 // pipeline containing elements, each taking responsibility for part of the
@@ -56,11 +64,15 @@ typedef enum _P1ObjectType P1ObjectType;
 typedef struct _P1ListNode P1ListNode;
 typedef struct _P1Notification P1Notification;
 typedef uint8_t P1VideoPreviewType;
+typedef struct _P1PreviewRawData P1PreviewRawData;
+typedef enum _P1VideoFilter P1VideoFilter;
+typedef struct _P1VideoSourcePriv P1VideoSourcePriv;
 
 // Callback signatures.
 typedef bool (*P1ConfigIterString)(P1Config *cfg, const char *key, const char *val, void *data);
 typedef void (*P1LogCallback)(P1Object *obj, P1LogLevel level, const char *fmt, va_list args, void *user_data);
 typedef void (*P1VideoPreviewCallback)(void *data, void *user_data);
+typedef void (*P1VideoFrameRelease)(void *ref);
 
 // These types are for convenience. Sources usually want to have a function
 // following one of these signatures to instantiate them.
@@ -297,6 +309,10 @@ struct _P1ListNode {
 #define p1_list_iterate(_head, _node)  \
     for (_node = _head->next; _node != _head; _node = _node->next)
 
+// Iterate list items in reverse order. Both arguments must be local variables.
+#define p1_list_iterate_reverse(_head, _node)  \
+    for (_node = _head->prev; _node != _head; _node = _node->prev)
+
 // Iterate list items where some iterations may remove the current item.
 #define p1_list_iterate_for_removal(_head, _node, _next)    \
     _next = _head->next;                                    \
@@ -439,11 +455,22 @@ void p1_video_clock_tick(P1VideoClock *vclock, int64_t time);
 // Video sources produce images on each clock tick. Several may be added to a
 // context, to be combined into a single output image.
 
+// Filter used to scale source frames. Bilinear is the default, and the only
+// filter the GL backend supports. The software backend also has separable
+// filters that sample more of the frame, and keep detail when shrinking.
+
+enum _P1VideoFilter {
+    P1_FILTER_BILINEAR  = 0,
+    P1_FILTER_BICUBIC   = 1,
+    P1_FILTER_LANCZOS   = 2
+};
+
 struct _P1VideoSource {
     P1Source super;
 
-    // Texture name. The source need not touch this.
-    unsigned int texture;
+    // State of the mixer and backend for this source, allocated by
+    // p1_video_source_init. The source need not touch this.
+    P1VideoSourcePriv *priv;
 
     // Top left and bottom right coordinates of where to place frames in the
     // output image. These are in the range [-1, +1].
@@ -451,10 +478,19 @@ struct _P1VideoSource {
     // Top left and bottom right coordinates of the area in the frame to grab,
     // used to achieve clipping. These are in the range [0, 1].
     float u1, v1, u2, v2;
+    // Filter used to scale frames into place.
+    P1VideoFilter filter;
 
-    // Produce the latest frame using p1_video_frame.
-    // This is called from the clock thread.
+    // Produce the latest frame using p1_video_frame. If the frame has not
+    // changed since the last call, the source may instead report that using
+    // p1_video_source_frame_unchanged. This is called from the clock thread.
     bool (*frame)(P1VideoSource *source);
+
+    // Optional. Called when the source becomes entirely covered by other
+    // sources, or visible again. While hidden, frame is not called, and the
+    // source may pause capture. This is called from the clock thread, with
+    // the source lock held.
+    void (*visibility)(P1VideoSource *source, bool hidden);
 };
 
 // Subclasses should call into this from the initializer.
@@ -466,6 +502,45 @@ void p1_video_source_config(P1VideoSource *vsrc, P1Config *cfg);
 // Callback for video sources to provide frame data.
 void p1_video_source_frame(P1VideoSource *vsrc, int width, int height, void *data);
 
+// Like p1_video_source_frame, but hands the mixer a reference to the frame,
+// which it may read in place instead of copying. The mixer calls release on
+// the reference exactly once, when it no longer needs the data. That may be
+// immediately, or as late as the next frame or unlinking the source.
+void p1_video_source_frame_ref(P1VideoSource *vsrc, int width, int height, size_t stride,
+                               const void *data, P1VideoFrameRelease release, void *ref);
+
+// Callback for video sources to report the frame is the same as the one passed
+// last. Returns false if the mixer no longer has that frame, in which case the
+// source should pass it again.
+bool p1_video_source_frame_unchanged(P1VideoSource *vsrc);
+
+// Optionally report the area of the frame that changed, in pixels, before
+// passing it. Multiple calls add up. Without this, the whole frame is
+// considered changed.
+void p1_video_source_damage(P1VideoSource *vsrc, int x, int y, int width, int height);
+
+// Frame latch for sources that produce frames on their own thread. The
+// producer gets a buffer for a BGRA frame of the given size using
+// p1_video_source_latch_acquire, fills it, then publishes it with
+// p1_video_source_latch_publish. Neither call blocks. Returns NULL if the
+// buffer could not be allocated.
+uint8_t *p1_video_source_latch_acquire(P1VideoSource *vsrc, int width, int height);
+void p1_video_source_latch_publish(P1VideoSource *vsrc);
+
+// Frame method for latched sources. Passes the newest published frame, or
+// reports the frame unchanged if there is none. Sources can assign this to the
+// frame field directly, or call it from their own frame method.
+bool p1_video_source_latch_frame(P1VideoSource *vsrc);
+
+// Free latch buffers. Only call this when the producer is stopped.
+void p1_video_source_latch_free(P1VideoSource *vsrc);
+
+// Read the latch statistics of a source, counted over its lifetime: frames
+// published, frames the mixer picked up, and frames replaced before the mixer
+// picked them up. Any of the pointers may be NULL. Can be called from any
+// thread, the counts may lag slightly behind.
+void p1_video_source_latch_stats(P1VideoSource *vsrc, uint64_t *produced, uint64_t *consumed, uint64_t *skipped);
+
 
 // Audio sources produce buffers as they become available, using
 // p1_audio_buffer. Several may be added to a context, to be mixed into a
@@ -524,11 +599,47 @@ struct _P1Video {
     P1VideoPreviewCallback preview_fn;
     void *preview_user_data;
     P1VideoPreviewType preview_type;
+
+    // Dimensions and rate of scaled previews. Zero dimensions use the output
+    // size, and a zero rate previews every frame. Changes apply from the next
+    // preview frame.
+    int preview_width;
+    int preview_height;
+    float preview_rate;
+
+    // Frame pacing counters, reset when the mixer starts. Duplicated frames
+    // fill in for missed clock ticks, and dropped frames are ticks that fell
+    // on an already streamed frame slot. Read-only.
+    uint64_t frames_duplicated;
+    uint64_t frames_dropped;
+
+    // Deadline counters, reset when the mixer starts. Ticks that overran the
+    // frame budget, and the work skipped to catch up. Read-only.
+    uint64_t ticks_late;
+    uint64_t previews_skipped;
+    uint64_t composites_deferred;
+    uint64_t frames_shed;
 };
 
 // Notify that the clock or sources have changed.
 #define p1_video_resync(_video) p1_object_resync((P1Object *) (_video))
 
+// Preview callback type where data is the below struct, allowing access to
+// raw pixel data. Pixel data is in little-endian BGRA format. Data should not
+// be accessed after the callback returns. Supported by all video backends.
+#define P1_PREVIEW_RAW_DATA 0
+struct _P1PreviewRawData {
+    size_t width;
+    size_t height;
+    const uint8_t *data;
+};
+
+// Preview callback type where data is a P1PreviewRawData as above, for a copy
+// of the frame scaled to the preview dimensions, at the preview rate. The
+// callback is made on a separate preview thread. If it is slow, frames are
+// skipped, but the mixer is never held up. Supported by all video backends.
+#define P1_PREVIEW_SCALED 2
+
 
 // Fixed stream connection element.
 
@@ -536,6 +647,12 @@ struct _P1Connection {
     P1Object super;
 };
 
+// Maximum number of renditions. These are additional connections, each
+// streaming a copy of the video output scaled to a different size. Keys of
+// rendition configuration are prefixed with 'rendition1-', 'rendition2-', etc.
+// Renditions without a URL are not used.
+#define P1_MAX_RENDITIONS 3
+
 
 // Context that encapsulates everything else.
 
@@ -553,6 +670,7 @@ struct _P1Context {
     P1Video *video;
     P1Audio *audio;
     P1Connection *conn;
+    P1Connection *renditions[P1_MAX_RENDITIONS];
 };
 
 // Create a new context.
@@ -581,6 +699,28 @@ void p1_logv(P1Object *obj, P1LogLevel level, const char *fmt, va_list args) __p
 
 
 
+// Bundled plugins.
+
+// Video source that generates moving test patterns, for benchmarking with a
+// reproducible load. Frames are rendered into a ring when the source starts.
+//
+// Configuration keys are pattern (bars, gradient or noise), width, height,
+// frames (the ring length), entropy (bits per channel of noise, 0 to 8), seed
+// and rate (frames per second, or 0 to advance every tick).
+P1VideoSource *p1_pattern_video_source_create(P1Context *ctx);
+
+// Video source that plays a Y4M or raw BGRA file in a loop, mapped into
+// memory. Y4M files may use 4:2:0, 4:4:4 or mono chroma.
+//
+// Configuration keys are file, width and height (for raw files only), rate
+// (frames per second, overriding the Y4M header) and realtime. In realtime,
+// the default, frames follow the clock at the file rate. Otherwise, each tick
+// takes the next frame, so the pipeline processes every frame as fast as its
+// clock allows.
+P1VideoSource *p1_file_video_source_create(P1Context *ctx);
+
+
+
 // Platform-specific functionality.
 
 #if __APPLE__
@@ -590,6 +730,8 @@ void p1_logv(P1Object *obj, P1LogLevel level, const char *fmt, va_list args) __p
 #   else
 #       error Unsupported platform
 #   endif
+#elif __linux__
+#   include "linux/p1stream_linux.h"
 #else
 #   error Unsupported platform
 #endif
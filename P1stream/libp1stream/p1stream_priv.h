@@ -9,6 +9,18 @@
 #include <librtmp/log.h>
 
 typedef struct _P1Packet P1Packet;
+typedef struct _P1VideoBackend P1VideoBackend;
+typedef struct _P1VideoCPUSample P1VideoCPUSample;
+typedef struct _P1VideoCPUDraw P1VideoCPUDraw;
+typedef struct _P1VideoScaleAxis P1VideoScaleAxis;
+typedef struct _P1VideoScaler P1VideoScaler;
+typedef struct _P1VideoLatchBuffer P1VideoLatchBuffer;
+typedef struct _P1VideoRendition P1VideoRendition;
+typedef struct _P1VideoPreview P1VideoPreview;
+typedef struct _P1VideoPreviewBuffer P1VideoPreviewBuffer;
+typedef struct _P1VideoRect P1VideoRect;
+typedef struct _P1Worker P1Worker;
+typedef struct _P1WorkerPool P1WorkerPool;
 typedef struct _P1VideoFull P1VideoFull;
 typedef struct _P1AudioFull P1AudioFull;
 typedef struct _P1ConnectionFull P1ConnectionFull;
@@ -24,6 +36,8 @@ typedef struct _P1ContextFull P1ContextFull;
 #   else
 #       error Unsupported platform
 #   endif
+#elif __linux__
+#   include "linux/p1stream_linux_priv.h"
 #else
 #   error Unsupported platform
 #endif
@@ -64,6 +78,64 @@ bool p1_object_init(P1Object *obj, P1ObjectType type, P1Context *ctx);
 void p1_object_destroy(P1Object *obj);
 
 
+// Connections of a context. Number zero is the main connection, the rest
+// stream renditions.
+
+#define P1_NUM_CONNECTIONS (P1_MAX_RENDITIONS + 1)
+
+#define p1_get_conn(_ctx, _i)                                   \
+    ((P1ConnectionFull *) ((_i) == 0 ? (_ctx)->conn : (_ctx)->renditions[(_i) - 1]))
+
+// A view of configuration with keys prefixed, used for renditions. The view
+// borrows the underlying configuration, and needs no freeing.
+
+typedef struct _P1PrefixConfig P1PrefixConfig;
+
+struct _P1PrefixConfig {
+    P1Config super;
+
+    P1Config *cfg;
+    char prefix[32];
+
+    // State of each_string.
+    P1ConfigIterString iter;
+    void *iter_data;
+};
+
+void p1_rendition_config_init(P1PrefixConfig *pcfg, P1Config *cfg, int rendition);
+
+
+// Worker thread pool. Runs jobs numbered [0, num_jobs) in parallel, and
+// returns once all are done. The worker number passed to the job function is
+// in the range [0, num_workers), and can be used to index scratch space.
+
+typedef void (*P1WorkerFn)(void *data, int job, int worker);
+
+struct _P1WorkerPool {
+    P1Object *obj;
+    int num_workers;
+    int num_threads;
+    P1Worker *workers;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    unsigned int generation;
+    bool stop;
+
+    // Current batch.
+    P1WorkerFn fn;
+    void *data;
+    int num_jobs;
+    int next_job;
+    int jobs_left;
+};
+
+bool p1_worker_pool_init(P1WorkerPool *pool, P1Object *obj, int num_workers);
+void p1_worker_pool_destroy(P1WorkerPool *pool);
+void p1_worker_pool_run(P1WorkerPool *pool, int num_jobs, P1WorkerFn fn, void *data);
+
+
 // This is a ringbuffer of RMTPPacket pointers.
 
 struct _P1Packet {
@@ -74,37 +146,463 @@ struct _P1Packet {
 };
 
 
+// The video mixer delegates compositing and colorspace conversion to a
+// backend. All methods are called with the video mixer lock held.
+
+// Upper limit of frames of latency allowed for readback of converted frames.
+#define P1_VIDEO_MAX_LATENCY 3
+
+struct _P1VideoBackend {
+    // Name used to select the backend in configuration.
+    const char *name;
+    // Whether the backend can composite just the damaged tiles. Otherwise,
+    // any damage causes the full frame to be composited.
+    bool partial;
+
+    // Allocate resources. Dimensions and the output picture are already set.
+    bool (*start)(P1VideoFull *videof);
+    // Free resources, including those of sources still linked.
+    void (*stop)(P1VideoFull *videof);
+
+    // Set up or tear down resources for a source that started or stopped.
+    bool (*link_source)(P1VideoFull *videof, P1VideoSource *vsrc);
+    void (*unlink_source)(P1VideoFull *videof, P1VideoSource *vsrc);
+
+    // Store frame data for a source. Called from the source frame method.
+    bool (*upload)(P1VideoFull *videof, P1VideoSource *vsrc, int width, int height, size_t stride, const void *data);
+    // Optionally, use frame data in place. The data stays valid until the next
+    // upload or hold, or until the source is unlinked. Return false to fall
+    // back to upload.
+    bool (*hold)(P1VideoFull *videof, P1VideoSource *vsrc, int width, int height, size_t stride, const void *data);
+
+    // Start of a tick, called before the frame methods of sources.
+    bool (*begin)(P1VideoFull *videof);
+
+    // Composite a frame, only called if there is damage. Clear starts a frame
+    // on a cleared canvas, draw is called for each visible source, and end
+    // finishes the frame. Backends may defer drawing until the end, and
+    // partial backends only need to touch tiles marked dirty.
+    bool (*clear)(P1VideoFull *videof);
+    bool (*draw)(P1VideoFull *videof, P1VideoSource *vsrc);
+    bool (*end)(P1VideoFull *videof);
+
+    // Call the preview function with the composited frame.
+    bool (*preview)(P1VideoFull *videof);
+
+    // Colorspace conversion of the composited frame into the output picture.
+    // Only tiles marked stale need to be converted. Backends with a finish
+    // method may instead only start conversion into output slot out_write.
+    bool (*convert)(P1VideoFull *videof);
+
+    // Complete conversion of output slot out_read, leaving the result in the
+    // output picture, or pointing stream_pic at it. Optional, backends without
+    // it convert synchronously and don't support latency.
+    bool (*finish)(P1VideoFull *videof);
+};
+
+#if P1_HAVE_GL
+extern const P1VideoBackend p1_video_gl_backend;
+#endif
+extern const P1VideoBackend p1_video_cpu_backend;
+
+
+// Filter coefficients for scaling along one axis. Output pixels [begin, end)
+// of an image out_size wide are covered by the range [p1, p2], in the range
+// [-1, +1], and take samples from the range [t1, t2] of the input, in the
+// range [0, 1]. Each output pixel has the same number of taps, starting at
+// first, relative to in_begin. Weights are 14-bit fixed point.
+struct _P1VideoScaleAxis {
+    bool valid;
+    P1VideoFilter filter;
+    int in_size, out_size;
+    int begin, end;
+    float p1, p2, t1, t2;
+
+    int taps;
+    int *first;
+    int16_t *weights;
+    int max_pixels, max_taps;
+    // Range of input samples read.
+    int in_begin, in_end;
+};
+
+struct _P1VideoScaler {
+    P1VideoScaleAxis x;
+    P1VideoScaleAxis y;
+};
+
+// A rendition of the video output at a different size. It is scaled from the
+// same frame whenever the output picture is converted, and streamed by its own
+// connection. The rows of the picture are split into tiles, like the output.
+
+struct _P1VideoRendition {
+    // Config
+    int cfg_width;
+    int cfg_height;
+    P1VideoFilter cfg_filter;
+
+    // Active size, zero if unused.
+    int width;
+    int height;
+    P1VideoFilter filter;
+
+    // Scaled frame in BGRA format, and the converted picture.
+    P1VideoScaler scaler;
+    uint8_t *canvas;
+    size_t canvas_stride;
+    x264_picture_t pic;
+    // Whether the picture holds a complete frame to update.
+    bool pic_valid;
+
+    int tile_height;
+    int num_tiles;
+    // Number of the first tile in the job list shared by all renditions.
+    int first_job;
+};
+
+// Area of output pixels [x1, x2) by [y1, y2), used for occlusion culling.
+struct _P1VideoRect {
+    int x1, y1, x2, y2;
+};
+
+// Limits of occlusion culling. The number of sources considered as covering
+// others, and of pieces tracked while subtracting them from a source. Beyond
+// these, sources are assumed to be visible.
+#define P1_VIDEO_MAX_OCCLUDERS 16
+#define P1_VIDEO_MAX_OCCLUSION_PARTS 32
+
+// State of the scaled preview. The mixer scales frames into the back buffer,
+// and swaps it with the pending buffer. The preview thread swaps the pending
+// buffer with the front buffer, and delivers that. A slow callback means
+// frames are replaced while pending, and the mixer never waits for it.
+
+// A preview buffer carries the size of the frame in it, so the preview size
+// can change without waiting for the preview thread.
+struct _P1VideoPreviewBuffer {
+    uint8_t *data;
+    size_t size;
+    int width;
+    int height;
+};
+
+struct _P1VideoPreview {
+    // Thread, started on first use.
+    bool started;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool stop;
+
+    // Dimensions the scaler targets. Each worker has a scratch row for
+    // scaling. These belong to the mixer thread.
+    int width;
+    int height;
+    P1VideoScaler scaler;
+    uint8_t *rows;
+    size_t row_size;
+
+    // Indices into the buffers, and whether the pending buffer holds a frame
+    // not yet delivered.
+    P1VideoPreviewBuffer buffers[3];
+    int back;
+    int pending;
+    int front;
+    bool pending_valid;
+
+    // Callback the pending frame is for.
+    P1VideoPreviewCallback fn;
+    void *user_data;
+
+    // Time of the current tick, and of the next frame in nanoseconds.
+    int64_t tick_time;
+    int64_t next_time;
+
+    // Input of the current scale.
+    const uint8_t *in;
+    size_t in_stride;
+
+    // Frames delivered, and frames replaced before the callback took them.
+    uint64_t delivered;
+    uint64_t skipped;
+};
+
+bool p1_video_preview_due(P1VideoFull *videof);
+bool p1_video_preview_scaled(P1VideoFull *videof, const uint8_t *in, size_t in_stride);
+void p1_video_preview_stop(P1VideoFull *videof);
+
+// Number of pixel buffers used for asynchronous texture uploads.
+#define P1_VIDEO_UPLOAD_BUFFERS 2
+
+// One of the buffers of a video source frame latch.
+struct _P1VideoLatchBuffer {
+    uint8_t *data;
+    size_t size;
+    int width;
+    int height;
+};
+
+// Private part of P1VideoSource. This is mixer and backend state, allocated
+// separately so sources can be built against the public header alone.
+
+struct _P1VideoSourcePriv {
+    // Whether the mixer has set up resources for this source.
+    bool linked;
+
+    // Texture name and storage size, used by the GL backend. Frames are
+    // uploaded through a ring of pixel buffers, so that an upload can overlap
+    // rendering of the previous frame.
+    unsigned int texture;
+    int texture_width;
+    int texture_height;
+    unsigned int upload_pbos[P1_VIDEO_UPLOAD_BUFFERS];
+    size_t upload_sizes[P1_VIDEO_UPLOAD_BUFFERS];
+    int upload_index;
+
+    // Frame storage, used by the software backend. Pixel data is in
+    // little-endian BGRA format. When borrowed, the data belongs to the frame
+    // reference below.
+    uint8_t *cpu_data;
+    size_t cpu_size;
+    size_t cpu_stride;
+    int cpu_width;
+    int cpu_height;
+    bool cpu_borrowed;
+    // Filter coefficients for the current placement, used by the software
+    // backend when the filter is not bilinear.
+    P1VideoScaler *cpu_scaler;
+    // Scaled output of a frame that is drawn again unchanged, used by the
+    // software backend. Holds the covered area of the canvas, filled row by
+    // row as tiles are composited, and is valid as long as the frame
+    // generation, placement and filter are the same.
+    uint8_t *cpu_cache;
+    size_t cpu_cache_size;
+    uint8_t *cpu_cache_rows;
+    int cpu_cache_height;
+    bool cpu_cache_keyed;
+    bool cpu_cache_active;
+    uint64_t cpu_cache_generation;
+    float cpu_cache_placement[8];
+    P1VideoFilter cpu_cache_filter;
+
+    // Frame passed by reference that the backend is still reading from, and
+    // the function to release it.
+    void *frame_ref;
+    P1VideoFrameRelease frame_ref_release;
+
+    // Damage tracking. Tracks the last frame passed, whether the backend
+    // still holds it, and whether it was replaced during this tick. Damage is
+    // in frame pixels. The generation counts frames stored, so derived data
+    // can tell when the frame was replaced.
+    int frame_width;
+    int frame_height;
+    uint64_t frame_generation;
+    bool frame_stored;
+    bool frame_changed;
+    bool damage_set;
+    int damage_x1, damage_y1, damage_x2, damage_y2;
+    // Placement as of the last composited frame.
+    bool drawn;
+    float drawn_x1, drawn_y1, drawn_x2, drawn_y2;
+    float drawn_u1, drawn_v1, drawn_u2, drawn_v2;
+    P1VideoFilter drawn_filter;
+    // Occlusion. Whether the source is entirely covered by sources drawn over
+    // it, and whether it covers others this tick.
+    bool hidden;
+    bool occluding;
+
+    // Triple-buffered frame latch, for sources that produce frames on their
+    // own thread. The producer owns the write buffer, the mixer owns the read
+    // buffer, and the shared buffer is swapped atomically.
+    P1VideoLatchBuffer latch_bufs[3];
+    int latch_write;
+    int latch_read;
+    int latch_shared;
+    // Latch statistics. Frames produced and skipped are counted by the
+    // producer, frames consumed by the mixer. Always accessed atomically, see
+    // p1_video_source_latch_stats.
+    uint64_t frames_produced;
+    uint64_t frames_consumed;
+    uint64_t frames_skipped;
+};
+
+// Degradation levels of the video mixer, when ticks overrun their frame
+// budget. Each level includes the ones before it.
+typedef enum _P1VideoDegrade {
+    P1_DEGRADE_NONE         = 0,
+    P1_DEGRADE_PREVIEW      = 1,    // Skip the preview.
+    P1_DEGRADE_COMPOSITE    = 2,    // Defer compositing, repeating the last frame.
+    P1_DEGRADE_STREAM       = 3     // Drop frames before encoding.
+} P1VideoDegrade;
+
 // Private part of P1Video.
 
 struct _P1VideoFull {
     P1Video super;
 
+    // Config
+    int cfg_width;
+    int cfg_height;
+    const P1VideoBackend *cfg_backend;
+    bool cfg_cpu_convert;
+    int cfg_threads;
+    int cfg_latency;
+
+    // Active backend, set once running.
+    const P1VideoBackend *backend;
+
+    // Whether the GL backend reads back frames and converts them on the CPU,
+    // instead of using OpenCL. Always the case without OpenCL support.
+    bool cpu_convert;
+
+    // Configured number of threads, zero for automatic.
+    int threads;
+
+    // Frames of latency allowed for readback. There is an output slot for each
+    // frame in flight, plus one to write to. Conversion starts in the write
+    // slot, and is finished from the read slot.
+    int latency;
+    int out_write;
+    int out_read;
+
+    // Ticks not yet streamed, oldest first, and whether each started a new
+    // conversion. Others repeat the previous frame.
+    int64_t pending_times[P1_VIDEO_MAX_LATENCY + 1];
+    bool pending_converted[P1_VIDEO_MAX_LATENCY + 1];
+    int pending_read;
+    int pending_used;
+
+    // Constant frame rate pacing. Streamed frames are placed on a grid of
+    // frame slots, starting at the first tick streamed.
+    bool pacing;
+    bool pace_started;
+    int64_t pace_origin;
+    int64_t pace_slot;
+
+    // Deadline tracking. Ticks over the frame budget raise the degradation
+    // level, and a run of ticks well within budget lowers it again.
+    P1VideoDegrade degrade;
+    int calm_ticks;
+
+    // Workers used for compositing and conversion on the CPU. The output is
+    // split into horizontal tiles, each an even number of rows.
+    P1WorkerPool workers;
+    int tile_height;
+    int num_tiles;
+
+    // Damage tracking. Flags for each tile, and a list of tile numbers used
+    // to hand out jobs for just some of the tiles.
+    uint8_t *tile_flags;
+    int *tile_jobs;
+    // Whether the canvas holds a complete frame to build upon.
+    bool canvas_valid;
+    // Source passed through to the output picture, if it still holds it.
+    P1VideoSource *out_src;
+
+    // Input of the current colorspace conversion.
+    const uint8_t *convert_in;
+    size_t convert_in_stride;
+
+    // Renditions, and the tiles of all renditions to convert. Each worker has
+    // a scratch row for scaling.
+    P1VideoRendition renditions[P1_MAX_RENDITIONS];
+    int num_renditions;
+    int *rendition_jobs;
+    int num_rendition_jobs;
+    uint8_t *rendition_rows;
+    size_t rendition_row_size;
+
+    // Scaled preview, and whether the canvas holds a frame not yet previewed.
+    P1VideoPreview preview;
+    bool preview_stale;
+
+    // Single source passthrough for the current frame. Set to the source if
+    // it may be converted directly into the output picture, skipping
+    // compositing. Done is set once it actually happened.
+    P1VideoSource *passthrough_src;
+    bool passthrough_done;
+
+#if P1_HAVE_GL
     // These are initialized by platform support
     P1GLContext gl;
-    cl_context cl;
     GLuint tex;
     GLuint fbo;
 
-    // Config
-    int cfg_width;
-    int cfg_height;
-
     // GL objects
     GLuint vao;
     GLuint vbo;
     GLuint program;
-    GLuint tex_u;
+    GLint textures_u;
+
+    // Number of texture units, and thus sources, used in a single draw call.
+    int gl_max_units;
+
+    // Quads drawn this frame, and the vertices currently in the buffer
+    // object. Quads are drawn in batches, one texture unit for each. The
+    // buffer object is only rewritten when the vertices change.
+    GLfloat *gl_verts;
+    GLfloat *gl_vbo_verts;
+    GLuint *gl_textures;
+    GLint *gl_firsts;
+    GLsizei *gl_counts;
+    int gl_num_quads;
+    int gl_vbo_quads;
+    int gl_max_quads;
+    int gl_vbo_max_quads;
+
+    // Pixel buffers for readback with CPU conversion, one for each output
+    // slot, and the one currently mapped. Unmapped when the next frame starts.
+    GLuint pbos[P1_VIDEO_MAX_LATENCY + 1];
+    int pbo_mapped;
+    const uint8_t *pbo_data;
+#endif
+
+#if P1_HAVE_CL
+    // Initialized by platform support
+    cl_context cl;
 
     // CL objects
     size_t out_size;
     size_t yuv_work_size[2];
     cl_command_queue clq;
     cl_mem tex_mem;
-    cl_mem out_mem;
     cl_kernel yuv_kernel;
 
+    // Output buffers the kernel writes to, one for each output slot. These
+    // are allocated in host accessible memory and mapped for reading once the
+    // kernel is done, instead of copied. The slot picture points straight at
+    // the mapping, which lasts until the slot is converted into again. Events
+    // signal the mapping is ready.
+    cl_mem out_mems[P1_VIDEO_MAX_LATENCY + 1];
+    void *out_maps[P1_VIDEO_MAX_LATENCY + 1];
+    x264_picture_t out_pics[P1_VIDEO_MAX_LATENCY + 1];
+    cl_event out_events[P1_VIDEO_MAX_LATENCY + 1];
+    // Signals the kernel released the rendered frame, so GL may draw again.
+    cl_event tex_event;
+#endif
+
+    // Software backend canvas, in BGRA format.
+    uint8_t *canvas;
+    size_t canvas_stride;
+
+    // Software backend draw list. Drawing is deferred until the end of the
+    // frame, when tiles are composited in parallel.
+    P1VideoCPUDraw *cpu_draws;
+    int cpu_num_draws;
+    int cpu_max_draws;
+
+    // Software backend scratch space. There is a column sample table for
+    // each draw, and a scratch row for each worker.
+    P1VideoCPUSample *cpu_xmap;
+    uint8_t *cpu_rows;
+    size_t cpu_row_size;
+
     // Output
     x264_picture_t out_pic;
+
+    // Picture handed to the connection, which copies it for the encoder
+    // before returning. This is the output picture, unless the backend
+    // finished conversion into memory of its own.
+    x264_picture_t *stream_pic;
 };
 
 bool p1_video_init(P1VideoFull *videof, P1Context *ctx);
@@ -116,11 +614,74 @@ void p1_video_notify(P1VideoFull *videof, P1Notification *n);
 void p1_video_start(P1VideoFull *videof);
 void p1_video_stop(P1VideoFull *videof);
 
+#if P1_HAVE_GL
+// Map the frame read back by the GL backend into an output slot, when using
+// CPU conversion. Returns NULL on failure.
+const uint8_t *p1_video_gl_readback(P1VideoFull *videof, int slot);
+#endif
+
+#if P1_HAVE_CL
 void p1_video_cl_notify_callback(const char *errstr, const void *private_info, size_t cb, void *user_data);
+#endif
+
+// Colorspace conversion of BGRA rows [y1, y2) into NV12 picture planes. Both row
+// numbers must be even, as must the width.
+void p1_video_bgra_to_yuv(x264_picture_t *pic, int width, const uint8_t *in, size_t in_stride, int y1, int y2);
+// Name of the instruction set used by p1_video_bgra_to_yuv.
+const char *p1_video_bgra_to_yuv_isa();
+
+// Compare the luma planes of two pictures per 16x16 macroblock, and set a byte
+// in the map for each, in raster order, to 1 if it changed or 0 if not. Returns
+// the number of changed macroblocks.
+int p1_video_change_map(uint8_t *map, const x264_picture_t *cur, const x264_picture_t *prev, int width, int height);
+// Name of the instruction set used by p1_video_change_map.
+const char *p1_video_change_map_isa();
+
+// Compute filter coefficients for an axis, unless they are already current.
+// Returns false if allocation failed.
+bool p1_video_scale_axis_update(P1VideoScaleAxis *axis, P1VideoFilter filter, int in_size, int out_size,
+                                int begin, int end, float p1, float p2, float t1, float t2);
+void p1_video_scale_axis_free(P1VideoScaleAxis *axis);
+// Size of the scratch row needed by p1_video_scale_rows.
+size_t p1_video_scale_scratch_size(const P1VideoScaler *scaler);
+// Scale BGRA input into output rows [y1, y2), which must be within the range
+// of the vertical axis. Only the columns of the horizontal axis are written.
+void p1_video_scale_rows(const P1VideoScaler *scaler, uint8_t *out, size_t out_stride,
+                         const uint8_t *in, size_t in_stride, int y1, int y2, uint8_t *scratch);
+// Radius of a filter in input samples, when not shrinking.
+double p1_video_filter_radius(P1VideoFilter filter);
+// Name of the instruction set used by p1_video_scale_rows.
+const char *p1_video_scale_isa();
+
+// Tile flags. Dirty tiles need to be composited, stale tiles need to be
+// converted.
+#define P1_TILE_DIRTY   0x01
+#define P1_TILE_STALE   0x02
+
+// Collect the numbers of tiles with the given flag in tile_jobs. Returns the
+// number of tiles found.
+int p1_video_collect_tiles(P1VideoFull *videof, uint8_t flag);
+
+// Colorspace conversion of the stale tiles of a frame into the output
+// picture, in parallel.
+void p1_video_convert_frame(P1VideoFull *videof, const uint8_t *in, size_t in_stride);
+// Same, but converts all tiles regardless of flags.
+void p1_video_convert_full(P1VideoFull *videof, const uint8_t *in, size_t in_stride);
+
+// Pass a source frame straight to the output picture, if this is the
+// passthrough source and the frame matches the output. Returns false if the
+// frame should be uploaded instead.
+bool p1_video_passthrough(P1VideoFull *videof, P1VideoSource *vsrc, int width, int height, size_t stride, const void *data);
 
 void p1_video_clock_notify(P1VideoClock *vclock, P1Notification *n);
 void p1_video_source_notify(P1VideoSource *vsrc, P1Notification *n);
 
+// Update damage tracking state after a frame was uploaded to the backend.
+void p1_video_source_stored(P1VideoSource *vsrc, int width, int height);
+// Free the private part of a video source. Called by p1_plugin_free after the
+// plugin free method, which may still use the latch.
+void p1_video_source_free_priv(P1VideoSourcePriv *priv);
+
 
 // Private part of P1Audio.
 
@@ -135,6 +696,9 @@ struct _P1AudioFull {
     int16_t *out;
     size_t out_pos;
     int64_t out_time;
+    // Samples of the output buffer each connection has taken. Samples are
+    // removed once all connections took them.
+    size_t conn_pos[P1_NUM_CONNECTIONS];
 
     // Mix thread
     pthread_t thread;
@@ -155,13 +719,29 @@ void p1_audio_source_notify(P1AudioSource *asrc, P1Notification *n);
 
 // Private part of P1StreamConnection.
 
+// What to drop when the video encoder falls behind and the picture ring is
+// full.
+typedef enum _P1VideoRingDrop {
+    P1_VIDEO_RING_DROP_OLDEST,
+    P1_VIDEO_RING_DROP_NEWEST
+} P1VideoRingDrop;
+
 struct _P1ConnectionFull {
     P1Connection super;
 
-    // Config
+    // Rendition number, or zero for the main connection.
+    int rendition;
+
+    // Config. Renditions are enabled by configuring a URL.
+    bool cfg_enabled;
     char cfg_url[2048];
     x264_param_t cfg_video_params;
     int cfg_buffer_size;
+    int cfg_video_ring_size;
+    P1VideoRingDrop cfg_video_ring_drop;
+    bool cfg_change_stats;
+    float cfg_change_qp_static;
+    float cfg_change_qp_changed;
 
     // RTMP state
     char url[2048];
@@ -184,17 +764,53 @@ struct _P1ConnectionFull {
 
     // Video encoding
     pthread_mutex_t video_lock;
+    int video_width;
+    int video_height;
     x264_param_t video_params;
     float keyint_sec;
     x264_t *video_enc;
 
+    // Picture ring, filled on the video clock thread and drained by the
+    // encoder thread. The ring and its indices are protected by video_lock.
+    int video_ring_size;
+    P1VideoRingDrop video_ring_drop;
+    x264_picture_t *video_ring;
+    int video_ring_read;
+    int video_ring_used;
+    uint64_t video_ring_dropped;
+    bool video_ring_lagging;
+
+    // Encoder thread, and the picture it is currently encoding.
+    pthread_t video_thread;
+    pthread_cond_t video_cond;
+    bool video_thread_stop;
+    x264_picture_t video_pic;
+
+    // Change statistics. When enabled, the encoder thread keeps the previous
+    // picture, and counts the macroblocks that changed. Only with non-zero
+    // offsets does it also hint x264 with quantizer offsets for changed and
+    // static macroblocks. Only accessed on the encoder thread while running.
+    bool change_stats;
+    float change_qp_static;
+    float change_qp_changed;
+    x264_picture_t video_prev;
+    bool video_prev_valid;
+    uint8_t *change_mbs;
+    float *change_offsets;
+    int change_mb_count;
+    int change_keyint;
+    int change_frames_since_key;
+    uint64_t change_frames;
+    uint64_t change_mbs_total;
+    uint64_t change_mbs_changed;
+
     // Audio encoding
     pthread_mutex_t audio_lock;
     HANDLE_AACENCODER audio_enc;
     void *audio_out;
 };
 
-bool p1_conn_init(P1ConnectionFull *connf, P1Context *ctx);
+bool p1_conn_init(P1ConnectionFull *connf, P1Context *ctx, int rendition);
 void p1_conn_destroy(P1ConnectionFull *connf);
 
 void p1_conn_config(P1ConnectionFull *connf, P1Config *cfg);
@@ -1,82 +1,69 @@
 #include "p1stream_priv.h"
 
+#include <math.h>
+#include <stdlib.h>
 #include <string.h>
-
+#include <unistd.h>
+
+// Limit for automatic worker thread count.
+static const int max_auto_threads = 8;
+
+// The shared latch index is marked fresh when it holds a frame that the mixer
+// has not yet seen.
+static const int latch_index_mask = 0x3;
+static const int latch_fresh = 0x4;
+
+// Source filter names, indexed by P1VideoFilter.
+static const char *filter_names[] = { "bilinear", "bicubic", "lanczos", NULL };
+
+// Consecutive ticks within half the frame budget needed to lower the
+// degradation level.
+static const int degrade_calm_ticks = 30;
+static const char *degrade_names[] = {
+    "none", "skipping previews", "deferring compositing", "dropping frames"
+};
+
+// Most frames duplicated for missed ticks. A longer stall leaves a gap in
+// timestamps, rather than flooding the encoder.
+static const int pace_max_duplicates = 3;
+
+static bool p1_video_config_filter(P1Object *obj, P1Config *cfg, P1VideoFilter *out);
+static bool p1_video_config_rendition(P1VideoFull *videof, P1VideoRendition *r, P1Config *cfg);
+static bool p1_video_start_renditions(P1VideoFull *videof, int num_workers);
+static void p1_video_stop_renditions(P1VideoFull *videof);
 static void p1_video_kill_session(P1VideoFull *videof);
-static void p1_video_link_source(P1VideoSource *vsrc);
-static void p1_video_unlink_source(P1VideoSource *vsrc);
-static GLuint p1_build_shader(P1Object *videoobj, GLuint type, const char *source);
-static bool p1_video_build_program(P1Object *videoobj, GLuint program, const char *vertexShader, const char *fragmentShader);
-
-static const char *simple_vertex_shader =
-    "#version 150\n"
-
-    "uniform sampler2DRect u_Texture;\n"
-    "in vec2 a_Position;\n"
-    "in vec2 a_TexCoords;\n"
-    "out vec2 v_TexCoords;\n"
-
-    "void main(void) {\n"
-        "gl_Position = vec4(a_Position.x, a_Position.y, 0.0, 1.0);\n"
-        "v_TexCoords = a_TexCoords * textureSize(u_Texture);\n"
-    "}\n";
-
-static const char *simple_fragment_shader =
-    "#version 150\n"
-
-    "uniform sampler2DRect u_Texture;\n"
-    "in vec2 v_TexCoords;\n"
-    "out vec4 o_FragColor;\n"
-
-    "void main(void) {\n"
-        "o_FragColor = texture(u_Texture, v_TexCoords);\n"
-    "}\n";
-
-static const char *yuv_kernel_source =
-    "const sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_LINEAR;\n"
-
-    "kernel void yuv(read_only image2d_t input, global write_only uchar* output)\n"
-    "{\n"
-        "size_t wUV = get_global_size(0);\n"
-        "size_t hUV = get_global_size(1);\n"
-        "size_t xUV = get_global_id(0);\n"
-        "size_t yUV = get_global_id(1);\n"
-
-        "size_t wY = wUV * 2;\n"
-        "size_t hY = hUV * 2;\n"
-        "size_t xY = xUV * 2;\n"
-        "size_t yY = yUV * 2;\n"
-
-        "float2 xyImg = (float2)(xY, yY);\n"
-        "size_t lenUV = wUV * hUV;\n"
-        "size_t lenY = wY * hY;\n"
-
-        "float4 s;\n"
-        "size_t base;\n"
-        "float value;\n"
-
-        // Write 2x2 block of Y values.
-        "base = yY * wY + xY;\n"
-        "for (size_t dx = 0; dx < 2; dx++) {\n"
-            "for (size_t dy = 0; dy < 2; dy++) {\n"
-                "s = read_imagef(input, sampler, xyImg + (float2)(dx, dy) + 0.5f);\n"
-                "value = 16 + 65.481f*s.r + 128.553f*s.g + 24.966f*s.b;\n"
-                "output[base + dy * wY + dx] = value;\n"
-            "}\n"
-        "}\n"
-
-        // Write UV values.
-        "s = read_imagef(input, sampler, xyImg + 1.0f);\n"
-        "base = yUV * wUV + xUV;\n"
-        "value = 128 - 37.797f*s.r - 74.203f*s.g + 112.0f*s.b;\n"
-        "output[lenY + base] = value;\n"
-        "value = 128 + 112.0f*s.r - 93.786f*s.g - 18.214f*s.b;\n"
-        "output[lenY + lenUV + base] = value;\n"
-    "}\n";
-
-static const GLsizei vbo_stride = 4 * sizeof(GLfloat);
-static const GLsizei vbo_size = 4 * vbo_stride;
-static const void *vbo_tex_coord_offset = (void *)(2 * sizeof(GLfloat));
+static bool p1_video_is_streaming(P1VideoFull *videof);
+static void p1_video_stream_pictures(P1VideoFull *videof, int64_t time);
+static bool p1_video_stream(P1VideoFull *videof, int64_t time, bool converted);
+static bool p1_video_discard_pending(P1VideoFull *videof);
+static double p1_video_frame_length(P1VideoFull *videof);
+static int p1_video_pace(P1VideoFull *videof, int64_t *time);
+static int64_t p1_video_slot_time(P1VideoFull *videof, int64_t slot);
+static void p1_video_track_deadline(P1VideoFull *videof, int64_t start);
+static void p1_video_convert_tile(void *data, int job, int worker);
+static void p1_video_convert_renditions(P1VideoFull *videof, bool full);
+static void p1_video_convert_rendition_tile(void *data, int job, int worker);
+static void p1_video_update_occlusion(P1VideoFull *videof);
+static bool p1_video_check_occlusion(P1VideoFull *videof);
+static void p1_video_set_hidden(P1VideoSource *vsrc, bool hidden);
+static bool p1_video_source_rect(P1VideoFull *videof, P1VideoSource *vsrc, P1VideoRect *out);
+static bool p1_video_rect_covered(const P1VideoRect *rect, const P1VideoRect *rects, int num_rects);
+static bool p1_video_update_damage(P1VideoFull *videof);
+static void p1_video_damage_rows(P1VideoFull *videof, float y1, float y2);
+static void p1_video_damage_frame(P1VideoFull *videof, P1VideoSource *vsrc);
+static int p1_video_filter_margin(P1VideoFull *videof, P1VideoSource *vsrc);
+static void p1_video_link_source(P1VideoFull *videof, P1VideoSource *vsrc);
+static void p1_video_unlink_source(P1VideoFull *videof, P1VideoSource *vsrc);
+static void p1_video_release_frame_ref(P1VideoSource *vsrc);
+
+// Available backends. The first is the default.
+static const P1VideoBackend *backends[] = {
+#if P1_HAVE_GL
+    &p1_video_gl_backend,
+#endif
+    &p1_video_cpu_backend,
+    NULL
+};
 
 
 bool p1_video_init(P1VideoFull *videof, P1Context *ctx)
@@ -102,6 +89,8 @@ void p1_video_config(P1VideoFull *videof, P1Config *cfg)
 {
     P1Video *video = (P1Video *) videof;
     P1Object *videoobj = (P1Object *) videof;
+    char s_tmp[128];
+    int i;
 
     p1_object_reset_config_flags(videoobj);
 
@@ -114,19 +103,144 @@ void p1_video_config(P1VideoFull *videof, P1Config *cfg)
         return;
     }
 
-    if ((videof->cfg_width % 1) != 0 || (videof->cfg_height % 1) != 0) {
+    if ((videof->cfg_width % 2) != 0 || (videof->cfg_height % 2) != 0) {
         p1_log(videoobj, P1_LOG_ERROR, "Video dimensions must be multiples of 2.");
         p1_object_clear_flag(videoobj, P1_FLAG_CONFIG_VALID);
         return;
     }
 
-    if (videof->cfg_width  != video->width ||
-        videof->cfg_height != video->height)
+    videof->cfg_backend = backends[0];
+    if (cfg->get_string(cfg, "video-backend", s_tmp, sizeof(s_tmp))) {
+        for (i = 0; backends[i] != NULL; i++) {
+            if (strcmp(backends[i]->name, s_tmp) == 0)
+                break;
+        }
+
+        if (backends[i] == NULL) {
+            p1_log(videoobj, P1_LOG_ERROR, "Unsupported video backend '%s'.", s_tmp);
+            p1_object_clear_flag(videoobj, P1_FLAG_CONFIG_VALID);
+            return;
+        }
+
+        videof->cfg_backend = backends[i];
+    }
+
+#if P1_HAVE_CL
+    videof->cfg_cpu_convert = false;
+    cfg->get_bool(cfg, "video-cpu-convert", &videof->cfg_cpu_convert);
+#else
+    // Without OpenCL, the GL backend always converts on the CPU.
+    videof->cfg_cpu_convert = true;
+#endif
+
+    // Zero means automatic, based on the number of CPUs.
+    videof->cfg_threads = 0;
+    cfg->get_int(cfg, "video-threads", &videof->cfg_threads);
+    if (videof->cfg_threads < 0) {
+        p1_log(videoobj, P1_LOG_ERROR, "Invalid number of video threads.");
+        p1_object_clear_flag(videoobj, P1_FLAG_CONFIG_VALID);
+        return;
+    }
+
+    // Snap timestamps to the frame rate. This applies immediately.
+    videof->pacing = true;
+    cfg->get_bool(cfg, "video-pacing", &videof->pacing);
+    videof->pace_started = false;
+
+    // Frames of latency traded for readback overlapping rendering.
+    videof->cfg_latency = 0;
+    cfg->get_int(cfg, "video-latency", &videof->cfg_latency);
+    if (videof->cfg_latency < 0 || videof->cfg_latency > P1_VIDEO_MAX_LATENCY) {
+        p1_log(videoobj, P1_LOG_ERROR, "Video latency must be between 0 and %d frames.", P1_VIDEO_MAX_LATENCY);
+        p1_object_clear_flag(videoobj, P1_FLAG_CONFIG_VALID);
+        return;
+    }
+
+    for (i = 0; i < P1_MAX_RENDITIONS; i++) {
+        P1VideoRendition *r = &videof->renditions[i];
+        P1PrefixConfig pcfg;
+
+        p1_rendition_config_init(&pcfg, cfg, i + 1);
+        if (!p1_video_config_rendition(videof, r, (P1Config *) &pcfg)) {
+            p1_object_clear_flag(videoobj, P1_FLAG_CONFIG_VALID);
+            return;
+        }
+
+        // Renditions are scaled from the frame in memory.
+        if (r->cfg_width != 0)
+            videof->cfg_cpu_convert = true;
+
+        if (r->cfg_width  != r->width  ||
+            r->cfg_height != r->height ||
+            r->cfg_filter != r->filter)
+            p1_object_set_flag(videoobj, P1_FLAG_NEEDS_RESTART);
+    }
+
+    if (videof->cfg_width       != video->width    ||
+        videof->cfg_height      != video->height   ||
+        videof->cfg_backend     != videof->backend ||
+        videof->cfg_cpu_convert != videof->cpu_convert ||
+        videof->cfg_threads     != videof->threads ||
+        videof->cfg_latency     != videof->latency)
         p1_object_set_flag(videoobj, P1_FLAG_NEEDS_RESTART);
 
     p1_object_notify(videoobj);
 }
 
+// Read a filter name, if configured. Returns false if it is invalid.
+static bool p1_video_config_filter(P1Object *obj, P1Config *cfg, P1VideoFilter *out)
+{
+    char s_tmp[128];
+    int i;
+
+    if (!cfg->get_string(cfg, "filter", s_tmp, sizeof(s_tmp)))
+        return true;
+
+    for (i = 0; filter_names[i] != NULL; i++) {
+        if (strcmp(filter_names[i], s_tmp) == 0) {
+            *out = (P1VideoFilter) i;
+            return true;
+        }
+    }
+
+    p1_log(obj, P1_LOG_ERROR, "Unsupported filter '%s'.", s_tmp);
+    return false;
+}
+
+// Read the configuration of a rendition. Renditions without dimensions are
+// not used.
+static bool p1_video_config_rendition(P1VideoFull *videof, P1VideoRendition *r, P1Config *cfg)
+{
+    P1Object *videoobj = (P1Object *) videof;
+    P1PrefixConfig *pcfg = (P1PrefixConfig *) cfg;
+
+    bool have_width  = cfg->get_int(cfg, "width",  &r->cfg_width);
+    bool have_height = cfg->get_int(cfg, "height", &r->cfg_height);
+
+    if (!have_width && !have_height) {
+        r->cfg_width = 0;
+        r->cfg_height = 0;
+        r->cfg_filter = P1_FILTER_BILINEAR;
+        return true;
+    }
+
+    if (!have_width || !have_height || r->cfg_width <= 0 || r->cfg_height <= 0) {
+        p1_log(videoobj, P1_LOG_ERROR, "Invalid dimensions for %.*s.",
+               (int) strlen(pcfg->prefix) - 1, pcfg->prefix);
+        return false;
+    }
+
+    if ((r->cfg_width % 2) != 0 || (r->cfg_height % 2) != 0) {
+        p1_log(videoobj, P1_LOG_ERROR, "Dimensions of %.*s must be multiples of 2.",
+               (int) strlen(pcfg->prefix) - 1, pcfg->prefix);
+        return false;
+    }
+
+    // Shrinking is the common case, which bilinear does poorly.
+    r->cfg_filter = P1_FILTER_BICUBIC;
+    return p1_video_config_filter(videoobj, cfg, &r->cfg_filter);
+}
+
 void p1_video_notify(P1VideoFull *videof, P1Notification *n)
 {
     P1Object *obj = n->object;
@@ -137,16 +251,15 @@ void p1_video_notify(P1VideoFull *videof, P1Notification *n)
     // When video sources change state, link/unlink them.
     if (obj->type == P1_OTYPE_VIDEO_SOURCE &&
             n->state.current != n->last_state.current &&
-            videoobj->state.current == P1_STATE_RUNNING &&
-            p1_video_activate_gl(videof)) {
+            videoobj->state.current == P1_STATE_RUNNING) {
 
         P1VideoSource *vsrc = (P1VideoSource *) obj;
         p1_object_lock(obj);
 
         if (obj->state.current == P1_STATE_RUNNING)
-            p1_video_link_source(vsrc);
+            p1_video_link_source(videof, vsrc);
         else
-            p1_video_unlink_source(vsrc);
+            p1_video_unlink_source(videof, vsrc);
 
         p1_object_unlock(obj);
     }
@@ -160,113 +273,83 @@ void p1_video_start(P1VideoFull *videof)
     P1Object *videoobj = (P1Object *) videof;
     P1ListNode *head;
     P1ListNode *node;
-    cl_int cl_err;
-    GLenum gl_err;
+    int num_workers;
     int i_ret;
-    bool b_ret;
-    size_t size;
+    int i;
 
     video->width = videof->cfg_width;
     video->height = videof->cfg_height;
-    videof->out_size = video->width * video->height * 1.5;
-    videof->yuv_work_size[0] = video->width / 2;
-    videof->yuv_work_size[1] = video->height / 2;
-
-    b_ret = p1_video_init_platform(videof);
-    if (!b_ret)
-        goto fail;
-
-    cl_device_id device_id;
-    cl_err = clGetContextInfo(videof->cl, CL_CONTEXT_DEVICES, sizeof(cl_device_id), &device_id, &size);
-    if (cl_err != CL_SUCCESS || size == 0) {
-        p1_log(videoobj, P1_LOG_ERROR, "Failed to get CL device info: OpenCL error %d", cl_err);
-        goto fail_platform;
+    videof->backend = videof->cfg_backend;
+    videof->cpu_convert = videof->cfg_cpu_convert;
+    videof->threads = videof->cfg_threads;
+
+    // Only backends that can finish conversion later support latency.
+    videof->latency = videof->backend->finish ? videof->cfg_latency : 0;
+    videof->out_write = 0;
+    videof->out_read = 0;
+    videof->pending_read = 0;
+    videof->pending_used = 0;
+    videof->pace_started = false;
+    video->frames_duplicated = 0;
+    video->frames_dropped = 0;
+    videof->degrade = P1_DEGRADE_NONE;
+    videof->calm_ticks = 0;
+    video->ticks_late = 0;
+    video->previews_skipped = 0;
+    video->composites_deferred = 0;
+    video->frames_shed = 0;
+
+    num_workers = videof->threads;
+    if (num_workers == 0) {
+        num_workers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+        if (num_workers < 1)
+            num_workers = 1;
+        else if (num_workers > max_auto_threads)
+            num_workers = max_auto_threads;
     }
 
-    videof->clq = clCreateCommandQueue(videof->cl, device_id, 0, &cl_err);
-    if (cl_err != CL_SUCCESS) {
-        p1_log(videoobj, P1_LOG_ERROR, "Failed to create CL command queue: OpenCL error %d", cl_err);
-        goto fail_platform;
+    // A few tiles per worker evens out the load. Tiles only divide the work,
+    // the output does not depend on them.
+    videof->tile_height = (video->height + num_workers * 4 - 1) / (num_workers * 4);
+    videof->tile_height += videof->tile_height % 2;
+    if (videof->tile_height < 16)
+        videof->tile_height = 16;
+    videof->num_tiles = (video->height + videof->tile_height - 1) / videof->tile_height;
+
+    videof->tile_flags = calloc(videof->num_tiles, sizeof(uint8_t));
+    videof->tile_jobs = calloc(videof->num_tiles, sizeof(int));
+    if (videof->tile_flags == NULL || videof->tile_jobs == NULL) {
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to allocate tile state");
+        goto fail_tiles;
     }
+    videof->canvas_valid = false;
+    videof->out_src = NULL;
 
-    i_ret = x264_picture_alloc(&videof->out_pic, X264_CSP_I420, video->width, video->height);
+    i_ret = x264_picture_alloc(&videof->out_pic, X264_CSP_NV12, video->width, video->height);
     if (i_ret < 0) {
         p1_log(videoobj, P1_LOG_ERROR, "Failed to alloc x264 picture buffer");
-        goto fail_clq;
+        goto fail_tiles;
     }
+    videof->stream_pic = &videof->out_pic;
 
-    glGenVertexArrays(1, &videof->vao);
-    glGenBuffers(1, &videof->vbo);
-    videof->program = glCreateProgram();
-    if ((gl_err = glGetError()) != GL_NO_ERROR) {
-        p1_log(videoobj, P1_LOG_ERROR, "Failed to create GL objects: OpenGL error %d", gl_err);
+    if (!p1_worker_pool_init(&videof->workers, videoobj, num_workers))
         goto fail_out_pic;
-    }
-
-    glBindAttribLocation(videof->program, 0, "a_Position");
-    glBindAttribLocation(videof->program, 1, "a_TexCoords");
-    glBindFragDataLocation(videof->program, 0, "o_FragColor");
-    b_ret = p1_video_build_program(videoobj, videof->program, simple_vertex_shader, simple_fragment_shader);
-    if (!b_ret)
-        goto fail_out_pic;
-    videof->tex_u = glGetUniformLocation(videof->program, "u_Texture");
 
-    videof->tex_mem = clCreateFromGLTexture(videof->cl, CL_MEM_READ_ONLY, GL_TEXTURE_RECTANGLE, 0, videof->tex, &cl_err);
-    if (cl_err != CL_SUCCESS) {
-        p1_log(videoobj, P1_LOG_ERROR, "Failed to create CL input buffer: OpenCL error %d", cl_err);
-        goto fail_out_pic;
-    }
-
-    videof->out_mem = clCreateBuffer(videof->cl, CL_MEM_WRITE_ONLY, videof->out_size, NULL, &cl_err);
-    if (cl_err != CL_SUCCESS) {
-        p1_log(videoobj, P1_LOG_ERROR, "Failed to create CL output buffer: OpenCL error %d", cl_err);
-        goto fail_tex_mem;
-    }
-
-    cl_program yuv_program = clCreateProgramWithSource(videof->cl, 1, &yuv_kernel_source, NULL, &cl_err);
-    if (cl_err != CL_SUCCESS) {
-        p1_log(videoobj, P1_LOG_ERROR, "Failed to create CL program: OpenCL error %d", cl_err);
-        goto fail_out_mem;
-    }
-    cl_err = clBuildProgram(yuv_program, 0, NULL, NULL, NULL, NULL);
-    if (cl_err != CL_SUCCESS) {
-        p1_log(videoobj, P1_LOG_ERROR, "Failed to build CL program: OpenCL error %d", cl_err);
-        clReleaseProgram(yuv_program);
-        goto fail_out_mem;
-    }
-    videof->yuv_kernel = clCreateKernel(yuv_program, "yuv", &cl_err);
-    clReleaseProgram(yuv_program);
-    if (cl_err != CL_SUCCESS) {
-        p1_log(videoobj, P1_LOG_ERROR, "Failed to create CL kernel: OpenCL error %d", cl_err);
-        goto fail_out_mem;
-    }
-
-    // GL state init. Most of this is up here because we can.
-    glViewport(0, 0, video->width, video->height);
-    glClearColor(0, 0, 0, 1);
-    glActiveTexture(GL_TEXTURE0);
-    glBindBuffer(GL_ARRAY_BUFFER, videof->vbo);
-    glUseProgram(videof->program);
-    glUniform1i(videof->tex_u, 0);
-    glBindVertexArray(videof->vao);
-    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, vbo_stride, 0);
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, vbo_stride, vbo_tex_coord_offset);
-    glEnableVertexAttribArray(0);
-    glEnableVertexAttribArray(1);
-    if ((gl_err = glGetError()) != GL_NO_ERROR) {
-        p1_log(videoobj, P1_LOG_ERROR, "Failed to initialize GL state: OpenGL error %d", gl_err);
-        goto fail_yuv_kernel;
-    }
-
-    cl_err = clSetKernelArg(videof->yuv_kernel, 0, sizeof(cl_mem), &videof->tex_mem);
-    if (cl_err != CL_SUCCESS) {
-        p1_log(videoobj, P1_LOG_ERROR, "Failed to set CL kernel arg: OpenCL error %d", cl_err);
-        goto fail_yuv_kernel;
-    }
-    cl_err = clSetKernelArg(videof->yuv_kernel, 1, sizeof(cl_mem), &videof->out_mem);
-    if (cl_err != CL_SUCCESS) {
-        p1_log(videoobj, P1_LOG_ERROR, "Failed to set CL kernel arg: OpenCL error %d", cl_err);
-        goto fail_yuv_kernel;
+    if (!p1_video_start_renditions(videof, num_workers))
+        goto fail_workers;
+
+    if (!videof->backend->start(videof))
+        goto fail_renditions;
+
+    p1_log(videoobj, P1_LOG_INFO, "Using %s video backend with %d threads",
+           videof->backend->name, num_workers);
+    if (videof->latency != 0)
+        p1_log(videoobj, P1_LOG_INFO, "Allowing %d frames of readback latency", videof->latency);
+    for (i = 0; i < P1_MAX_RENDITIONS; i++) {
+        P1VideoRendition *r = &videof->renditions[i];
+        if (r->width != 0)
+            p1_log(videoobj, P1_LOG_INFO, "Rendition %d is %dx%d, using %s scaling",
+                   i + 1, r->width, r->height, p1_video_scale_isa());
     }
 
     // Change state.
@@ -281,38 +364,26 @@ void p1_video_start(P1VideoFull *videof)
         P1VideoSource *vsrc = (P1VideoSource *) src;
 
         if (obj->state.current == P1_STATE_RUNNING)
-            p1_video_link_source(vsrc);
+            p1_video_link_source(videof, vsrc);
     }
 
     return;
 
-fail_yuv_kernel:
-    cl_err = clReleaseKernel(videof->yuv_kernel);
-    if (cl_err != CL_SUCCESS)
-        p1_log(videoobj, P1_LOG_ERROR, "Failed to release CL kernel: OpenCL error %d", cl_err);
+fail_renditions:
+    p1_video_stop_renditions(videof);
 
-fail_out_mem:
-    cl_err = clReleaseMemObject(videof->out_mem);
-    if (cl_err != CL_SUCCESS)
-        p1_log(videoobj, P1_LOG_ERROR, "Failed to release CL output buffer: OpenCL error %d", cl_err);
-
-fail_tex_mem:
-    cl_err = clReleaseMemObject(videof->tex_mem);
-    if (cl_err != CL_SUCCESS)
-        p1_log(videoobj, P1_LOG_ERROR, "Failed to release CL input buffer: OpenCL error %d", cl_err);
+fail_workers:
+    p1_worker_pool_destroy(&videof->workers);
 
 fail_out_pic:
     x264_picture_clean(&videof->out_pic);
 
-fail_clq:
-    cl_err = clReleaseCommandQueue(videof->clq);
-    if (cl_err != CL_SUCCESS)
-        p1_log(videoobj, P1_LOG_ERROR, "Failed to release CL command queue: OpenCL error %d", cl_err);
-
-fail_platform:
-    p1_video_destroy_platform(videof);
+fail_tiles:
+    free(videof->tile_flags);
+    free(videof->tile_jobs);
+    videof->tile_flags = NULL;
+    videof->tile_jobs = NULL;
 
-fail:
     videoobj->state.current = P1_STATE_IDLE;
     videoobj->state.flags |= P1_FLAG_ERROR;
     p1_object_notify(videoobj);
@@ -331,68 +402,915 @@ void p1_video_stop(P1VideoFull *videof)
 static void p1_video_kill_session(P1VideoFull *videof)
 {
     P1Video *video = (P1Video *) videof;
+    P1ListNode *head;
+    P1ListNode *node;
+
+    // The backend frees resources of linked sources, so this is a quick
+    // unlink of all sources.
+    videof->backend->stop(videof);
+
+    head = &video->sources;
+    p1_list_iterate(head, node) {
+        P1Source *src = p1_list_get_container(node, P1Source, link);
+        P1VideoSource *vsrc = (P1VideoSource *) src;
+        P1VideoSourcePriv *priv = vsrc->priv;
+
+        priv->linked = false;
+        priv->frame_stored = false;
+        priv->drawn = false;
+        p1_video_release_frame_ref(vsrc);
+    }
+
+    p1_video_preview_stop(videof);
+    p1_video_stop_renditions(videof);
+    p1_worker_pool_destroy(&videof->workers);
+    x264_picture_clean(&videof->out_pic);
+
+    free(videof->tile_flags);
+    free(videof->tile_jobs);
+    videof->tile_flags = NULL;
+    videof->tile_jobs = NULL;
+}
+
+// Allocate rendition pictures, and tiles for conversion. Rendition tiles are
+// sized like those of the output.
+static bool p1_video_start_renditions(P1VideoFull *videof, int num_workers)
+{
     P1Object *videoobj = (P1Object *) videof;
+    size_t row_size = 0;
+    size_t size;
+    int num_jobs = 0;
+    int i, ret;
+
+    for (i = 0; i < P1_MAX_RENDITIONS; i++) {
+        P1VideoRendition *r = &videof->renditions[i];
+
+        r->width = r->cfg_width;
+        r->height = r->cfg_height;
+        r->filter = r->cfg_filter;
+        r->pic_valid = false;
+        if (r->width == 0)
+            continue;
+
+        r->tile_height = (r->height + num_workers * 4 - 1) / (num_workers * 4);
+        r->tile_height += r->tile_height % 2;
+        if (r->tile_height < 16)
+            r->tile_height = 16;
+        r->num_tiles = (r->height + r->tile_height - 1) / r->tile_height;
+        r->first_job = num_jobs;
+        num_jobs += r->num_tiles;
+
+        r->canvas_stride = (size_t) r->width * 4;
+        ret = posix_memalign((void **) &r->canvas, 64, r->canvas_stride * r->height);
+        if (ret != 0) {
+            r->canvas = NULL;
+            p1_log(videoobj, P1_LOG_ERROR, "Failed to allocate rendition canvas: %s", strerror(ret));
+            goto fail;
+        }
+
+        ret = x264_picture_alloc(&r->pic, X264_CSP_NV12, r->width, r->height);
+        if (ret < 0) {
+            r->width = 0;
+            p1_log(videoobj, P1_LOG_ERROR, "Failed to alloc x264 picture buffer");
+            goto fail;
+        }
+
+        videof->num_renditions++;
+    }
+
+    if (num_jobs == 0)
+        return true;
+
+    videof->rendition_jobs = calloc(num_jobs, sizeof(int));
+    if (videof->rendition_jobs == NULL) {
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to allocate rendition tiles");
+        goto fail;
+    }
+
+    // Renditions always scale the full output frame.
+    for (i = 0; i < P1_MAX_RENDITIONS; i++) {
+        P1VideoRendition *r = &videof->renditions[i];
+        P1Video *video = (P1Video *) videof;
+
+        if (r->width == 0)
+            continue;
+
+        if (!p1_video_scale_axis_update(&r->scaler.x, r->filter, video->width, r->width,
+                                        0, r->width, -1, 1, 0, 1) ||
+            !p1_video_scale_axis_update(&r->scaler.y, r->filter, video->height, r->height,
+                                        0, r->height, -1, 1, 0, 1)) {
+            p1_log(videoobj, P1_LOG_ERROR, "Failed to allocate filter coefficients");
+            goto fail;
+        }
+
+        size = p1_video_scale_scratch_size(&r->scaler);
+        if (size > row_size)
+            row_size = size;
+    }
+
+    row_size = (row_size + 63) & ~(size_t) 63;
+    ret = posix_memalign((void **) &videof->rendition_rows, 64, row_size * num_workers);
+    if (ret != 0) {
+        videof->rendition_rows = NULL;
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to allocate scratch rows: %s", strerror(ret));
+        goto fail;
+    }
+    videof->rendition_row_size = row_size;
+
+    return true;
+
+fail:
+    p1_video_stop_renditions(videof);
+    return false;
+}
+
+static void p1_video_stop_renditions(P1VideoFull *videof)
+{
+    int i;
+
+    for (i = 0; i < P1_MAX_RENDITIONS; i++) {
+        P1VideoRendition *r = &videof->renditions[i];
+
+        if (r->width != 0)
+            x264_picture_clean(&r->pic);
+        free(r->canvas);
+        r->canvas = NULL;
+        p1_video_scale_axis_free(&r->scaler.x);
+        p1_video_scale_axis_free(&r->scaler.y);
+        r->width = 0;
+        r->height = 0;
+    }
+    videof->num_renditions = 0;
+
+    free(videof->rendition_jobs);
+    videof->rendition_jobs = NULL;
+    free(videof->rendition_rows);
+    videof->rendition_rows = NULL;
+    videof->rendition_row_size = 0;
+}
+
+// Check whether the main connection or any rendition is streaming. Like the
+// other state checks on the connection, this is only preliminary.
+static bool p1_video_is_streaming(P1VideoFull *videof)
+{
+    P1Context *ctx = ((P1Object *) videof)->ctx;
+    P1Object *connobj;
+    int i;
+
+    for (i = 0; i < P1_NUM_CONNECTIONS; i++) {
+        if (i != 0 && videof->renditions[i - 1].width == 0)
+            continue;
+
+        connobj = (P1Object *) p1_get_conn(ctx, i);
+        if (connobj->state.current == P1_STATE_RUNNING)
+            return true;
+    }
+
+    return false;
+}
+
+// Hand the output picture and renditions to their connections.
+static void p1_video_stream_pictures(P1VideoFull *videof, int64_t time)
+{
+    P1Context *ctx = ((P1Object *) videof)->ctx;
+    int i;
+
+    p1_conn_stream_video((P1ConnectionFull *) ctx->conn, time, videof->stream_pic);
+
+    for (i = 0; i < P1_MAX_RENDITIONS; i++) {
+        P1VideoRendition *r = &videof->renditions[i];
+
+        if (r->width != 0)
+            p1_conn_stream_video((P1ConnectionFull *) ctx->renditions[i], time, &r->pic);
+    }
+}
+
+// Queue the tick for streaming, and stream ticks that have reached the
+// configured latency. Conversion of the frame has just started if converted
+// is set. The connection only queues a copy of the picture, encoding happens
+// on the encoder thread.
+static bool p1_video_stream(P1VideoFull *videof, int64_t time, bool converted)
+{
+    int slots = videof->latency + 1;
+    int i;
+
+    if (videof->backend->finish == NULL) {
+        p1_video_stream_pictures(videof, time);
+        return true;
+    }
+
+    i = (videof->pending_read + videof->pending_used) % slots;
+    videof->pending_times[i] = time;
+    videof->pending_converted[i] = converted;
+    videof->pending_used++;
+    if (converted)
+        videof->out_write = (videof->out_write + 1) % slots;
+
+    while (videof->pending_used > videof->latency) {
+        i = videof->pending_read;
+        videof->pending_read = (i + 1) % slots;
+        videof->pending_used--;
+
+        // Otherwise, the streamed picture still holds the previous frame.
+        if (videof->pending_converted[i]) {
+            if (!videof->backend->finish(videof))
+                return false;
+            videof->out_read = (videof->out_read + 1) % slots;
+        }
+
+        p1_video_stream_pictures(videof, videof->pending_times[i]);
+    }
+
+    return true;
+}
+
+// Place a tick on the grid of frame slots, and snap its time to the slot.
+// Returns the number of frames to stream for the tick: zero if it falls on
+// a slot already streamed, and more than one if ticks were missed.
+static int p1_video_pace(P1VideoFull *videof, int64_t *time)
+{
+    P1Video *video = (P1Video *) videof;
+    int64_t slot;
+    int frames;
+
+    if (!videof->pacing)
+        return 1;
+
+    if (!videof->pace_started) {
+        videof->pace_started = true;
+        videof->pace_origin = *time;
+        videof->pace_slot = 0;
+        return 1;
+    }
+
+    slot = llround((*time - videof->pace_origin) / p1_video_frame_length(videof));
+
+    if (slot <= videof->pace_slot) {
+        video->frames_dropped++;
+        return 0;
+    }
+
+    frames = 1;
+    if (slot - videof->pace_slot - 1 > pace_max_duplicates)
+        frames += pace_max_duplicates;
+    else
+        frames += (int) (slot - videof->pace_slot - 1);
+    video->frames_duplicated += frames - 1;
+
+    videof->pace_slot = slot;
+    *time = p1_video_slot_time(videof, slot);
+    return frames;
+}
+
+static int64_t p1_video_slot_time(P1VideoFull *videof, int64_t slot)
+{
+    return videof->pace_origin + llround(slot * p1_video_frame_length(videof));
+}
+
+// Length of a frame in context time units.
+static double p1_video_frame_length(P1VideoFull *videof)
+{
+    P1VideoClock *vclock = ((P1Video *) videof)->clock;
+    P1ContextFull *ctxf = (P1ContextFull *) ((P1Object *) videof)->ctx;
+
+    return 1000000000.0 * vclock->fps_den / vclock->fps_num *
+           ctxf->timebase_den / ctxf->timebase_num;
+}
+
+// Check the time spent on a tick against the frame budget, and adjust the
+// degradation level.
+static void p1_video_track_deadline(P1VideoFull *videof, int64_t start)
+{
+    P1Video *video = (P1Video *) videof;
+    P1Object *videoobj = (P1Object *) videof;
+    P1ContextFull *ctxf = (P1ContextFull *) videoobj->ctx;
+    double budget = p1_video_frame_length(videof);
+    double spent = (double) (p1_get_time() - start);
+    double to_ms = 1e-6 * ctxf->timebase_num / ctxf->timebase_den;
+
+    if (spent > budget) {
+        video->ticks_late++;
+        videof->calm_ticks = 0;
+
+        if (videof->degrade < P1_DEGRADE_STREAM) {
+            videof->degrade++;
+            p1_log(videoobj, P1_LOG_WARNING, "Tick took %.1f ms of %.1f ms budget, now %s (%llu late)",
+                   spent * to_ms, budget * to_ms, degrade_names[videof->degrade],
+                   (unsigned long long) video->ticks_late);
+        }
+        else {
+            p1_log(videoobj, P1_LOG_DEBUG, "Tick took %.1f ms of %.1f ms budget (%llu late)",
+                   spent * to_ms, budget * to_ms, (unsigned long long) video->ticks_late);
+        }
+    }
+    else if (videof->degrade != P1_DEGRADE_NONE) {
+        if (spent * 2 > budget)
+            videof->calm_ticks = 0;
+        else if (++videof->calm_ticks == degrade_calm_ticks) {
+            videof->calm_ticks = 0;
+            videof->degrade--;
+            p1_log(videoobj, P1_LOG_INFO, "Ticks back within budget, now %s", degrade_names[videof->degrade]);
+        }
+    }
+}
+
+// Finish conversions in flight without streaming them, once the connection
+// is gone.
+static bool p1_video_discard_pending(P1VideoFull *videof)
+{
+    int slots = videof->latency + 1;
+    int i;
+
+    while (videof->pending_used != 0) {
+        i = videof->pending_read;
+        videof->pending_read = (i + 1) % slots;
+        videof->pending_used--;
+
+        if (videof->pending_converted[i]) {
+            if (!videof->backend->finish(videof))
+                return false;
+            videof->out_read = (videof->out_read + 1) % slots;
+        }
+    }
+
+    return true;
+}
+
+int p1_video_collect_tiles(P1VideoFull *videof, uint8_t flag)
+{
+    int i, n = 0;
+
+    for (i = 0; i < videof->num_tiles; i++) {
+        if (videof->tile_flags[i] & flag)
+            videof->tile_jobs[n++] = i;
+    }
+
+    return n;
+}
+
+void p1_video_convert_frame(P1VideoFull *videof, const uint8_t *in, size_t in_stride)
+{
+    int n = p1_video_collect_tiles(videof, P1_TILE_STALE);
+
+    videof->convert_in = in;
+    videof->convert_in_stride = in_stride;
+    p1_worker_pool_run(&videof->workers, n, p1_video_convert_tile, videof);
+
+    p1_video_convert_renditions(videof, false);
+}
+
+void p1_video_convert_full(P1VideoFull *videof, const uint8_t *in, size_t in_stride)
+{
+    int i;
+
+    for (i = 0; i < videof->num_tiles; i++)
+        videof->tile_jobs[i] = i;
+
+    videof->convert_in = in;
+    videof->convert_in_stride = in_stride;
+    p1_worker_pool_run(&videof->workers, videof->num_tiles, p1_video_convert_tile, videof);
+
+    p1_video_convert_renditions(videof, true);
+}
+
+static void p1_video_convert_tile(void *data, int job, int worker)
+{
+    P1VideoFull *videof = (P1VideoFull *) data;
+    P1Video *video = (P1Video *) videof;
+    int tile = videof->tile_jobs[job];
+    int y1 = tile * videof->tile_height;
+    int y2 = y1 + videof->tile_height;
+
+    if (y2 > video->height)
+        y2 = video->height;
+
+    p1_video_bgra_to_yuv(&videof->out_pic, video->width,
+                         videof->convert_in, videof->convert_in_stride, y1, y2);
+}
+
+// Scale and convert renditions from the conversion input. Unless full is set,
+// only rendition tiles that sample stale output tiles are updated.
+static void p1_video_convert_renditions(P1VideoFull *videof, bool full)
+{
+    int i, tile, row1, row2, t1, t2, t;
+    bool stale;
+
+    videof->num_rendition_jobs = 0;
+
+    for (i = 0; i < P1_MAX_RENDITIONS; i++) {
+        P1VideoRendition *r = &videof->renditions[i];
+        const P1VideoScaleAxis *y = &r->scaler.y;
+
+        if (r->width == 0)
+            continue;
+
+        for (tile = 0; tile < r->num_tiles; tile++) {
+            stale = full || !r->pic_valid;
+
+            if (!stale) {
+                // Range of output rows the tile samples.
+                row1 = tile * r->tile_height;
+                row2 = row1 + r->tile_height;
+                if (row2 > r->height)
+                    row2 = r->height;
+                t1 = (y->in_begin + y->first[row1]) / videof->tile_height;
+                t2 = (y->in_begin + y->first[row2 - 1] + y->taps - 1) / videof->tile_height;
+                if (t2 >= videof->num_tiles)
+                    t2 = videof->num_tiles - 1;
+
+                for (t = t1; t <= t2 && !stale; t++)
+                    stale = (videof->tile_flags[t] & P1_TILE_STALE) != 0;
+            }
+
+            if (stale)
+                videof->rendition_jobs[videof->num_rendition_jobs++] = r->first_job + tile;
+        }
+
+        r->pic_valid = true;
+    }
+
+    if (videof->num_rendition_jobs != 0)
+        p1_worker_pool_run(&videof->workers, videof->num_rendition_jobs,
+                           p1_video_convert_rendition_tile, videof);
+}
+
+static void p1_video_convert_rendition_tile(void *data, int job, int worker)
+{
+    P1VideoFull *videof = (P1VideoFull *) data;
+    uint8_t *scratch = videof->rendition_rows + worker * videof->rendition_row_size;
+    int tile = videof->rendition_jobs[job];
+    P1VideoRendition *r;
+    int i, y1, y2;
+
+    for (i = 0; i < P1_MAX_RENDITIONS; i++) {
+        r = &videof->renditions[i];
+        if (r->width != 0 && tile < r->first_job + r->num_tiles)
+            break;
+    }
+
+    y1 = (tile - r->first_job) * r->tile_height;
+    y2 = y1 + r->tile_height;
+    if (y2 > r->height)
+        y2 = r->height;
+
+    p1_video_scale_rows(&r->scaler, r->canvas, r->canvas_stride,
+                        videof->convert_in, videof->convert_in_stride, y1, y2, scratch);
+    p1_video_bgra_to_yuv(&r->pic, r->width, r->canvas, r->canvas_stride, y1, y2);
+}
+
+// Check if the frame consists of just a single source covering the output
+// exactly, without any transform. Returns the source, or NULL.
+static P1VideoSource *p1_video_find_passthrough(P1VideoFull *videof)
+{
+    P1Video *video = (P1Video *) videof;
+    P1VideoSource *found = NULL;
     P1ListNode *head;
     P1ListNode *node;
-    cl_int cl_err;
 
-    // Quick unlink of sources. We don't have to delete textures, but do set the
-    // texture field to 0, because it is our linked/unlinked indicator.
+    // The preview needs the frame in memory.
+    if (video->preview_fn != NULL && video->preview_type != P1_PREVIEW_RAW_DATA &&
+        video->preview_type != P1_PREVIEW_SCALED)
+        return NULL;
+
+    // Frames in flight would be streamed out of order.
+    if (videof->latency != 0)
+        return NULL;
+
     head = &video->sources;
     p1_list_iterate(head, node) {
         P1Source *src = p1_list_get_container(node, P1Source, link);
+        P1Object *obj = (P1Object *) src;
         P1VideoSource *vsrc = (P1VideoSource *) src;
 
-        vsrc->texture = 0;
+        if (obj->state.current != P1_STATE_RUNNING || !vsrc->priv->linked)
+            continue;
+
+        if (found != NULL)
+            return NULL;
+        found = vsrc;
     }
 
-    cl_err = clReleaseKernel(videof->yuv_kernel);
-    if (cl_err != CL_SUCCESS)
-        p1_log(videoobj, P1_LOG_ERROR, "Failed to release CL kernel: OpenCL error %d", cl_err);
+    if (found == NULL ||
+        found->x1 != -1 || found->y1 != -1 || found->x2 != 1 || found->y2 != 1 ||
+        found->u1 !=  0 || found->v1 !=  0 || found->u2 != 1 || found->v2 != 1)
+        return NULL;
+
+    return found;
+}
+
+bool p1_video_passthrough(P1VideoFull *videof, P1VideoSource *vsrc, int width, int height, size_t stride, const void *data)
+{
+    P1Video *video = (P1Video *) videof;
 
-    cl_err = clReleaseMemObject(videof->out_mem);
-    if (cl_err != CL_SUCCESS)
-        p1_log(videoobj, P1_LOG_ERROR, "Failed to release CL output buffer: OpenCL error %d", cl_err);
+    if (vsrc != videof->passthrough_src || width != video->width || height != video->height)
+        return false;
 
-    cl_err = clReleaseMemObject(videof->tex_mem);
-    if (cl_err != CL_SUCCESS)
-        p1_log(videoobj, P1_LOG_ERROR, "Failed to release CL input buffer: OpenCL error %d", cl_err);
+    // The raw data preview has no notion of stride.
+    if (video->preview_fn != NULL && video->preview_type == P1_PREVIEW_RAW_DATA &&
+        stride != (size_t) width * 4)
+        return false;
 
-    x264_picture_clean(&videof->out_pic);
+    if (video->preview_fn != NULL && p1_video_preview_due(videof)) {
+        if (videof->degrade >= P1_DEGRADE_PREVIEW) {
+            video->previews_skipped++;
+            p1_log((P1Object *) videof, P1_LOG_DEBUG, "Skipped preview (%llu total)",
+                   (unsigned long long) video->previews_skipped);
+        }
+        else if (video->preview_type == P1_PREVIEW_SCALED) {
+            if (!p1_video_preview_scaled(videof, data, stride))
+                return false;
+        }
+        else {
+            P1PreviewRawData info = {
+                .width = width,
+                .height = height,
+                .data = data
+            };
+            video->preview_fn(&info, video->preview_user_data);
+        }
+    }
+
+    memset(videof->tile_flags, P1_TILE_STALE, videof->num_tiles);
+    p1_video_convert_frame(videof, data, stride);
+    memset(videof->tile_flags, 0, videof->num_tiles);
+
+    // The backend doesn't have this frame, and the canvas is out of date.
+    vsrc->priv->frame_stored = false;
+    videof->canvas_valid = false;
+    videof->out_src = vsrc;
+    videof->stream_pic = &videof->out_pic;
+
+    videof->passthrough_done = true;
+    return true;
+}
+
+// Determine which sources are entirely covered by sources drawn over them.
+// Sources are drawn without blending, so any source with a frame is opaque.
+// The list is walked from the top, collecting the area covered so far.
+static void p1_video_update_occlusion(P1VideoFull *videof)
+{
+    P1Video *video = (P1Video *) videof;
+    P1VideoRect rects[P1_VIDEO_MAX_OCCLUDERS];
+    P1VideoRect rect;
+    int num_rects = 0;
+    bool hidden;
+    P1ListNode *head;
+    P1ListNode *node;
+
+    head = &video->sources;
+    p1_list_iterate_reverse(head, node) {
+        P1Source *src = p1_list_get_container(node, P1Source, link);
+        P1Object *obj = (P1Object *) src;
+        P1VideoSource *vsrc = (P1VideoSource *) src;
+        P1VideoSourcePriv *priv = vsrc->priv;
+
+        p1_object_lock(obj);
+
+        priv->occluding = false;
+
+        // Reset quietly, so a restarted source is notified again.
+        if (obj->state.current != P1_STATE_RUNNING || !priv->linked) {
+            priv->hidden = false;
+            p1_object_unlock(obj);
+            continue;
+        }
 
-    cl_err = clReleaseCommandQueue(videof->clq);
-    if (cl_err != CL_SUCCESS)
-        p1_log(videoobj, P1_LOG_ERROR, "Failed to release CL command queue: OpenCL error %d", cl_err);
+        hidden = (!p1_video_source_rect(videof, vsrc, &rect) ||
+                  p1_video_rect_covered(&rect, rects, num_rects));
 
-    p1_video_destroy_platform(videof);
+        // A hidden source adds nothing to the covered area.
+        if (!hidden && priv->frame_stored && num_rects < P1_VIDEO_MAX_OCCLUDERS) {
+            rects[num_rects++] = rect;
+            priv->occluding = true;
+        }
+
+        if (hidden != priv->hidden)
+            p1_video_set_hidden(vsrc, hidden);
+
+        p1_object_unlock(obj);
+    }
 }
 
+// Check that sources covering others still have a frame after the frame
+// callbacks. If one lost its frame, everything is revealed again, and hidden
+// sources are asked for a frame after all. Returns false on failure.
+static bool p1_video_check_occlusion(P1VideoFull *videof)
+{
+    P1Video *video = (P1Video *) videof;
+    bool intact = true;
+    bool b_ret;
+    P1ListNode *head;
+    P1ListNode *node;
 
-static void p1_video_link_source(P1VideoSource *vsrc)
+    head = &video->sources;
+    p1_list_iterate(head, node) {
+        P1Source *src = p1_list_get_container(node, P1Source, link);
+        P1Object *obj = (P1Object *) src;
+        P1VideoSource *vsrc = (P1VideoSource *) src;
+
+        p1_object_lock(obj);
+        if (vsrc->priv->occluding && !vsrc->priv->frame_stored)
+            intact = false;
+        p1_object_unlock(obj);
+    }
+
+    if (intact)
+        return true;
+
+    p1_list_iterate(head, node) {
+        P1Source *src = p1_list_get_container(node, P1Source, link);
+        P1Object *obj = (P1Object *) src;
+        P1VideoSource *vsrc = (P1VideoSource *) src;
+        P1VideoSourcePriv *priv = vsrc->priv;
+        b_ret = true;
+
+        p1_object_lock(obj);
+        if (priv->hidden && obj->state.current == P1_STATE_RUNNING && priv->linked) {
+            p1_video_set_hidden(vsrc, false);
+            b_ret = vsrc->frame(vsrc);
+        }
+        else {
+            priv->hidden = false;
+        }
+        p1_object_unlock(obj);
+
+        if (!b_ret)
+            return false;
+    }
+
+    return true;
+}
+
+// Change whether a source is hidden, and tell the source.
+static void p1_video_set_hidden(P1VideoSource *vsrc, bool hidden)
 {
     P1Object *obj = (P1Object *) vsrc;
-    P1Object *videoobj = (P1Object *) obj->ctx->video;
-    GLenum err;
 
-    glGenTextures(1, &vsrc->texture);
-    err = glGetError();
-    if (err != GL_NO_ERROR) {
-        vsrc->texture = 0;
-        p1_log(videoobj, P1_LOG_ERROR, "Failed to create texture: OpenGL error %d", err);
+    vsrc->priv->hidden = hidden;
+    p1_log(obj, P1_LOG_DEBUG, hidden ? "Source is covered, skipping frames" : "Source is visible again");
+
+    if (vsrc->visibility != NULL)
+        vsrc->visibility(vsrc, hidden);
+}
+
+// Get the output pixels covered by a source. Like the backends, a pixel is
+// covered if its center lies within the placement. Returns false if none are.
+static bool p1_video_source_rect(P1VideoFull *videof, P1VideoSource *vsrc, P1VideoRect *out)
+{
+    P1Video *video = (P1Video *) videof;
+    float x1 = (fminf(vsrc->x1, vsrc->x2) + 1) * 0.5f * video->width;
+    float x2 = (fmaxf(vsrc->x1, vsrc->x2) + 1) * 0.5f * video->width;
+    float y1 = (fminf(vsrc->y1, vsrc->y2) + 1) * 0.5f * video->height;
+    float y2 = (fmaxf(vsrc->y1, vsrc->y2) + 1) * 0.5f * video->height;
+
+    out->x1 = (int) ceilf(x1 - 0.5f);
+    out->x2 = (int) ceilf(x2 - 0.5f);
+    out->y1 = (int) ceilf(y1 - 0.5f);
+    out->y2 = (int) ceilf(y2 - 0.5f);
+    if (out->x1 < 0)
+        out->x1 = 0;
+    if (out->y1 < 0)
+        out->y1 = 0;
+    if (out->x2 > video->width)
+        out->x2 = video->width;
+    if (out->y2 > video->height)
+        out->y2 = video->height;
+
+    return out->x1 < out->x2 && out->y1 < out->y2;
+}
+
+// Check if a rectangle is covered by the union of others. Subtracts each from
+// the pieces left uncovered, splitting them in up to four. Gives up and
+// returns false if there are too many pieces to track.
+static bool p1_video_rect_covered(const P1VideoRect *rect, const P1VideoRect *rects, int num_rects)
+{
+    P1VideoRect parts[2][P1_VIDEO_MAX_OCCLUSION_PARTS];
+    P1VideoRect *in = parts[0];
+    P1VideoRect *out = parts[1];
+    P1VideoRect *tmp;
+    int num_in = 1, num_out;
+    int i, j, y1, y2;
+
+    in[0] = *rect;
+
+    for (i = 0; i < num_rects && num_in != 0; i++) {
+        const P1VideoRect *o = &rects[i];
+        num_out = 0;
+
+        for (j = 0; j < num_in; j++) {
+            const P1VideoRect *p = &in[j];
+
+            if (num_out + 4 > P1_VIDEO_MAX_OCCLUSION_PARTS)
+                return false;
+
+            if (o->x2 <= p->x1 || o->x1 >= p->x2 || o->y2 <= p->y1 || o->y1 >= p->y2) {
+                out[num_out++] = *p;
+                continue;
+            }
+
+            // Full width bands above and below, then the sides in between.
+            y1 = p->y1 > o->y1 ? p->y1 : o->y1;
+            y2 = p->y2 < o->y2 ? p->y2 : o->y2;
+            if (p->y1 < o->y1)
+                out[num_out++] = (P1VideoRect) { p->x1, p->y1, p->x2, o->y1 };
+            if (o->y2 < p->y2)
+                out[num_out++] = (P1VideoRect) { p->x1, o->y2, p->x2, p->y2 };
+            if (p->x1 < o->x1)
+                out[num_out++] = (P1VideoRect) { p->x1, y1, o->x1, y2 };
+            if (o->x2 < p->x2)
+                out[num_out++] = (P1VideoRect) { o->x2, y1, p->x2, y2 };
+        }
+
+        tmp = in;
+        in = out;
+        out = tmp;
+        num_in = num_out;
     }
+
+    return num_in == 0;
 }
 
-static void p1_video_unlink_source(P1VideoSource *vsrc)
+// Determine which tiles need to be composited, and remember source placement
+// for the next frame. Returns true if there is any damage.
+static bool p1_video_update_damage(P1VideoFull *videof)
 {
-    P1Object *obj = (P1Object *) vsrc;
-    P1Object *videoobj = (P1Object *) obj->ctx->video;
-    GLenum err;
+    P1Video *video = (P1Video *) videof;
+    bool full = !videof->canvas_valid;
+    bool visible, moved;
+    P1ListNode *head;
+    P1ListNode *node;
+    int i;
+
+    head = &video->sources;
+    p1_list_iterate(head, node) {
+        P1Source *src = p1_list_get_container(node, P1Source, link);
+        P1Object *obj = (P1Object *) src;
+        P1VideoSource *vsrc = (P1VideoSource *) src;
+        P1VideoSourcePriv *priv = vsrc->priv;
+
+        p1_object_lock(obj);
+
+        visible = (obj->state.current == P1_STATE_RUNNING &&
+                   priv->linked && priv->frame_stored && !priv->hidden);
+        moved = (priv->drawn_x1 != vsrc->x1 || priv->drawn_y1 != vsrc->y1 ||
+                 priv->drawn_x2 != vsrc->x2 || priv->drawn_y2 != vsrc->y2 ||
+                 priv->drawn_u1 != vsrc->u1 || priv->drawn_v1 != vsrc->v1 ||
+                 priv->drawn_u2 != vsrc->u2 || priv->drawn_v2 != vsrc->v2 ||
+                 priv->drawn_filter != vsrc->filter);
+
+        if (!full) {
+            if (priv->drawn && (!visible || moved))
+                p1_video_damage_rows(videof, priv->drawn_y1, priv->drawn_y2);
+
+            if (visible && (!priv->drawn || moved))
+                p1_video_damage_rows(videof, vsrc->y1, vsrc->y2);
+            else if (visible && priv->frame_changed)
+                p1_video_damage_frame(videof, vsrc);
+        }
+
+        priv->drawn = visible;
+        priv->drawn_x1 = vsrc->x1;
+        priv->drawn_y1 = vsrc->y1;
+        priv->drawn_x2 = vsrc->x2;
+        priv->drawn_y2 = vsrc->y2;
+        priv->drawn_u1 = vsrc->u1;
+        priv->drawn_v1 = vsrc->v1;
+        priv->drawn_u2 = vsrc->u2;
+        priv->drawn_v2 = vsrc->v2;
+        priv->drawn_filter = vsrc->filter;
+
+        p1_object_unlock(obj);
+    }
 
-    glDeleteTextures(1, &vsrc->texture);
-    vsrc->texture = 0;
-    err = glGetError();
-    if (err != GL_NO_ERROR)
-        p1_log(videoobj, P1_LOG_ERROR, "Failed to delete texture: OpenGL error %d", err);
+    if (p1_video_collect_tiles(videof, P1_TILE_DIRTY) == 0 && !full)
+        return false;
+
+    if (full || !videof->backend->partial) {
+        for (i = 0; i < videof->num_tiles; i++)
+            videof->tile_flags[i] |= P1_TILE_DIRTY;
+    }
+
+    return true;
+}
+
+// Mark tiles dirty that cover the range [y1, y2] of output rows, in the range
+// [-1, +1]. Rounds outwards and adds a row on either side, to account for
+// filtering.
+static void p1_video_damage_rows(P1VideoFull *videof, float y1, float y2)
+{
+    P1Video *video = (P1Video *) videof;
+    int begin, end, i;
+
+    if (y1 > y2) {
+        float tmp = y1;
+        y1 = y2;
+        y2 = tmp;
+    }
+
+    begin = (int) floorf((y1 + 1) * 0.5f * video->height) - 1;
+    end = (int) ceilf((y2 + 1) * 0.5f * video->height) + 1;
+    if (begin < 0)
+        begin = 0;
+    if (end > video->height)
+        end = video->height;
+
+    for (i = begin; i < end; i += videof->tile_height)
+        videof->tile_flags[i / videof->tile_height] |= P1_TILE_DIRTY;
+    if (begin < end)
+        videof->tile_flags[(end - 1) / videof->tile_height] |= P1_TILE_DIRTY;
+}
+
+// Mark tiles dirty for a new frame of a source that hasn't moved.
+static void p1_video_damage_frame(P1VideoFull *videof, P1VideoSource *vsrc)
+{
+    P1VideoSourcePriv *priv = vsrc->priv;
+    float dv = vsrc->v2 - vsrc->v1;
+    float t1 = 0, t2 = 1;
+    int margin;
+
+    if (priv->damage_set && dv != 0) {
+        // Frame rows to the range [0, 1] of the placement, with margin for
+        // filtering.
+        margin = p1_video_filter_margin(videof, vsrc);
+        t1 = ((float) (priv->damage_y1 - margin) / priv->frame_height - vsrc->v1) / dv;
+        t2 = ((float) (priv->damage_y2 + margin) / priv->frame_height - vsrc->v1) / dv;
+        if (t1 > t2) {
+            float tmp = t1;
+            t1 = t2;
+            t2 = tmp;
+        }
+
+        // Damage outside the visible part of the frame.
+        if (t2 < 0 || t1 > 1)
+            return;
+
+        if (t1 < 0)
+            t1 = 0;
+        if (t2 > 1)
+            t2 = 1;
+    }
+
+    p1_video_damage_rows(videof,
+                         vsrc->y1 + t1 * (vsrc->y2 - vsrc->y1),
+                         vsrc->y1 + t2 * (vsrc->y2 - vsrc->y1));
+}
+
+// Number of frame rows around a changed row that affect the output, which is
+// the filter radius, stretched when the frame is shrunk.
+static int p1_video_filter_margin(P1VideoFull *videof, P1VideoSource *vsrc)
+{
+    P1Video *video = (P1Video *) videof;
+    float in_rows, out_rows, radius;
+
+    if (vsrc->filter == P1_FILTER_BILINEAR)
+        return 1;
+
+    in_rows = fabsf(vsrc->v2 - vsrc->v1) * vsrc->priv->frame_height;
+    out_rows = fabsf(vsrc->y2 - vsrc->y1) * 0.5f * video->height;
+    radius = (float) p1_video_filter_radius(vsrc->filter);
+    if (out_rows > 0 && in_rows > out_rows)
+        radius *= in_rows / out_rows;
+
+    return (int) ceilf(radius);
+}
+
+
+static void p1_video_link_source(P1VideoFull *videof, P1VideoSource *vsrc)
+{
+    P1VideoSourcePriv *priv = vsrc->priv;
+
+    if (priv->linked)
+        return;
+
+    priv->linked = videof->backend->link_source(videof, vsrc);
+    priv->frame_stored = false;
+}
+
+static void p1_video_unlink_source(P1VideoFull *videof, P1VideoSource *vsrc)
+{
+    P1VideoSourcePriv *priv = vsrc->priv;
+
+    if (!priv->linked)
+        return;
+
+    videof->backend->unlink_source(videof, vsrc);
+    priv->linked = false;
+    priv->frame_stored = false;
+    p1_video_release_frame_ref(vsrc);
+}
+
+// Release the frame reference held for a source, if any.
+static void p1_video_release_frame_ref(P1VideoSource *vsrc)
+{
+    P1VideoSourcePriv *priv = vsrc->priv;
+    P1VideoFrameRelease release = priv->frame_ref_release;
+
+    if (release == NULL)
+        return;
+
+    priv->frame_ref_release = NULL;
+    release(priv->frame_ref);
+    priv->frame_ref = NULL;
 }
 
 
@@ -434,14 +1352,14 @@ void p1_video_clock_tick(P1VideoClock *vclock, int64_t time)
     P1Video *video = ctx->video;
     P1VideoFull *videof = (P1VideoFull *) video;
     P1Object *videoobj = (P1Object *) video;
-    P1Connection *conn = ctx->conn;
-    P1Object *connobj = (P1Object *) conn;
-    P1ConnectionFull *connf = (P1ConnectionFull *) conn;
+    const P1VideoBackend *backend;
     P1ListNode *head;
     P1ListNode *node;
-    GLenum gl_err;
-    cl_int cl_err;
+    int64_t start = p1_get_time();
+    bool converted;
     bool b_ret;
+    int frames;
+    int i;
 
     p1_object_lock(videoobj);
 
@@ -450,80 +1368,169 @@ void p1_video_clock_tick(P1VideoClock *vclock, int64_t time)
         return;
     }
 
+    backend = videof->backend;
+    videof->preview.tick_time = time;
+
+    // With a single source matching the output, and a connection to feed,
+    // the source frame may be converted directly.
+    videof->passthrough_src = NULL;
+    videof->passthrough_done = false;
+    if (p1_video_is_streaming(videof))
+        videof->passthrough_src = p1_video_find_passthrough(videof);
+
     // Rendering
-    if (!p1_video_activate_gl(videof))
+    if (!backend->begin(videof))
         goto fail;
 
-    glClear(GL_COLOR_BUFFER_BIT);
+    // Sources covered by others skip frames entirely.
+    p1_video_update_occlusion(videof);
 
     head = &video->sources;
     p1_list_iterate(head, node) {
         P1Source *src = p1_list_get_container(node, P1Source, link);
         P1Object *obj = (P1Object *) src;
         P1VideoSource *vsrc = (P1VideoSource *) src;
+        P1VideoSourcePriv *priv = vsrc->priv;
         b_ret = true;
 
         p1_object_lock(obj);
-        if (obj->state.current == P1_STATE_RUNNING && vsrc->texture != 0) {
-            glBindTexture(GL_TEXTURE_RECTANGLE, vsrc->texture);
+        priv->frame_changed = false;
+        priv->damage_set = false;
+        if (obj->state.current == P1_STATE_RUNNING && priv->linked && !priv->hidden)
             b_ret = vsrc->frame(vsrc);
-
-            if (b_ret) {
-                glBufferData(GL_ARRAY_BUFFER, vbo_size, (GLfloat []) {
-                    vsrc->x1, vsrc->y1, vsrc->u1, vsrc->v1,
-                    vsrc->x1, vsrc->y2, vsrc->u1, vsrc->v2,
-                    vsrc->x2, vsrc->y1, vsrc->u2, vsrc->v1,
-                    vsrc->x2, vsrc->y2, vsrc->u2, vsrc->v2
-                }, GL_DYNAMIC_DRAW);
-                glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-            }
-        }
         p1_object_unlock(obj);
 
         if (!b_ret)
             goto fail;
     }
 
-    glFinish();
-    if ((gl_err = glGetError()) != GL_NO_ERROR) {
-        p1_log(videoobj, P1_LOG_ERROR, "Failed to render frame: OpenGL error %d", gl_err);
+    if (!p1_video_check_occlusion(videof))
         goto fail;
+
+    // Passthrough already did preview and conversion. Missed ticks repeat
+    // the new frame, because the previous one is gone.
+    if (videof->passthrough_done) {
+        frames = p1_video_pace(videof, &time);
+        if (frames != 0 && videof->degrade >= P1_DEGRADE_STREAM) {
+            video->frames_shed++;
+            p1_log(videoobj, P1_LOG_DEBUG, "Dropped frame before encoding (%llu total)",
+                   (unsigned long long) video->frames_shed);
+            frames = 0;
+        }
+        for (i = frames - 1; i > 0; i--)
+            p1_video_stream_pictures(videof, p1_video_slot_time(videof, videof->pace_slot - i));
+        if (frames != 0)
+            p1_video_stream_pictures(videof, time);
+
+        p1_video_track_deadline(videof, start);
+        p1_object_unlock(videoobj);
+        return;
     }
 
-    // Preview hook, in platform specific code
-    if (video->preview_fn) {
-        b_ret = p1_video_preview(videof);
-        if (!b_ret)
+    // Composite only if something changed. Otherwise, the previous frame is
+    // still good. When behind, damage is left for the next tick.
+    if (!p1_video_update_damage(videof)) {
+        // Nothing to do.
+    }
+    else if (videof->degrade >= P1_DEGRADE_COMPOSITE && videof->canvas_valid) {
+        video->composites_deferred++;
+        p1_log(videoobj, P1_LOG_DEBUG, "Deferred compositing (%llu total)",
+               (unsigned long long) video->composites_deferred);
+    }
+    else {
+        if (!backend->clear(videof))
+            goto fail;
+
+        p1_list_iterate(head, node) {
+            P1Source *src = p1_list_get_container(node, P1Source, link);
+            P1Object *obj = (P1Object *) src;
+            P1VideoSource *vsrc = (P1VideoSource *) src;
+
+            if (!vsrc->priv->drawn)
+                continue;
+
+            p1_object_lock(obj);
+            b_ret = backend->draw(videof, vsrc);
+            p1_object_unlock(obj);
+
+            if (!b_ret)
+                goto fail;
+        }
+
+        if (!backend->end(videof))
             goto fail;
+
+        // Composited tiles now need conversion.
+        for (i = 0; i < videof->num_tiles; i++) {
+            if (videof->tile_flags[i] & P1_TILE_DIRTY)
+                videof->tile_flags[i] = P1_TILE_STALE;
+        }
+        videof->canvas_valid = true;
+        videof->preview_stale = true;
+    }
+
+    // Preview hook, in backend specific code. Scaled previews may skip
+    // frames, and catch up with the canvas once due.
+    if (video->preview_fn && videof->preview_stale && p1_video_preview_due(videof)) {
+        if (videof->degrade >= P1_DEGRADE_PREVIEW) {
+            video->previews_skipped++;
+            p1_log(videoobj, P1_LOG_DEBUG, "Skipped preview (%llu total)",
+                   (unsigned long long) video->previews_skipped);
+        }
+        else {
+            videof->preview_stale = false;
+            b_ret = backend->preview(videof);
+            if (!b_ret)
+                goto fail;
+        }
     }
 
     // Streaming. The state test is a preliminary check. The state may change,
     // and the connection code does a final check itself, but checking here as
     // well saves us a bunch of processing.
-    if (connobj->state.current == P1_STATE_RUNNING) {
-        // Colorspace conversion
-        cl_err = clEnqueueAcquireGLObjects(videof->clq, 1, &videof->tex_mem, 0, NULL, NULL);
-        if (cl_err != CL_SUCCESS) goto fail_cl;
-        cl_err = clEnqueueNDRangeKernel(videof->clq, videof->yuv_kernel, 2, NULL, videof->yuv_work_size, NULL, 0, NULL, NULL);
-        if (cl_err != CL_SUCCESS) goto fail_cl;
-        cl_err = clEnqueueReleaseGLObjects(videof->clq, 1, &videof->tex_mem, 0, NULL, NULL);
-        if (cl_err != CL_SUCCESS) goto fail_cl;
-        cl_err = clEnqueueReadBuffer(videof->clq, videof->out_mem, CL_FALSE, 0, videof->out_size, videof->out_pic.img.plane[0], 0, NULL, NULL);
-        if (cl_err != CL_SUCCESS) goto fail_cl;
-        cl_err = clFinish(videof->clq);
-        if (cl_err != CL_SUCCESS) goto fail_cl;
-
-        // Hand off to connection
-        p1_conn_stream_video(connf, time, &videof->out_pic);
+    if (p1_video_is_streaming(videof)) {
+        // Repeat the previous frame for missed ticks. If this tick is dropped,
+        // stale tiles are converted on the next.
+        frames = p1_video_pace(videof, &time);
+        if (frames != 0 && videof->degrade >= P1_DEGRADE_STREAM) {
+            video->frames_shed++;
+            p1_log(videoobj, P1_LOG_DEBUG, "Dropped frame before encoding (%llu total)",
+                   (unsigned long long) video->frames_shed);
+            frames = 0;
+        }
+        for (i = frames - 1; i > 0; i--) {
+            if (!p1_video_stream(videof, p1_video_slot_time(videof, videof->pace_slot - i), false))
+                goto fail;
+        }
+
+        if (frames != 0) {
+            // Colorspace conversion, if the output picture is out of date.
+            converted = false;
+            if (p1_video_collect_tiles(videof, P1_TILE_STALE) != 0) {
+                if (!backend->convert(videof))
+                    goto fail;
+
+                memset(videof->tile_flags, 0, videof->num_tiles);
+                videof->out_src = NULL;
+                converted = true;
+            }
+
+            if (!p1_video_stream(videof, time, converted))
+                goto fail;
+        }
     }
+    else {
+        videof->pace_started = false;
 
+        if (videof->pending_used != 0 && !p1_video_discard_pending(videof))
+            goto fail;
+    }
+
+    p1_video_track_deadline(videof, start);
     p1_object_unlock(videoobj);
 
     return;
 
-fail_cl:
-    p1_log(videoobj, P1_LOG_ERROR, "Failure during colorspace conversion: OpenCL error %d", cl_err);
-
 fail:
     p1_video_kill_session(videof);
 
@@ -537,7 +1544,42 @@ fail:
 
 bool p1_video_source_init(P1VideoSource *vsrc, P1Context *ctx)
 {
-    return p1_object_init((P1Object *) vsrc, P1_OTYPE_VIDEO_SOURCE, ctx);
+    P1Object *obj = (P1Object *) vsrc;
+    P1VideoSourcePriv *priv;
+
+    if (!p1_object_init(obj, P1_OTYPE_VIDEO_SOURCE, ctx))
+        goto fail;
+
+    priv = calloc(1, sizeof(P1VideoSourcePriv));
+    if (priv == NULL) {
+        p1_log(obj, P1_LOG_ERROR, "Failed to allocate video source state");
+        goto fail_object;
+    }
+
+    priv->latch_write = 0;
+    priv->latch_shared = 1;
+    priv->latch_read = 2;
+    vsrc->priv = priv;
+
+    return true;
+
+fail_object:
+    p1_object_destroy(obj);
+
+fail:
+    return false;
+}
+
+void p1_video_source_free_priv(P1VideoSourcePriv *priv)
+{
+    int i;
+
+    if (priv == NULL)
+        return;
+
+    for (i = 0; i < 3; i++)
+        free(priv->latch_bufs[i].data);
+    free(priv);
 }
 
 void p1_video_source_config(P1VideoSource *vsrc, P1Config *cfg)
@@ -564,6 +1606,10 @@ void p1_video_source_config(P1VideoSource *vsrc, P1Config *cfg)
     if (!cfg->get_float(cfg, "v2", &vsrc->v2))
         vsrc->v2 = 1;
 
+    vsrc->filter = P1_FILTER_BILINEAR;
+    if (!p1_video_config_filter(obj, cfg, &vsrc->filter))
+        p1_object_clear_flag(obj, P1_FLAG_CONFIG_VALID);
+
     if (pel->config != NULL)
         pel->config(pel, cfg);
 
@@ -585,92 +1631,187 @@ void p1_video_source_notify(P1VideoSource *vsrc, P1Notification *n)
 
 void p1_video_source_frame(P1VideoSource *vsrc, int width, int height, void *data)
 {
-    glTexImage2D(GL_TEXTURE_RECTANGLE, 0, GL_RGBA8, width, height, 0,
-                 GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, data);
+    P1Object *obj = (P1Object *) vsrc;
+    P1VideoFull *videof = (P1VideoFull *) obj->ctx->video;
+
+    size_t stride = (size_t) width * 4;
+
+    if (p1_video_passthrough(videof, vsrc, width, height, stride, data))
+        return;
+
+    if (videof->backend->upload(videof, vsrc, width, height, stride, data))
+        p1_video_source_stored(vsrc, width, height);
+    else
+        vsrc->priv->frame_stored = false;
+
+    // The backend no longer reads from a previous reference.
+    p1_video_release_frame_ref(vsrc);
 }
 
+void p1_video_source_frame_ref(P1VideoSource *vsrc, int width, int height, size_t stride,
+                               const void *data, P1VideoFrameRelease release, void *ref)
+{
+    P1Object *obj = (P1Object *) vsrc;
+    P1VideoFull *videof = (P1VideoFull *) obj->ctx->video;
+    const P1VideoBackend *backend = videof->backend;
+
+    if (p1_video_passthrough(videof, vsrc, width, height, stride, data)) {
+        release(ref);
+        return;
+    }
+
+    if (backend->hold != NULL && backend->hold(videof, vsrc, width, height, stride, data)) {
+        p1_video_release_frame_ref(vsrc);
+        vsrc->priv->frame_ref = ref;
+        vsrc->priv->frame_ref_release = release;
+        p1_video_source_stored(vsrc, width, height);
+        return;
+    }
+
+    if (backend->upload(videof, vsrc, width, height, stride, data))
+        p1_video_source_stored(vsrc, width, height);
+    else
+        vsrc->priv->frame_stored = false;
+
+    p1_video_release_frame_ref(vsrc);
+    release(ref);
+}
 
-static GLuint p1_build_shader(P1Object *videoobj, GLuint type, const char *source)
+bool p1_video_source_frame_unchanged(P1VideoSource *vsrc)
 {
-    GLuint shader = glCreateShader(type);
-    glShaderSource(shader, 1, &source, NULL);
-    glCompileShader(shader);
+    P1Object *obj = (P1Object *) vsrc;
+    P1VideoFull *videof = (P1VideoFull *) obj->ctx->video;
 
-    GLint log_size = 0;
-    glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &log_size);
-    if (log_size) {
-        GLchar *log = malloc(log_size);
-        if (log) {
-            glGetShaderInfoLog(shader, log_size, NULL, log);
-            p1_log(videoobj, P1_LOG_INFO, "Shader compiler log:\n%s", log);
-            free(log);
-        }
+    // The output picture still holds the passthrough frame.
+    if (vsrc == videof->passthrough_src && vsrc == videof->out_src) {
+        videof->passthrough_done = true;
+        return true;
     }
 
-    GLint success = GL_FALSE;
-    glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
+    return vsrc->priv->frame_stored;
+}
 
-    GLenum err = glGetError();
-    if (err != GL_NO_ERROR) {
-        p1_log(videoobj, P1_LOG_ERROR, "Failed to build shader: OpenGL error %d", err);
-        return 0;
+void p1_video_source_damage(P1VideoSource *vsrc, int x, int y, int width, int height)
+{
+    P1VideoSourcePriv *priv = vsrc->priv;
+
+    if (!priv->damage_set) {
+        priv->damage_x1 = x;
+        priv->damage_y1 = y;
+        priv->damage_x2 = x + width;
+        priv->damage_y2 = y + height;
+        priv->damage_set = true;
     }
-    if (success != GL_TRUE) {
-        p1_log(videoobj, P1_LOG_ERROR, "Failed to build shader");
-        return 0;
+    else {
+        if (x < priv->damage_x1) priv->damage_x1 = x;
+        if (y < priv->damage_y1) priv->damage_y1 = y;
+        if (x + width  > priv->damage_x2) priv->damage_x2 = x + width;
+        if (y + height > priv->damage_y2) priv->damage_y2 = y + height;
     }
-
-    return shader;
 }
 
-static bool p1_video_build_program(P1Object *videoobj, GLuint program, const char *vertex_source, const char *fragment_source)
+void p1_video_source_stored(P1VideoSource *vsrc, int width, int height)
 {
-    GLuint vertex_shader = p1_build_shader(videoobj, GL_VERTEX_SHADER, vertex_source);
-    if (vertex_shader == 0)
-        return false;
+    P1VideoSourcePriv *priv = vsrc->priv;
 
-    GLuint fragment_shader = p1_build_shader(videoobj, GL_FRAGMENT_SHADER, fragment_source);
-    if (fragment_shader == 0)
-        return false;
+    // Damage is only meaningful relative to a frame of the same size.
+    if (width != priv->frame_width || height != priv->frame_height || !priv->frame_stored)
+        priv->damage_set = false;
 
-    glAttachShader(program, vertex_shader);
-    glAttachShader(program, fragment_shader);
-    glLinkProgram(program);
-    glDetachShader(program, vertex_shader);
-    glDetachShader(program, fragment_shader);
+    priv->frame_width = width;
+    priv->frame_height = height;
+    priv->frame_generation++;
+    priv->frame_stored = true;
+    priv->frame_changed = true;
+}
 
-    glDeleteShader(vertex_shader);
-    glDeleteShader(fragment_shader);
 
-    GLint log_size = 0;
-    glGetProgramiv(program, GL_INFO_LOG_LENGTH, &log_size);
-    if (log_size) {
-        GLchar *log = malloc(log_size);
-        if (log) {
-            glGetProgramInfoLog(program, log_size, NULL, log);
-            p1_log(videoobj, P1_LOG_INFO, "Shader linker log:\n%s", log);
-            free(log);
+uint8_t *p1_video_source_latch_acquire(P1VideoSource *vsrc, int width, int height)
+{
+    P1Object *obj = (P1Object *) vsrc;
+    P1VideoSourcePriv *priv = vsrc->priv;
+    P1VideoLatchBuffer *buf = &priv->latch_bufs[priv->latch_write];
+    size_t size = (size_t) width * height * 4;
+    uint8_t *data;
+
+    if (size == 0)
+        return NULL;
+
+    if (buf->size != size) {
+        data = realloc(buf->data, size);
+        if (data == NULL) {
+            p1_log(obj, P1_LOG_ERROR, "Failed to allocate frame buffer");
+            return NULL;
         }
+
+        buf->data = data;
+        buf->size = size;
     }
 
-    GLint success = GL_FALSE;
-    glGetProgramiv(program, GL_LINK_STATUS, &success);
+    buf->width = width;
+    buf->height = height;
 
-    GLenum err = glGetError();
-    if (err != GL_NO_ERROR) {
-        p1_log(videoobj, P1_LOG_ERROR, "Failed to link shaders: OpenGL error %d", err);
-        return false;
+    return buf->data;
+}
+
+void p1_video_source_latch_publish(P1VideoSource *vsrc)
+{
+    P1VideoSourcePriv *priv = vsrc->priv;
+    int prev;
+
+    // Swap the write buffer with the shared buffer. If the mixer didn't pick
+    // up the previous frame, it is lost.
+    prev = __atomic_exchange_n(&priv->latch_shared, priv->latch_write | latch_fresh, __ATOMIC_ACQ_REL);
+    priv->latch_write = prev & latch_index_mask;
+
+    __atomic_add_fetch(&priv->frames_produced, 1, __ATOMIC_RELAXED);
+    if (prev & latch_fresh)
+        __atomic_add_fetch(&priv->frames_skipped, 1, __ATOMIC_RELAXED);
+}
+
+bool p1_video_source_latch_frame(P1VideoSource *vsrc)
+{
+    P1VideoSourcePriv *priv = vsrc->priv;
+    P1VideoLatchBuffer *buf;
+    int prev;
+
+    // Swap the read buffer with the shared buffer, if there's a new frame.
+    if (__atomic_load_n(&priv->latch_shared, __ATOMIC_ACQUIRE) & latch_fresh) {
+        prev = __atomic_exchange_n(&priv->latch_shared, priv->latch_read, __ATOMIC_ACQ_REL);
+        priv->latch_read = prev & latch_index_mask;
+        __atomic_add_fetch(&priv->frames_consumed, 1, __ATOMIC_RELAXED);
     }
-    if (success != GL_TRUE) {
-        p1_log(videoobj, P1_LOG_ERROR, "Failed to link shaders");
-        return false;
+    else if (p1_video_source_frame_unchanged(vsrc)) {
+        return true;
     }
 
+    buf = &priv->latch_bufs[priv->latch_read];
+    if (buf->data != NULL)
+        p1_video_source_frame(vsrc, buf->width, buf->height, buf->data);
+
     return true;
 }
 
-void p1_video_cl_notify_callback(const char *errstr, const void *private_info, size_t cb, void *user_data)
+void p1_video_source_latch_free(P1VideoSource *vsrc)
+{
+    P1VideoSourcePriv *priv = vsrc->priv;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        free(priv->latch_bufs[i].data);
+        priv->latch_bufs[i].data = NULL;
+        priv->latch_bufs[i].size = 0;
+    }
+}
+
+void p1_video_source_latch_stats(P1VideoSource *vsrc, uint64_t *produced, uint64_t *consumed, uint64_t *skipped)
 {
-    P1Object *videoobj = (P1Object *) user_data;
-    p1_log(videoobj, P1_LOG_INFO, "%s", errstr);
+    P1VideoSourcePriv *priv = vsrc->priv;
+
+    if (produced != NULL)
+        *produced = __atomic_load_n(&priv->frames_produced, __ATOMIC_RELAXED);
+    if (consumed != NULL)
+        *consumed = __atomic_load_n(&priv->frames_consumed, __ATOMIC_RELAXED);
+    if (skipped != NULL)
+        *skipped = __atomic_load_n(&priv->frames_skipped, __ATOMIC_RELAXED);
 }
@@ -0,0 +1,182 @@
+#include "p1stream_priv.h"
+
+#include <pthread.h>
+
+#if __x86_64__ || __i386__
+#   include <immintrin.h>
+#   define P1_HAVE_SSE2 1
+#elif __ARM_NEON
+#   include <arm_neon.h>
+#   define P1_HAVE_NEON 1
+#endif
+
+// Change detection between the luma planes of two pictures, one 16x16
+// macroblock at a time. Each block is compared row by row, and stops at the
+// first difference, so only unchanged blocks are read in full.
+//
+// There are SIMD implementations for SSE2 and NEON, where a block row is a
+// single vector. The comparison is bound by memory bandwidth, so wider vectors
+// don't help. Blocks cut off at the right edge use the plain C implementation.
+
+// Compares a block of 16 columns and the given number of rows. Returns true if
+// any byte differs.
+typedef bool (*P1VideoChangeFn)(const uint8_t *a, size_t a_stride, const uint8_t *b, size_t b_stride, int rows);
+
+typedef struct _P1VideoChangeDetector P1VideoChangeDetector;
+
+struct _P1VideoChangeDetector {
+    const char *name;
+    P1VideoChangeFn fn;
+};
+
+static bool p1_video_change_c(const uint8_t *a, size_t a_stride, const uint8_t *b, size_t b_stride, int rows);
+static bool p1_video_change_cols_c(const uint8_t *a, size_t a_stride, const uint8_t *b, size_t b_stride,
+                                   int cols, int rows);
+#if P1_HAVE_SSE2
+static bool p1_video_change_sse2(const uint8_t *a, size_t a_stride, const uint8_t *b, size_t b_stride, int rows);
+#endif
+#if P1_HAVE_NEON
+static bool p1_video_change_neon(const uint8_t *a, size_t a_stride, const uint8_t *b, size_t b_stride, int rows);
+#endif
+static void p1_video_select_change_detector();
+
+static const P1VideoChangeDetector c_detector = { "C", p1_video_change_c };
+#if P1_HAVE_SSE2
+static const P1VideoChangeDetector sse2_detector = { "SSE2", p1_video_change_sse2 };
+#endif
+#if P1_HAVE_NEON
+static const P1VideoChangeDetector neon_detector = { "NEON", p1_video_change_neon };
+#endif
+
+static pthread_once_t detector_once = PTHREAD_ONCE_INIT;
+static const P1VideoChangeDetector *detector = &c_detector;
+
+
+int p1_video_change_map(uint8_t *map, const x264_picture_t *cur, const x264_picture_t *prev, int width, int height)
+{
+    const uint8_t *a = cur->img.plane[0];
+    const uint8_t *b = prev->img.plane[0];
+    size_t a_stride = (size_t) cur->img.i_stride[0];
+    size_t b_stride = (size_t) prev->img.i_stride[0];
+    int mb_width = (width + 15) / 16;
+    int full_width = width / 16;
+    int changed = 0;
+    int x, y, rows;
+    bool diff;
+
+    pthread_once(&detector_once, p1_video_select_change_detector);
+
+    for (y = 0; y < height; y += 16) {
+        rows = height - y < 16 ? height - y : 16;
+
+        for (x = 0; x < mb_width; x++) {
+            if (x < full_width)
+                diff = detector->fn(a + x * 16, a_stride, b + x * 16, b_stride, rows);
+            else
+                diff = p1_video_change_cols_c(a + x * 16, a_stride, b + x * 16, b_stride, width - x * 16, rows);
+
+            *(map++) = diff;
+            changed += diff;
+        }
+
+        a += a_stride * 16;
+        b += b_stride * 16;
+    }
+
+    return changed;
+}
+
+const char *p1_video_change_map_isa()
+{
+    pthread_once(&detector_once, p1_video_select_change_detector);
+
+    return detector->name;
+}
+
+static void p1_video_select_change_detector()
+{
+#if P1_HAVE_SSE2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        detector = &sse2_detector;
+        return;
+    }
+#endif
+
+#if P1_HAVE_NEON
+    detector = &neon_detector;
+#endif
+}
+
+
+static bool p1_video_change_c(const uint8_t *a, size_t a_stride, const uint8_t *b, size_t b_stride, int rows)
+{
+    return p1_video_change_cols_c(a, a_stride, b, b_stride, 16, rows);
+}
+
+static bool p1_video_change_cols_c(const uint8_t *a, size_t a_stride, const uint8_t *b, size_t b_stride,
+                                   int cols, int rows)
+{
+    int x, y;
+
+    for (y = 0; y < rows; y++) {
+        for (x = 0; x < cols; x++) {
+            if (a[x] != b[x])
+                return true;
+        }
+
+        a += a_stride;
+        b += b_stride;
+    }
+
+    return false;
+}
+
+
+#if P1_HAVE_SSE2
+
+#define P1_SSE2_ATTR __attribute__((target("sse2")))
+
+static P1_SSE2_ATTR bool p1_video_change_sse2(const uint8_t *a, size_t a_stride, const uint8_t *b, size_t b_stride, int rows)
+{
+    __m128i va, vb;
+    int y;
+
+    for (y = 0; y < rows; y++) {
+        va = _mm_loadu_si128((const __m128i *) a);
+        vb = _mm_loadu_si128((const __m128i *) b);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xffff)
+            return true;
+
+        a += a_stride;
+        b += b_stride;
+    }
+
+    return false;
+}
+
+#endif
+
+
+#if P1_HAVE_NEON
+
+static bool p1_video_change_neon(const uint8_t *a, size_t a_stride, const uint8_t *b, size_t b_stride, int rows)
+{
+    uint8x16_t diff;
+    uint64x2_t wide;
+    int y;
+
+    for (y = 0; y < rows; y++) {
+        diff = veorq_u8(vld1q_u8(a), vld1q_u8(b));
+        wide = vreinterpretq_u64_u8(diff);
+        if ((vgetq_lane_u64(wide, 0) | vgetq_lane_u64(wide, 1)) != 0)
+            return true;
+
+        a += a_stride;
+        b += b_stride;
+    }
+
+    return false;
+}
+
+#endif
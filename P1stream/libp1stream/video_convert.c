@@ -0,0 +1,413 @@
+#include "p1stream_priv.h"
+
+#include <pthread.h>
+
+#if __x86_64__ || __i386__
+#   include <immintrin.h>
+#   define P1_HAVE_SSE2 1
+#   define P1_HAVE_AVX2 1
+#elif __ARM_NEON
+#   include <arm_neon.h>
+#   define P1_HAVE_NEON 1
+#endif
+
+// Colorspace conversion from BGRA to NV12, using BT.601 limited range
+// coefficients. These match the OpenCL kernel of the GL backend, scaled
+// to 8-bit fixed point. Chroma is the average of each 2x2 block.
+//
+// There are SIMD implementations for SSE2, AVX2 and NEON, selected at runtime
+// based on CPU features. All produce the exact same output as the plain C
+// implementation, which also handles columns left over at the right edge.
+
+#define P1_Y(r, g, b)   ((( 66 * (r) + 129 * (g) +  25 * (b) + 128) >> 8) + 16)
+#define P1_U(r, g, b)   (((-38 * (r) -  74 * (g) + 112 * (b) + 128) >> 8) + 128)
+#define P1_V(r, g, b)   (((112 * (r) -  94 * (g) -  18 * (b) + 128) >> 8) + 128)
+
+// Converts columns [x1, x2) of rows [y1, y2). The column range is a multiple
+// of the converter step.
+typedef void (*P1VideoConvertFn)(x264_picture_t *pic, const uint8_t *in, size_t in_stride, int x1, int x2, int y1, int y2);
+
+typedef struct _P1VideoConverter P1VideoConverter;
+
+struct _P1VideoConverter {
+    const char *name;
+    int step;
+    P1VideoConvertFn fn;
+};
+
+static void p1_video_convert_c(x264_picture_t *pic, const uint8_t *in, size_t in_stride, int x1, int x2, int y1, int y2);
+#if P1_HAVE_SSE2
+static void p1_video_convert_sse2(x264_picture_t *pic, const uint8_t *in, size_t in_stride, int x1, int x2, int y1, int y2);
+#endif
+#if P1_HAVE_AVX2
+static void p1_video_convert_avx2(x264_picture_t *pic, const uint8_t *in, size_t in_stride, int x1, int x2, int y1, int y2);
+#endif
+#if P1_HAVE_NEON
+static void p1_video_convert_neon(x264_picture_t *pic, const uint8_t *in, size_t in_stride, int x1, int x2, int y1, int y2);
+#endif
+static void p1_video_select_converter();
+
+static const P1VideoConverter c_converter = { "C", 2, p1_video_convert_c };
+#if P1_HAVE_SSE2
+static const P1VideoConverter sse2_converter = { "SSE2", 16, p1_video_convert_sse2 };
+#endif
+#if P1_HAVE_AVX2
+static const P1VideoConverter avx2_converter = { "AVX2", 32, p1_video_convert_avx2 };
+#endif
+#if P1_HAVE_NEON
+static const P1VideoConverter neon_converter = { "NEON", 16, p1_video_convert_neon };
+#endif
+
+static pthread_once_t converter_once = PTHREAD_ONCE_INIT;
+static const P1VideoConverter *converter = &c_converter;
+
+
+void p1_video_bgra_to_yuv(x264_picture_t *pic, int width, const uint8_t *in, size_t in_stride, int y1, int y2)
+{
+    int n;
+
+    pthread_once(&converter_once, p1_video_select_converter);
+
+    n = width - width % converter->step;
+    if (n != 0)
+        converter->fn(pic, in, in_stride, 0, n, y1, y2);
+    if (n != width)
+        p1_video_convert_c(pic, in, in_stride, n, width, y1, y2);
+}
+
+const char *p1_video_bgra_to_yuv_isa()
+{
+    pthread_once(&converter_once, p1_video_select_converter);
+
+    return converter->name;
+}
+
+static void p1_video_select_converter()
+{
+#if P1_HAVE_SSE2 || P1_HAVE_AVX2
+    __builtin_cpu_init();
+#endif
+
+#if P1_HAVE_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        converter = &avx2_converter;
+        return;
+    }
+#endif
+
+#if P1_HAVE_SSE2
+    if (__builtin_cpu_supports("sse2")) {
+        converter = &sse2_converter;
+        return;
+    }
+#endif
+
+#if P1_HAVE_NEON
+    converter = &neon_converter;
+#endif
+}
+
+
+static void p1_video_convert_c(x264_picture_t *pic, const uint8_t *in, size_t in_stride, int x1, int x2, int y1, int y2)
+{
+    x264_image_t *img = &pic->img;
+    int x, y;
+
+    for (y = y1; y < y2; y += 2) {
+        const uint8_t *in0 = in + y * in_stride;
+        const uint8_t *in1 = in0 + in_stride;
+        uint8_t *out_y0 = img->plane[0] + y * img->i_stride[0];
+        uint8_t *out_y1 = out_y0 + img->i_stride[0];
+        uint8_t *out_uv = img->plane[1] + (y / 2) * img->i_stride[1];
+
+        for (x = x1; x < x2; x += 2) {
+            const uint8_t *p00 = in0 + x * 4;
+            const uint8_t *p01 = p00 + 4;
+            const uint8_t *p10 = in1 + x * 4;
+            const uint8_t *p11 = p10 + 4;
+
+            out_y0[x]     = P1_Y(p00[2], p00[1], p00[0]);
+            out_y0[x + 1] = P1_Y(p01[2], p01[1], p01[0]);
+            out_y1[x]     = P1_Y(p10[2], p10[1], p10[0]);
+            out_y1[x + 1] = P1_Y(p11[2], p11[1], p11[0]);
+
+            int r = (p00[2] + p01[2] + p10[2] + p11[2] + 2) >> 2;
+            int g = (p00[1] + p01[1] + p10[1] + p11[1] + 2) >> 2;
+            int b = (p00[0] + p01[0] + p10[0] + p11[0] + 2) >> 2;
+            out_uv[x]     = P1_U(r, g, b);
+            out_uv[x + 1] = P1_V(r, g, b);
+        }
+    }
+}
+
+
+#if P1_HAVE_SSE2
+
+// The SIMD implementations work on 16-bit lanes. The luma sum fits unsigned,
+// the chroma sums fit signed, so plain 16-bit arithmetic gives exact results.
+
+#define P1_SSE2_ATTR __attribute__((target("sse2")))
+
+// Extract one channel from 8 pixels into 16-bit lanes.
+static inline P1_SSE2_ATTR __m128i p1_sse2_channel(__m128i a, __m128i b, int shift)
+{
+    const __m128i mask = _mm_set1_epi32(0xff);
+
+    a = _mm_and_si128(_mm_srli_epi32(a, shift), mask);
+    b = _mm_and_si128(_mm_srli_epi32(b, shift), mask);
+    return _mm_packs_epi32(a, b);
+}
+
+static inline P1_SSE2_ATTR __m128i p1_sse2_y(__m128i r, __m128i g, __m128i b)
+{
+    __m128i y = _mm_set1_epi16(128);
+
+    y = _mm_add_epi16(y, _mm_mullo_epi16(r, _mm_set1_epi16(66)));
+    y = _mm_add_epi16(y, _mm_mullo_epi16(g, _mm_set1_epi16(129)));
+    y = _mm_add_epi16(y, _mm_mullo_epi16(b, _mm_set1_epi16(25)));
+    return _mm_add_epi16(_mm_srli_epi16(y, 8), _mm_set1_epi16(16));
+}
+
+static inline P1_SSE2_ATTR __m128i p1_sse2_uv(__m128i r, __m128i g, __m128i b, int cr, int cg, int cb)
+{
+    __m128i c = _mm_set1_epi16(128);
+
+    c = _mm_add_epi16(c, _mm_mullo_epi16(r, _mm_set1_epi16(cr)));
+    c = _mm_add_epi16(c, _mm_mullo_epi16(g, _mm_set1_epi16(cg)));
+    c = _mm_add_epi16(c, _mm_mullo_epi16(b, _mm_set1_epi16(cb)));
+    return _mm_add_epi16(_mm_srai_epi16(c, 8), _mm_set1_epi16(128));
+}
+
+// Rounded average of 2x2 blocks, given one channel of two rows of 16 pixels.
+static inline P1_SSE2_ATTR __m128i p1_sse2_average(__m128i lo0, __m128i hi0, __m128i lo1, __m128i hi1)
+{
+    const __m128i ones = _mm_set1_epi16(1);
+
+    __m128i lo = _mm_madd_epi16(_mm_add_epi16(lo0, lo1), ones);
+    __m128i hi = _mm_madd_epi16(_mm_add_epi16(hi0, hi1), ones);
+    return _mm_srli_epi16(_mm_add_epi16(_mm_packs_epi32(lo, hi), _mm_set1_epi16(2)), 2);
+}
+
+static P1_SSE2_ATTR void p1_video_convert_sse2(x264_picture_t *pic, const uint8_t *in, size_t in_stride, int x1, int x2, int y1, int y2)
+{
+    x264_image_t *img = &pic->img;
+    int x, y;
+
+    for (y = y1; y < y2; y += 2) {
+        const uint8_t *in0 = in + y * in_stride;
+        const uint8_t *in1 = in0 + in_stride;
+        uint8_t *out_y0 = img->plane[0] + y * img->i_stride[0];
+        uint8_t *out_y1 = out_y0 + img->i_stride[0];
+        uint8_t *out_uv = img->plane[1] + (y / 2) * img->i_stride[1];
+
+        for (x = x1; x < x2; x += 16) {
+            const __m128i *p0 = (const __m128i *) (in0 + x * 4);
+            const __m128i *p1 = (const __m128i *) (in1 + x * 4);
+            __m128i a0 = _mm_loadu_si128(p0);
+            __m128i a1 = _mm_loadu_si128(p0 + 1);
+            __m128i a2 = _mm_loadu_si128(p0 + 2);
+            __m128i a3 = _mm_loadu_si128(p0 + 3);
+            __m128i b0 = _mm_loadu_si128(p1);
+            __m128i b1 = _mm_loadu_si128(p1 + 1);
+            __m128i b2 = _mm_loadu_si128(p1 + 2);
+            __m128i b3 = _mm_loadu_si128(p1 + 3);
+
+            __m128i r0l = p1_sse2_channel(a0, a1, 16), r0h = p1_sse2_channel(a2, a3, 16);
+            __m128i g0l = p1_sse2_channel(a0, a1,  8), g0h = p1_sse2_channel(a2, a3,  8);
+            __m128i b0l = p1_sse2_channel(a0, a1,  0), b0h = p1_sse2_channel(a2, a3,  0);
+            __m128i r1l = p1_sse2_channel(b0, b1, 16), r1h = p1_sse2_channel(b2, b3, 16);
+            __m128i g1l = p1_sse2_channel(b0, b1,  8), g1h = p1_sse2_channel(b2, b3,  8);
+            __m128i b1l = p1_sse2_channel(b0, b1,  0), b1h = p1_sse2_channel(b2, b3,  0);
+
+            _mm_storeu_si128((__m128i *) (out_y0 + x),
+                             _mm_packus_epi16(p1_sse2_y(r0l, g0l, b0l), p1_sse2_y(r0h, g0h, b0h)));
+            _mm_storeu_si128((__m128i *) (out_y1 + x),
+                             _mm_packus_epi16(p1_sse2_y(r1l, g1l, b1l), p1_sse2_y(r1h, g1h, b1h)));
+
+            __m128i r = p1_sse2_average(r0l, r0h, r1l, r1h);
+            __m128i g = p1_sse2_average(g0l, g0h, g1l, g1h);
+            __m128i b = p1_sse2_average(b0l, b0h, b1l, b1h);
+            __m128i u = p1_sse2_uv(r, g, b, -38, -74, 112);
+            __m128i v = p1_sse2_uv(r, g, b, 112, -94, -18);
+            _mm_storeu_si128((__m128i *) (out_uv + x),
+                             _mm_unpacklo_epi8(_mm_packus_epi16(u, u), _mm_packus_epi16(v, v)));
+        }
+    }
+}
+
+#endif
+
+
+#if P1_HAVE_AVX2
+
+// Same as the SSE2 implementation, but 32 pixels at a time. Packing
+// instructions work within 128-bit lanes, so results are permuted back into
+// order afterwards.
+
+#define P1_AVX2_ATTR __attribute__((target("avx2")))
+
+static inline P1_AVX2_ATTR __m256i p1_avx2_pack_epi32(__m256i a, __m256i b)
+{
+    return _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xd8);
+}
+
+static inline P1_AVX2_ATTR __m256i p1_avx2_pack_epi16(__m256i a, __m256i b)
+{
+    return _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8);
+}
+
+static inline P1_AVX2_ATTR __m256i p1_avx2_channel(__m256i a, __m256i b, int shift)
+{
+    const __m256i mask = _mm256_set1_epi32(0xff);
+
+    a = _mm256_and_si256(_mm256_srli_epi32(a, shift), mask);
+    b = _mm256_and_si256(_mm256_srli_epi32(b, shift), mask);
+    return p1_avx2_pack_epi32(a, b);
+}
+
+static inline P1_AVX2_ATTR __m256i p1_avx2_y(__m256i r, __m256i g, __m256i b)
+{
+    __m256i y = _mm256_set1_epi16(128);
+
+    y = _mm256_add_epi16(y, _mm256_mullo_epi16(r, _mm256_set1_epi16(66)));
+    y = _mm256_add_epi16(y, _mm256_mullo_epi16(g, _mm256_set1_epi16(129)));
+    y = _mm256_add_epi16(y, _mm256_mullo_epi16(b, _mm256_set1_epi16(25)));
+    return _mm256_add_epi16(_mm256_srli_epi16(y, 8), _mm256_set1_epi16(16));
+}
+
+static inline P1_AVX2_ATTR __m256i p1_avx2_uv(__m256i r, __m256i g, __m256i b, int cr, int cg, int cb)
+{
+    __m256i c = _mm256_set1_epi16(128);
+
+    c = _mm256_add_epi16(c, _mm256_mullo_epi16(r, _mm256_set1_epi16(cr)));
+    c = _mm256_add_epi16(c, _mm256_mullo_epi16(g, _mm256_set1_epi16(cg)));
+    c = _mm256_add_epi16(c, _mm256_mullo_epi16(b, _mm256_set1_epi16(cb)));
+    return _mm256_add_epi16(_mm256_srai_epi16(c, 8), _mm256_set1_epi16(128));
+}
+
+static inline P1_AVX2_ATTR __m256i p1_avx2_average(__m256i lo0, __m256i hi0, __m256i lo1, __m256i hi1)
+{
+    const __m256i ones = _mm256_set1_epi16(1);
+
+    __m256i lo = _mm256_madd_epi16(_mm256_add_epi16(lo0, lo1), ones);
+    __m256i hi = _mm256_madd_epi16(_mm256_add_epi16(hi0, hi1), ones);
+    return _mm256_srli_epi16(_mm256_add_epi16(p1_avx2_pack_epi32(lo, hi), _mm256_set1_epi16(2)), 2);
+}
+
+static P1_AVX2_ATTR void p1_video_convert_avx2(x264_picture_t *pic, const uint8_t *in, size_t in_stride, int x1, int x2, int y1, int y2)
+{
+    x264_image_t *img = &pic->img;
+    int x, y;
+
+    for (y = y1; y < y2; y += 2) {
+        const uint8_t *in0 = in + y * in_stride;
+        const uint8_t *in1 = in0 + in_stride;
+        uint8_t *out_y0 = img->plane[0] + y * img->i_stride[0];
+        uint8_t *out_y1 = out_y0 + img->i_stride[0];
+        uint8_t *out_uv = img->plane[1] + (y / 2) * img->i_stride[1];
+
+        for (x = x1; x < x2; x += 32) {
+            const __m256i *p0 = (const __m256i *) (in0 + x * 4);
+            const __m256i *p1 = (const __m256i *) (in1 + x * 4);
+            __m256i a0 = _mm256_loadu_si256(p0);
+            __m256i a1 = _mm256_loadu_si256(p0 + 1);
+            __m256i a2 = _mm256_loadu_si256(p0 + 2);
+            __m256i a3 = _mm256_loadu_si256(p0 + 3);
+            __m256i b0 = _mm256_loadu_si256(p1);
+            __m256i b1 = _mm256_loadu_si256(p1 + 1);
+            __m256i b2 = _mm256_loadu_si256(p1 + 2);
+            __m256i b3 = _mm256_loadu_si256(p1 + 3);
+
+            __m256i r0l = p1_avx2_channel(a0, a1, 16), r0h = p1_avx2_channel(a2, a3, 16);
+            __m256i g0l = p1_avx2_channel(a0, a1,  8), g0h = p1_avx2_channel(a2, a3,  8);
+            __m256i b0l = p1_avx2_channel(a0, a1,  0), b0h = p1_avx2_channel(a2, a3,  0);
+            __m256i r1l = p1_avx2_channel(b0, b1, 16), r1h = p1_avx2_channel(b2, b3, 16);
+            __m256i g1l = p1_avx2_channel(b0, b1,  8), g1h = p1_avx2_channel(b2, b3,  8);
+            __m256i b1l = p1_avx2_channel(b0, b1,  0), b1h = p1_avx2_channel(b2, b3,  0);
+
+            _mm256_storeu_si256((__m256i *) (out_y0 + x),
+                                p1_avx2_pack_epi16(p1_avx2_y(r0l, g0l, b0l), p1_avx2_y(r0h, g0h, b0h)));
+            _mm256_storeu_si256((__m256i *) (out_y1 + x),
+                                p1_avx2_pack_epi16(p1_avx2_y(r1l, g1l, b1l), p1_avx2_y(r1h, g1h, b1h)));
+
+            __m256i r = p1_avx2_average(r0l, r0h, r1l, r1h);
+            __m256i g = p1_avx2_average(g0l, g0h, g1l, g1h);
+            __m256i b = p1_avx2_average(b0l, b0h, b1l, b1h);
+            __m256i u = p1_avx2_uv(r, g, b, -38, -74, 112);
+            __m256i v = p1_avx2_uv(r, g, b, 112, -94, -18);
+            __m128i u8 = _mm256_castsi256_si128(p1_avx2_pack_epi16(u, u));
+            __m128i v8 = _mm256_castsi256_si128(p1_avx2_pack_epi16(v, v));
+            _mm_storeu_si128((__m128i *) (out_uv + x),      _mm_unpacklo_epi8(u8, v8));
+            _mm_storeu_si128((__m128i *) (out_uv + x + 16), _mm_unpackhi_epi8(u8, v8));
+        }
+    }
+}
+
+#endif
+
+
+#if P1_HAVE_NEON
+
+static inline uint8x8_t p1_neon_y(uint8x8_t r, uint8x8_t g, uint8x8_t b)
+{
+    uint16x8_t y = vdupq_n_u16(128);
+
+    y = vmlal_u8(y, r, vdup_n_u8(66));
+    y = vmlal_u8(y, g, vdup_n_u8(129));
+    y = vmlal_u8(y, b, vdup_n_u8(25));
+    return vadd_u8(vshrn_n_u16(y, 8), vdup_n_u8(16));
+}
+
+static inline uint8x8_t p1_neon_uv(int16x8_t r, int16x8_t g, int16x8_t b, int16_t cr, int16_t cg, int16_t cb)
+{
+    int16x8_t c = vdupq_n_s16(128);
+
+    c = vmlaq_n_s16(c, r, cr);
+    c = vmlaq_n_s16(c, g, cg);
+    c = vmlaq_n_s16(c, b, cb);
+    return vqmovun_s16(vaddq_s16(vshrq_n_s16(c, 8), vdupq_n_s16(128)));
+}
+
+// Rounded average of 2x2 blocks, given one channel of two rows of 16 pixels.
+static inline int16x8_t p1_neon_average(uint8x16_t c0, uint8x16_t c1)
+{
+    return vreinterpretq_s16_u16(vrshrq_n_u16(vpadalq_u8(vpaddlq_u8(c0), c1), 2));
+}
+
+static void p1_video_convert_neon(x264_picture_t *pic, const uint8_t *in, size_t in_stride, int x1, int x2, int y1, int y2)
+{
+    x264_image_t *img = &pic->img;
+    int x, y;
+
+    for (y = y1; y < y2; y += 2) {
+        const uint8_t *in0 = in + y * in_stride;
+        const uint8_t *in1 = in0 + in_stride;
+        uint8_t *out_y0 = img->plane[0] + y * img->i_stride[0];
+        uint8_t *out_y1 = out_y0 + img->i_stride[0];
+        uint8_t *out_uv = img->plane[1] + (y / 2) * img->i_stride[1];
+
+        for (x = x1; x < x2; x += 16) {
+            // Deinterleaves into B, G, R and A.
+            uint8x16x4_t p0 = vld4q_u8(in0 + x * 4);
+            uint8x16x4_t p1 = vld4q_u8(in1 + x * 4);
+
+            vst1q_u8(out_y0 + x, vcombine_u8(
+                p1_neon_y(vget_low_u8(p0.val[2]),  vget_low_u8(p0.val[1]),  vget_low_u8(p0.val[0])),
+                p1_neon_y(vget_high_u8(p0.val[2]), vget_high_u8(p0.val[1]), vget_high_u8(p0.val[0]))));
+            vst1q_u8(out_y1 + x, vcombine_u8(
+                p1_neon_y(vget_low_u8(p1.val[2]),  vget_low_u8(p1.val[1]),  vget_low_u8(p1.val[0])),
+                p1_neon_y(vget_high_u8(p1.val[2]), vget_high_u8(p1.val[1]), vget_high_u8(p1.val[0]))));
+
+            int16x8_t r = p1_neon_average(p0.val[2], p1.val[2]);
+            int16x8_t g = p1_neon_average(p0.val[1], p1.val[1]);
+            int16x8_t b = p1_neon_average(p0.val[0], p1.val[0]);
+            uint8x8x2_t uv = {{
+                p1_neon_uv(r, g, b, -38, -74, 112),
+                p1_neon_uv(r, g, b, 112, -94, -18)
+            }};
+            vst2_u8(out_uv + x, uv);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,766 @@
+#include "p1stream_priv.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if __SSE2__
+#   include <emmintrin.h>
+#elif __ARM_NEON
+#   include <arm_neon.h>
+#endif
+
+// The software backend composites into a plain BGRA canvas in memory. It
+// follows the same rules as the GL backend: sources are drawn in list order
+// without blending, pixels are covered if their center lies within the
+// destination rectangle, and sampling is bilinear with clamping to the edge.
+// Sources may instead use one of the separable filters of video_scale.c.
+
+// Sample positions along one axis, for a single output row or column.
+struct _P1VideoCPUSample {
+    int i0;
+    int i1;
+    // Weight of the second sample, in the range [0, 256).
+    int f;
+};
+
+// A source drawn in the current frame.
+struct _P1VideoCPUDraw {
+    P1VideoSource *vsrc;
+    // Covered area of the canvas.
+    int x_begin, x_end;
+    int y_begin, y_end;
+    // Range of source bytes read for each row, starting at this column.
+    int span_begin;
+    size_t span_size;
+    // Whether rows are a plain copy horizontally.
+    bool copy;
+    // Separable filter used instead of bilinear sampling, if any.
+    P1VideoScaler *scaler;
+    // Whether rows are taken from, or kept in, the scaled frame cache.
+    bool cached;
+};
+
+// Canvas clear value. Opaque black, like the GL clear color.
+static const uint32_t clear_pixel = 0xff000000;
+
+static bool p1_video_cpu_start(P1VideoFull *videof);
+static void p1_video_cpu_stop(P1VideoFull *videof);
+static bool p1_video_cpu_link_source(P1VideoFull *videof, P1VideoSource *vsrc);
+static void p1_video_cpu_unlink_source(P1VideoFull *videof, P1VideoSource *vsrc);
+static bool p1_video_cpu_upload(P1VideoFull *videof, P1VideoSource *vsrc, int width, int height, size_t stride, const void *data);
+static bool p1_video_cpu_hold(P1VideoFull *videof, P1VideoSource *vsrc, int width, int height, size_t stride, const void *data);
+static bool p1_video_cpu_begin(P1VideoFull *videof);
+static bool p1_video_cpu_clear(P1VideoFull *videof);
+static bool p1_video_cpu_draw(P1VideoFull *videof, P1VideoSource *vsrc);
+static bool p1_video_cpu_end(P1VideoFull *videof);
+static bool p1_video_cpu_preview(P1VideoFull *videof);
+static bool p1_video_cpu_convert(P1VideoFull *videof);
+
+static void p1_video_cpu_composite_tile(void *data, int job, int worker);
+static void p1_video_cpu_draw_rows(P1VideoFull *videof, P1VideoCPUDraw *d, const P1VideoCPUSample *xmap,
+                                   int y1, int y2, uint8_t *scratch);
+static void p1_video_cpu_draw_cached(P1VideoFull *videof, int i, int y1, int y2, uint8_t *scratch);
+static void p1_video_cpu_free_frame(P1VideoSource *vsrc);
+static bool p1_video_cpu_update_cache(P1VideoFull *videof, P1VideoSource *vsrc, int width, int height);
+static void p1_video_cpu_free_cache(P1VideoSource *vsrc);
+static bool p1_video_cpu_update_scaler(P1VideoFull *videof, P1VideoSource *vsrc,
+                                       int x_begin, int x_end, int y_begin, int y_end);
+static void p1_video_cpu_free_scaler(P1VideoSource *vsrc);
+static bool p1_video_cpu_grow_draws(P1VideoFull *videof);
+static bool p1_video_cpu_cover(int *out_begin, int *out_end, int out_size, float p1, float p2);
+static void p1_video_cpu_map(P1VideoCPUSample *out, int i, int out_size,
+                             float p1, float p2, float t1, float t2, int in_size);
+static void p1_video_cpu_blend_rows(uint8_t *out, const uint8_t *a, const uint8_t *b, size_t len, int f);
+static void p1_video_cpu_sample_row(uint32_t *out, const uint32_t *in, const P1VideoCPUSample *xmap, int n);
+
+const P1VideoBackend p1_video_cpu_backend = {
+    .name           = "software",
+    .partial        = true,
+    .start          = p1_video_cpu_start,
+    .stop           = p1_video_cpu_stop,
+    .link_source    = p1_video_cpu_link_source,
+    .unlink_source  = p1_video_cpu_unlink_source,
+    .upload         = p1_video_cpu_upload,
+    .hold           = p1_video_cpu_hold,
+    .begin          = p1_video_cpu_begin,
+    .clear          = p1_video_cpu_clear,
+    .draw           = p1_video_cpu_draw,
+    .end            = p1_video_cpu_end,
+    .preview        = p1_video_cpu_preview,
+    .convert        = p1_video_cpu_convert
+};
+
+
+static bool p1_video_cpu_start(P1VideoFull *videof)
+{
+    P1Video *video = (P1Video *) videof;
+    P1Object *videoobj = (P1Object *) videof;
+    int ret;
+
+    videof->canvas_stride = (size_t) video->width * 4;
+
+    ret = posix_memalign((void **) &videof->canvas, 64, videof->canvas_stride * video->height);
+    if (ret != 0) {
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to allocate canvas: %s", strerror(ret));
+        goto fail;
+    }
+
+    p1_log(videoobj, P1_LOG_INFO, "Using %s colorspace conversion and %s scaling",
+           p1_video_bgra_to_yuv_isa(), p1_video_scale_isa());
+
+    return true;
+
+fail:
+    return false;
+}
+
+static void p1_video_cpu_stop(P1VideoFull *videof)
+{
+    P1Video *video = (P1Video *) videof;
+    P1ListNode *head;
+    P1ListNode *node;
+
+    head = &video->sources;
+    p1_list_iterate(head, node) {
+        P1Source *src = p1_list_get_container(node, P1Source, link);
+        P1VideoSource *vsrc = (P1VideoSource *) src;
+
+        p1_video_cpu_free_frame(vsrc);
+        p1_video_cpu_free_scaler(vsrc);
+        p1_video_cpu_free_cache(vsrc);
+    }
+
+    free(videof->cpu_rows);
+    videof->cpu_rows = NULL;
+    videof->cpu_row_size = 0;
+
+    free(videof->cpu_xmap);
+    videof->cpu_xmap = NULL;
+
+    free(videof->cpu_draws);
+    videof->cpu_draws = NULL;
+    videof->cpu_num_draws = videof->cpu_max_draws = 0;
+
+    free(videof->canvas);
+    videof->canvas = NULL;
+}
+
+static bool p1_video_cpu_link_source(P1VideoFull *videof, P1VideoSource *vsrc)
+{
+    // Frame storage is allocated on the first upload.
+    return true;
+}
+
+static void p1_video_cpu_unlink_source(P1VideoFull *videof, P1VideoSource *vsrc)
+{
+    p1_video_cpu_free_frame(vsrc);
+    p1_video_cpu_free_scaler(vsrc);
+    p1_video_cpu_free_cache(vsrc);
+}
+
+static bool p1_video_cpu_upload(P1VideoFull *videof, P1VideoSource *vsrc, int width, int height, size_t stride, const void *data)
+{
+    P1Object *obj = (P1Object *) vsrc;
+    P1VideoSourcePriv *priv = vsrc->priv;
+    size_t row_size = (size_t) width * 4;
+    size_t size = row_size * height;
+    const uint8_t *in = data;
+    uint8_t *out;
+    int i;
+
+    if (width <= 0 || height <= 0) {
+        p1_log(obj, P1_LOG_ERROR, "Invalid frame dimensions %dx%d", width, height);
+        return false;
+    }
+
+    // Stop reading from a held frame.
+    if (priv->cpu_borrowed)
+        p1_video_cpu_free_frame(vsrc);
+
+    if (size > priv->cpu_size) {
+        free(priv->cpu_data);
+        priv->cpu_size = 0;
+
+        if (posix_memalign((void **) &priv->cpu_data, 64, size) != 0) {
+            priv->cpu_data = NULL;
+            priv->cpu_width = priv->cpu_height = 0;
+            p1_log(obj, P1_LOG_ERROR, "Failed to allocate frame buffer");
+            return false;
+        }
+
+        priv->cpu_size = size;
+    }
+
+    priv->cpu_width = width;
+    priv->cpu_height = height;
+    priv->cpu_stride = row_size;
+
+    out = priv->cpu_data;
+    if (stride == row_size) {
+        memcpy(out, in, size);
+    }
+    else {
+        for (i = 0; i < height; i++) {
+            memcpy(out, in, row_size);
+            out += row_size;
+            in += stride;
+        }
+    }
+
+    return true;
+}
+
+// Read the frame in place, instead of copying it like upload does.
+static bool p1_video_cpu_hold(P1VideoFull *videof, P1VideoSource *vsrc, int width, int height, size_t stride, const void *data)
+{
+    P1VideoSourcePriv *priv = vsrc->priv;
+
+    if (width <= 0 || height <= 0 || stride < (size_t) width * 4)
+        return false;
+
+    p1_video_cpu_free_frame(vsrc);
+
+    priv->cpu_data = (uint8_t *) data;
+    priv->cpu_width = width;
+    priv->cpu_height = height;
+    priv->cpu_stride = stride;
+    priv->cpu_borrowed = true;
+
+    return true;
+}
+
+static bool p1_video_cpu_begin(P1VideoFull *videof)
+{
+    return true;
+}
+
+static bool p1_video_cpu_clear(P1VideoFull *videof)
+{
+    videof->cpu_num_draws = 0;
+
+    return true;
+}
+
+// Record a draw, the actual compositing happens in the end method.
+static bool p1_video_cpu_draw(P1VideoFull *videof, P1VideoSource *vsrc)
+{
+    P1Video *video = (P1Video *) videof;
+    P1Object *videoobj = (P1Object *) videof;
+    P1VideoSourcePriv *priv = vsrc->priv;
+    P1VideoCPUDraw *d;
+    P1VideoCPUSample *xmap;
+    int x_begin, x_end, y_begin, y_end;
+    int x, n, span_begin, span_end;
+    size_t span_size;
+    size_t row_size;
+    bool copy = false;
+
+    // Nothing uploaded yet.
+    if (priv->cpu_data == NULL)
+        return true;
+
+    // Find the covered area.
+    if (!p1_video_cpu_cover(&x_begin, &x_end, video->width, vsrc->x1, vsrc->x2))
+        return true;
+    if (!p1_video_cpu_cover(&y_begin, &y_end, video->height, vsrc->y1, vsrc->y2))
+        return true;
+
+    if (videof->cpu_num_draws == videof->cpu_max_draws) {
+        if (!p1_video_cpu_grow_draws(videof))
+            return false;
+    }
+
+    if (vsrc->filter != P1_FILTER_BILINEAR) {
+        // The scaler keeps its tables while placement is the same.
+        if (!p1_video_cpu_update_scaler(videof, vsrc, x_begin, x_end, y_begin, y_end))
+            return false;
+
+        span_begin = 0;
+        span_size = p1_video_scale_scratch_size(priv->cpu_scaler);
+    }
+    else {
+        // Build the column sample table.
+        xmap = videof->cpu_xmap + (size_t) videof->cpu_num_draws * video->width + x_begin;
+        n = x_end - x_begin;
+        for (x = 0; x < n; x++)
+            p1_video_cpu_map(&xmap[x], x_begin + x, video->width,
+                             vsrc->x1, vsrc->x2, vsrc->u1, vsrc->u2, priv->cpu_width);
+
+        // Determine the range of source columns we touch, and whether this is
+        // a plain 1:1 copy horizontally.
+        span_begin = span_end = xmap[0].i0;
+        copy = true;
+        for (x = 0; x < n; x++) {
+            if (xmap[x].i0 < span_begin) span_begin = xmap[x].i0;
+            if (xmap[x].i1 > span_end)   span_end   = xmap[x].i1;
+            if (xmap[x].f != 0 || xmap[x].i0 != xmap[0].i0 + x)
+                copy = false;
+        }
+        span_end++;
+        span_size = (size_t) (span_end - span_begin) * 4;
+    }
+
+    // Scratch rows for vertical interpolation, one for each worker.
+    if (span_size > videof->cpu_row_size) {
+        row_size = (span_size + 63) & ~(size_t) 63;
+
+        free(videof->cpu_rows);
+        if (posix_memalign((void **) &videof->cpu_rows, 64, row_size * videof->workers.num_workers) != 0) {
+            videof->cpu_rows = NULL;
+            videof->cpu_row_size = 0;
+            p1_log(videoobj, P1_LOG_ERROR, "Failed to allocate scratch rows");
+            return false;
+        }
+        videof->cpu_row_size = row_size;
+    }
+
+    d = &videof->cpu_draws[videof->cpu_num_draws++];
+    d->vsrc = vsrc;
+    d->x_begin = x_begin;
+    d->x_end = x_end;
+    d->y_begin = y_begin;
+    d->y_end = y_end;
+    d->span_begin = span_begin;
+    d->span_size = span_size;
+    d->copy = copy;
+    d->scaler = (vsrc->filter != P1_FILTER_BILINEAR) ? priv->cpu_scaler : NULL;
+
+    // Plain copies gain nothing from the cache.
+    d->cached = false;
+    if (!copy) {
+        if (!p1_video_cpu_update_cache(videof, vsrc, x_end - x_begin, y_end - y_begin))
+            return false;
+        d->cached = priv->cpu_cache_active;
+    }
+
+    return true;
+}
+
+static bool p1_video_cpu_end(P1VideoFull *videof)
+{
+    int n = p1_video_collect_tiles(videof, P1_TILE_DIRTY);
+
+    p1_worker_pool_run(&videof->workers, n, p1_video_cpu_composite_tile, videof);
+
+    return true;
+}
+
+static bool p1_video_cpu_preview(P1VideoFull *videof)
+{
+    P1Video *video = (P1Video *) videof;
+
+    if (video->preview_type == P1_PREVIEW_RAW_DATA) {
+        P1PreviewRawData info = {
+            .width = video->width,
+            .height = video->height,
+            .data = videof->canvas
+        };
+        video->preview_fn(&info, video->preview_user_data);
+    }
+
+    if (video->preview_type == P1_PREVIEW_SCALED)
+        return p1_video_preview_scaled(videof, videof->canvas, videof->canvas_stride);
+
+    return true;
+}
+
+static bool p1_video_cpu_convert(P1VideoFull *videof)
+{
+    p1_video_convert_frame(videof, videof->canvas, videof->canvas_stride);
+
+    return true;
+}
+
+
+// Clear and draw all sources in a dirty tile. Each row only depends on the
+// draw list, so the result is the same regardless of tiling.
+static void p1_video_cpu_composite_tile(void *data, int job, int worker)
+{
+    P1VideoFull *videof = (P1VideoFull *) data;
+    P1Video *video = (P1Video *) videof;
+    uint8_t *scratch = videof->cpu_rows + worker * videof->cpu_row_size;
+    int tile = videof->tile_jobs[job];
+    int y1 = tile * videof->tile_height;
+    int y2 = y1 + videof->tile_height;
+    int i, y_begin, y_end;
+    uint32_t *p;
+    size_t n;
+
+    if (y2 > video->height)
+        y2 = video->height;
+
+    p = (uint32_t *) (videof->canvas + y1 * videof->canvas_stride);
+    n = (size_t) video->width * (y2 - y1);
+    while (n--)
+        *(p++) = clear_pixel;
+
+    for (i = 0; i < videof->cpu_num_draws; i++) {
+        P1VideoCPUDraw *d = &videof->cpu_draws[i];
+
+        y_begin = d->y_begin > y1 ? d->y_begin : y1;
+        y_end = d->y_end < y2 ? d->y_end : y2;
+        if (y_begin >= y_end)
+            continue;
+
+        if (d->cached)
+            p1_video_cpu_draw_cached(videof, i, y_begin, y_end, scratch);
+        else if (d->scaler != NULL)
+            p1_video_scale_rows(d->scaler, videof->canvas, videof->canvas_stride,
+                                d->vsrc->priv->cpu_data, d->vsrc->priv->cpu_stride, y_begin, y_end, scratch);
+        else
+            p1_video_cpu_draw_rows(videof, d, videof->cpu_xmap + (size_t) i * video->width + d->x_begin,
+                                   y_begin, y_end, scratch);
+    }
+}
+
+// Draw rows of a source through its scaled frame cache. Rows already in the
+// cache are copied, others are scaled as usual and then added. Workers fill
+// disjoint rows, so the cache needs no locking.
+static void p1_video_cpu_draw_cached(P1VideoFull *videof, int i, int y1, int y2, uint8_t *scratch)
+{
+    P1Video *video = (P1Video *) videof;
+    P1VideoCPUDraw *d = &videof->cpu_draws[i];
+    P1VideoSourcePriv *priv = d->vsrc->priv;
+    size_t row_size = (size_t) (d->x_end - d->x_begin) * 4;
+    uint8_t *out, *cache;
+    int y, row;
+
+    for (y = y1; y < y2; y++) {
+        row = y - d->y_begin;
+        out = videof->canvas + y * videof->canvas_stride + (size_t) d->x_begin * 4;
+        cache = priv->cpu_cache + row * row_size;
+
+        if (priv->cpu_cache_rows[row]) {
+            memcpy(out, cache, row_size);
+            continue;
+        }
+
+        if (d->scaler != NULL)
+            p1_video_scale_rows(d->scaler, videof->canvas, videof->canvas_stride,
+                                priv->cpu_data, priv->cpu_stride, y, y + 1, scratch);
+        else
+            p1_video_cpu_draw_rows(videof, d, videof->cpu_xmap + (size_t) i * video->width + d->x_begin,
+                                   y, y + 1, scratch);
+
+        memcpy(cache, out, row_size);
+        priv->cpu_cache_rows[row] = 1;
+    }
+}
+
+static void p1_video_cpu_draw_rows(P1VideoFull *videof, P1VideoCPUDraw *d, const P1VideoCPUSample *xmap,
+                                   int y1, int y2, uint8_t *scratch)
+{
+    P1Video *video = (P1Video *) videof;
+    P1VideoSource *vsrc = d->vsrc;
+    P1VideoSourcePriv *priv = vsrc->priv;
+    P1VideoCPUSample ys;
+    size_t in_stride = priv->cpu_stride;
+    int n = d->x_end - d->x_begin;
+    int y;
+
+    for (y = y1; y < y2; y++) {
+        uint32_t *out = (uint32_t *) (videof->canvas + y * videof->canvas_stride) + d->x_begin;
+        const uint8_t *row;
+
+        p1_video_cpu_map(&ys, y, video->height,
+                         vsrc->y1, vsrc->y2, vsrc->v1, vsrc->v2, priv->cpu_height);
+
+        row = priv->cpu_data + ys.i0 * in_stride + d->span_begin * 4;
+        if (ys.f != 0) {
+            p1_video_cpu_blend_rows(scratch, row,
+                                    priv->cpu_data + ys.i1 * in_stride + d->span_begin * 4,
+                                    d->span_size, ys.f);
+            row = scratch;
+        }
+
+        if (d->copy)
+            memcpy(out, row, (size_t) n * 4);
+        else
+            p1_video_cpu_sample_row(out, (const uint32_t *) row - d->span_begin, xmap, n);
+    }
+}
+
+
+static void p1_video_cpu_free_frame(P1VideoSource *vsrc)
+{
+    P1VideoSourcePriv *priv = vsrc->priv;
+
+    if (!priv->cpu_borrowed)
+        free(priv->cpu_data);
+    priv->cpu_borrowed = false;
+    priv->cpu_data = NULL;
+    priv->cpu_size = 0;
+    priv->cpu_width = 0;
+    priv->cpu_height = 0;
+}
+
+// Check the scaled frame cache of a source against its current frame and
+// placement. A new frame or placement is drawn directly the first time, and
+// only cached once it is drawn again unchanged, so sources with a new frame
+// every tick don't pay for the cache. Returns false if allocation failed.
+static bool p1_video_cpu_update_cache(P1VideoFull *videof, P1VideoSource *vsrc, int width, int height)
+{
+    P1Object *videoobj = (P1Object *) videof;
+    P1VideoSourcePriv *priv = vsrc->priv;
+    size_t size = (size_t) width * height * 4;
+    const float placement[8] = {
+        vsrc->x1, vsrc->y1, vsrc->x2, vsrc->y2,
+        vsrc->u1, vsrc->v1, vsrc->u2, vsrc->v2
+    };
+    uint8_t *rows;
+
+    if (!priv->cpu_cache_keyed ||
+        priv->cpu_cache_generation != priv->frame_generation ||
+        priv->cpu_cache_filter != vsrc->filter ||
+        memcmp(priv->cpu_cache_placement, placement, sizeof(placement)) != 0) {
+        priv->cpu_cache_keyed = true;
+        priv->cpu_cache_generation = priv->frame_generation;
+        priv->cpu_cache_filter = vsrc->filter;
+        memcpy(priv->cpu_cache_placement, placement, sizeof(placement));
+        priv->cpu_cache_active = false;
+        return true;
+    }
+
+    if (priv->cpu_cache_active)
+        return true;
+
+    // Drawn again unchanged, start caching. Buffers are kept between frames.
+    if (size > priv->cpu_cache_size) {
+        free(priv->cpu_cache);
+        priv->cpu_cache_size = 0;
+
+        if (posix_memalign((void **) &priv->cpu_cache, 64, size) != 0) {
+            priv->cpu_cache = NULL;
+            goto fail;
+        }
+
+        priv->cpu_cache_size = size;
+    }
+
+    if (height > priv->cpu_cache_height) {
+        rows = realloc(priv->cpu_cache_rows, height);
+        if (rows == NULL)
+            goto fail;
+        priv->cpu_cache_rows = rows;
+        priv->cpu_cache_height = height;
+    }
+
+    memset(priv->cpu_cache_rows, 0, height);
+    priv->cpu_cache_active = true;
+
+    return true;
+
+fail:
+    p1_log(videoobj, P1_LOG_ERROR, "Failed to allocate scaled frame cache");
+    return false;
+}
+
+static void p1_video_cpu_free_cache(P1VideoSource *vsrc)
+{
+    P1VideoSourcePriv *priv = vsrc->priv;
+
+    free(priv->cpu_cache);
+    free(priv->cpu_cache_rows);
+    priv->cpu_cache = NULL;
+    priv->cpu_cache_size = 0;
+    priv->cpu_cache_rows = NULL;
+    priv->cpu_cache_height = 0;
+    priv->cpu_cache_keyed = false;
+    priv->cpu_cache_active = false;
+}
+
+// Prepare the filter coefficients of a source for the covered area.
+static bool p1_video_cpu_update_scaler(P1VideoFull *videof, P1VideoSource *vsrc,
+                                       int x_begin, int x_end, int y_begin, int y_end)
+{
+    P1Video *video = (P1Video *) videof;
+    P1Object *videoobj = (P1Object *) videof;
+    P1VideoSourcePriv *priv = vsrc->priv;
+    P1VideoScaler *scaler = priv->cpu_scaler;
+
+    if (scaler == NULL) {
+        scaler = priv->cpu_scaler = calloc(1, sizeof(P1VideoScaler));
+        if (scaler == NULL)
+            goto fail;
+    }
+
+    if (!p1_video_scale_axis_update(&scaler->x, vsrc->filter, priv->cpu_width, video->width,
+                                    x_begin, x_end, vsrc->x1, vsrc->x2, vsrc->u1, vsrc->u2))
+        goto fail;
+    if (!p1_video_scale_axis_update(&scaler->y, vsrc->filter, priv->cpu_height, video->height,
+                                    y_begin, y_end, vsrc->y1, vsrc->y2, vsrc->v1, vsrc->v2))
+        goto fail;
+
+    return true;
+
+fail:
+    p1_log(videoobj, P1_LOG_ERROR, "Failed to allocate filter coefficients");
+    return false;
+}
+
+static void p1_video_cpu_free_scaler(P1VideoSource *vsrc)
+{
+    P1VideoSourcePriv *priv = vsrc->priv;
+    P1VideoScaler *scaler = priv->cpu_scaler;
+
+    if (scaler == NULL)
+        return;
+
+    p1_video_scale_axis_free(&scaler->x);
+    p1_video_scale_axis_free(&scaler->y);
+    free(scaler);
+    priv->cpu_scaler = NULL;
+}
+
+// Grow the draw list and the matching column sample tables.
+static bool p1_video_cpu_grow_draws(P1VideoFull *videof)
+{
+    P1Video *video = (P1Video *) videof;
+    P1Object *videoobj = (P1Object *) videof;
+    int max_draws = videof->cpu_max_draws ? videof->cpu_max_draws * 2 : 4;
+    P1VideoCPUDraw *draws;
+    P1VideoCPUSample *xmap;
+
+    draws = realloc(videof->cpu_draws, max_draws * sizeof(P1VideoCPUDraw));
+    if (draws == NULL)
+        goto fail;
+    videof->cpu_draws = draws;
+
+    xmap = realloc(videof->cpu_xmap, (size_t) max_draws * video->width * sizeof(P1VideoCPUSample));
+    if (xmap == NULL)
+        goto fail;
+    videof->cpu_xmap = xmap;
+
+    videof->cpu_max_draws = max_draws;
+    return true;
+
+fail:
+    p1_log(videoobj, P1_LOG_ERROR, "Failed to allocate draw list");
+    return false;
+}
+
+// Determine the range of output pixels covered along one axis by [p1, p2],
+// which is in the range [-1, +1] and may be flipped. Pixels are covered if
+// their center lies within the range. Returns false if nothing is covered.
+static bool p1_video_cpu_cover(int *out_begin, int *out_end, int out_size, float p1, float p2)
+{
+    float a = (p1 + 1) * 0.5f * out_size;
+    float b = (p2 + 1) * 0.5f * out_size;
+    int begin, end;
+
+    if (a > b) {
+        float tmp = a;
+        a = b;
+        b = tmp;
+    }
+
+    begin = (int) ceilf(a - 0.5f);
+    end = (int) ceilf(b - 0.5f);
+    if (begin < 0)
+        begin = 0;
+    if (end > out_size)
+        end = out_size;
+
+    *out_begin = begin;
+    *out_end = end;
+    return begin < end;
+}
+
+// Determine the input samples for output pixel i along one axis. The output
+// range is [p1, p2] in the range [-1, +1], the input range is [t1, t2] in the
+// range [0, 1]. Either may be flipped.
+static void p1_video_cpu_map(P1VideoCPUSample *out, int i, int out_size,
+                             float p1, float p2, float t1, float t2, int in_size)
+{
+    double a = (p1 + 1) * 0.5 * out_size;
+    double b = (p2 + 1) * 0.5 * out_size;
+    double t = (i + 0.5 - a) / (b - a);
+
+    // Texel coordinate relative to texel centers, rounded to fixed point so
+    // that exact mappings don't suffer from precision errors.
+    long s = lround(((t1 + t * (t2 - t1)) * in_size - 0.5) * 256.0);
+    int i0 = (int) (s >> 8);
+    int i1 = i0 + 1;
+    int f = (int) (s & 0xff);
+
+    if (i0 < 0)
+        i0 = 0;
+    else if (i0 >= in_size)
+        i0 = in_size - 1;
+    if (i1 < 0)
+        i1 = 0;
+    else if (i1 >= in_size)
+        i1 = in_size - 1;
+    if (i0 == i1)
+        f = 0;
+
+    out->i0 = i0;
+    out->i1 = i1;
+    out->f = f;
+}
+
+// Vertical interpolation of two rows of bytes. The weight of the second row
+// is f, in the range (0, 256).
+static void p1_video_cpu_blend_rows(uint8_t *out, const uint8_t *a, const uint8_t *b, size_t len, int f)
+{
+    size_t i = 0;
+
+#if __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i wa = _mm_set1_epi16((short) (256 - f));
+    const __m128i wb = _mm_set1_epi16((short) f);
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i *) (a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *) (b + i));
+
+        __m128i lo = _mm_add_epi16(
+            _mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), wa),
+            _mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), wb));
+        __m128i hi = _mm_add_epi16(
+            _mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), wa),
+            _mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), wb));
+
+        lo = _mm_srli_epi16(lo, 8);
+        hi = _mm_srli_epi16(hi, 8);
+        _mm_storeu_si128((__m128i *) (out + i), _mm_packus_epi16(lo, hi));
+    }
+#elif __ARM_NEON
+    const uint8x8_t wa = vdup_n_u8((uint8_t) (256 - f));
+    const uint8x8_t wb = vdup_n_u8((uint8_t) f);
+
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t va = vld1q_u8(a + i);
+        uint8x16_t vb = vld1q_u8(b + i);
+
+        uint16x8_t lo = vmlal_u8(vmull_u8(vget_low_u8(va), wa), vget_low_u8(vb), wb);
+        uint16x8_t hi = vmlal_u8(vmull_u8(vget_high_u8(va), wa), vget_high_u8(vb), wb);
+
+        vst1q_u8(out + i, vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8)));
+    }
+#endif
+
+    for (; i < len; i++)
+        out[i] = (uint8_t) ((a[i] * (256 - f) + b[i] * f) >> 8);
+}
+
+// Horizontal interpolation into an output row. Works on two channels of a
+// pixel at once, which is safe because the weights add up to 256.
+static void p1_video_cpu_sample_row(uint32_t *out, const uint32_t *in, const P1VideoCPUSample *xmap, int n)
+{
+    int x;
+
+    for (x = 0; x < n; x++) {
+        const P1VideoCPUSample *s = &xmap[x];
+        uint32_t p0 = in[s->i0];
+        uint32_t p1 = in[s->i1];
+        uint32_t f1 = (uint32_t) s->f;
+        uint32_t f0 = 256 - f1;
+
+        uint32_t rb = (((p0 & 0x00ff00ff) * f0 + (p1 & 0x00ff00ff) * f1) >> 8) & 0x00ff00ff;
+        uint32_t ag = (((p0 >> 8) & 0x00ff00ff) * f0 + ((p1 >> 8) & 0x00ff00ff) * f1) & 0xff00ff00;
+
+        out[x] = rb | ag;
+    }
+}
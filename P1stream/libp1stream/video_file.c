@@ -0,0 +1,685 @@
+#include "p1stream_priv.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// The file is mapped whole, with sequential readahead, and never read through
+// a buffer. Raw BGRA frames are passed to the mixer by reference straight from
+// the mapping. Y4M frames are converted to BGRA first, using the inverse of
+// the BT.601 limited range conversion the mixer uses on the way out.
+//
+// The mapping is reference counted, because the mixer may hold on to a frame
+// after the source stops.
+//
+// Y4M conversion is the expensive part, so in realtime it runs on a thread of
+// its own, which hands frames to the mixer through the frame latch. Otherwise,
+// every frame must be shown, and conversion happens on the clock thread.
+
+typedef enum _P1FileChroma P1FileChroma;
+typedef struct _P1FileMapping P1FileMapping;
+typedef struct _P1FileVideoSource P1FileVideoSource;
+
+enum _P1FileChroma {
+    P1_CHROMA_NONE  = 0,    // Raw BGRA.
+    P1_CHROMA_420   = 1,
+    P1_CHROMA_444   = 2,
+    P1_CHROMA_MONO  = 3
+};
+
+// Longest Y4M header line we accept.
+static const size_t max_header_size = 1024;
+// Longest sleep of the conversion thread, so it notices a stop in time.
+static const int64_t max_sleep = 50000000;
+
+struct _P1FileMapping {
+    int refcount;
+    uint8_t *data;
+    size_t size;
+};
+
+struct _P1FileVideoSource {
+    P1VideoSource super;
+
+    char cfg_file[1024];
+    int cfg_width;
+    int cfg_height;
+    float cfg_rate;
+    bool cfg_realtime;
+
+    P1FileMapping *map;
+
+    // Format of the open file. The rate is frames per second, from the
+    // configuration or the Y4M header.
+    P1FileChroma chroma;
+    int width;
+    int height;
+    double rate;
+    size_t frame_size;
+    int num_frames;
+    size_t *offsets;
+
+    // Conversion buffer for Y4M frames converted on the clock thread.
+    uint8_t *bgra;
+
+    // Conversion thread, for Y4M frames in realtime.
+    bool threaded;
+    pthread_t thread;
+    bool thread_started;
+
+    int64_t start_time;
+    int index;
+};
+
+static bool p1_file_video_source_init(P1FileVideoSource *fvsrc, P1Context *ctx);
+static void p1_file_video_source_config(P1Plugin *pel, P1Config *cfg);
+static void p1_file_video_source_free(P1Plugin *pel);
+static void p1_file_video_source_start(P1Plugin *pel);
+static void p1_file_video_source_stop(P1Plugin *pel);
+static void p1_file_video_source_kill_session(P1FileVideoSource *fvsrc);
+static void p1_file_video_source_join(P1FileVideoSource *fvsrc);
+static bool p1_file_video_source_frame(P1VideoSource *vsrc);
+static int p1_file_video_source_position(P1FileVideoSource *fvsrc, double *rate);
+static void *p1_file_video_source_main(void *data);
+static bool p1_file_video_source_open(P1FileVideoSource *fvsrc);
+static bool p1_file_video_source_parse_y4m(P1FileVideoSource *fvsrc);
+static bool p1_file_y4m_value_is(const char *p, int len, const char *value);
+static bool p1_file_video_source_index(P1FileVideoSource *fvsrc, size_t pos, bool y4m);
+static void p1_file_video_source_convert(P1FileVideoSource *fvsrc, uint8_t *out, const uint8_t *in);
+static void p1_file_mapping_release(void *ref);
+
+
+P1VideoSource *p1_file_video_source_create(P1Context *ctx)
+{
+    P1FileVideoSource *fvsrc = calloc(1, sizeof(P1FileVideoSource));
+
+    if (fvsrc != NULL) {
+        if (!p1_file_video_source_init(fvsrc, ctx)) {
+            free(fvsrc);
+            fvsrc = NULL;
+        }
+    }
+
+    return (P1VideoSource *) fvsrc;
+}
+
+static bool p1_file_video_source_init(P1FileVideoSource *fvsrc, P1Context *ctx)
+{
+    P1VideoSource *vsrc = (P1VideoSource *) fvsrc;
+    P1Plugin *pel = (P1Plugin *) fvsrc;
+
+    if (!p1_video_source_init(vsrc, ctx))
+        return false;
+
+    pel->config = p1_file_video_source_config;
+    pel->free = p1_file_video_source_free;
+    pel->start = p1_file_video_source_start;
+    pel->stop = p1_file_video_source_stop;
+    vsrc->frame = p1_file_video_source_frame;
+
+    return true;
+}
+
+static void p1_file_video_source_config(P1Plugin *pel, P1Config *cfg)
+{
+    P1FileVideoSource *fvsrc = (P1FileVideoSource *) pel;
+    P1Object *obj = (P1Object *) pel;
+    char file[sizeof(fvsrc->cfg_file)];
+    int width, height;
+
+    if (!cfg->get_string(cfg, "file", file, sizeof(file))) {
+        p1_log(obj, P1_LOG_ERROR, "Missing video file");
+        p1_object_clear_flag(obj, P1_FLAG_CONFIG_VALID);
+        return;
+    }
+
+    // Raw files need dimensions, Y4M files have them in the header.
+    if (!cfg->get_int(cfg, "width", &width))
+        width = 0;
+    if (!cfg->get_int(cfg, "height", &height))
+        height = 0;
+    if (width < 0 || height < 0) {
+        p1_log(obj, P1_LOG_ERROR, "Invalid video file dimensions %dx%d", width, height);
+        p1_object_clear_flag(obj, P1_FLAG_CONFIG_VALID);
+        return;
+    }
+
+    if (strcmp(file, fvsrc->cfg_file) != 0 || width != fvsrc->cfg_width || height != fvsrc->cfg_height)
+        p1_object_set_flag(obj, P1_FLAG_NEEDS_RESTART);
+
+    strcpy(fvsrc->cfg_file, file);
+    fvsrc->cfg_width = width;
+    fvsrc->cfg_height = height;
+
+    // These apply immediately.
+    if (!cfg->get_float(cfg, "rate", &fvsrc->cfg_rate))
+        fvsrc->cfg_rate = 0;
+    if (!cfg->get_bool(cfg, "realtime", &fvsrc->cfg_realtime))
+        fvsrc->cfg_realtime = true;
+}
+
+static void p1_file_video_source_free(P1Plugin *pel)
+{
+    P1FileVideoSource *fvsrc = (P1FileVideoSource *) pel;
+
+    p1_file_video_source_join(fvsrc);
+    free(fvsrc);
+}
+
+static void p1_file_video_source_start(P1Plugin *pel)
+{
+    P1FileVideoSource *fvsrc = (P1FileVideoSource *) pel;
+    P1Object *obj = (P1Object *) pel;
+    int ret;
+
+    // Reap the thread of a previous run.
+    p1_file_video_source_join(fvsrc);
+
+    if (!p1_file_video_source_open(fvsrc))
+        goto fail;
+
+    fvsrc->start_time = p1_get_time();
+    fvsrc->index = -1;
+
+    // The thread runs as long as the source, even if realtime is turned off
+    // in the meantime. It then follows the clock thread pace instead.
+    fvsrc->threaded = (fvsrc->chroma != P1_CHROMA_NONE && fvsrc->cfg_realtime);
+    if (fvsrc->threaded) {
+        ret = pthread_create(&fvsrc->thread, NULL, p1_file_video_source_main, fvsrc);
+        if (ret != 0) {
+            p1_log(obj, P1_LOG_ERROR, "Failed to start conversion thread: %s", strerror(ret));
+            goto fail;
+        }
+        fvsrc->thread_started = true;
+    }
+    else if (fvsrc->chroma != P1_CHROMA_NONE) {
+        fvsrc->bgra = malloc((size_t) fvsrc->width * fvsrc->height * 4);
+        if (fvsrc->bgra == NULL) {
+            p1_log(obj, P1_LOG_ERROR, "Failed to allocate conversion buffer");
+            goto fail;
+        }
+    }
+
+    obj->state.current = P1_STATE_RUNNING;
+    p1_object_notify(obj);
+
+    return;
+
+fail:
+    p1_file_video_source_kill_session(fvsrc);
+
+    obj->state.current = P1_STATE_IDLE;
+    obj->state.flags |= P1_FLAG_ERROR;
+    p1_object_notify(obj);
+}
+
+static void p1_file_video_source_stop(P1Plugin *pel)
+{
+    P1FileVideoSource *fvsrc = (P1FileVideoSource *) pel;
+    P1Object *obj = (P1Object *) pel;
+
+    // The conversion thread cleans up and goes idle after its next wakeup.
+    if (fvsrc->threaded) {
+        obj->state.current = P1_STATE_STOPPING;
+        p1_object_notify(obj);
+        return;
+    }
+
+    p1_file_video_source_kill_session(fvsrc);
+
+    obj->state.current = P1_STATE_IDLE;
+    p1_object_notify(obj);
+}
+
+static void p1_file_video_source_join(P1FileVideoSource *fvsrc)
+{
+    P1Object *obj = (P1Object *) fvsrc;
+    int ret;
+
+    if (!fvsrc->thread_started)
+        return;
+
+    ret = pthread_join(fvsrc->thread, NULL);
+    if (ret != 0)
+        p1_log(obj, P1_LOG_ERROR, "Failed to stop conversion thread: %s", strerror(ret));
+
+    fvsrc->thread_started = false;
+}
+
+static void p1_file_video_source_kill_session(P1FileVideoSource *fvsrc)
+{
+    if (fvsrc->map != NULL) {
+        p1_file_mapping_release(fvsrc->map);
+        fvsrc->map = NULL;
+    }
+
+    free(fvsrc->offsets);
+    fvsrc->offsets = NULL;
+
+    free(fvsrc->bgra);
+    fvsrc->bgra = NULL;
+}
+
+static bool p1_file_video_source_frame(P1VideoSource *vsrc)
+{
+    P1FileVideoSource *fvsrc = (P1FileVideoSource *) vsrc;
+    P1FileMapping *map = fvsrc->map;
+    const uint8_t *data;
+    double rate;
+    int index;
+
+    if (fvsrc->threaded)
+        return p1_video_source_latch_frame(vsrc);
+
+    index = p1_file_video_source_position(fvsrc, &rate);
+    if (index == fvsrc->index && p1_video_source_frame_unchanged(vsrc))
+        return true;
+
+    fvsrc->index = index;
+    data = map->data + fvsrc->offsets[index];
+
+    if (fvsrc->chroma == P1_CHROMA_NONE) {
+        __atomic_add_fetch(&map->refcount, 1, __ATOMIC_RELAXED);
+        p1_video_source_frame_ref(vsrc, fvsrc->width, fvsrc->height, (size_t) fvsrc->width * 4,
+                                  data, p1_file_mapping_release, map);
+    }
+    else {
+        p1_file_video_source_convert(fvsrc, fvsrc->bgra, data);
+        p1_video_source_frame(vsrc, fvsrc->width, fvsrc->height, fvsrc->bgra);
+    }
+
+    return true;
+}
+
+// Get the index of the frame to show. In realtime, play at the file rate,
+// skipping or repeating frames to match the clock. Otherwise, take the next
+// frame every call, so no frame is lost and the pipeline runs as fast as its
+// clock. Also returns the rate in use, or zero if not realtime.
+static int p1_file_video_source_position(P1FileVideoSource *fvsrc, double *rate)
+{
+    P1ContextFull *ctxf = (P1ContextFull *) ((P1Object *) fvsrc)->ctx;
+    double elapsed;
+
+    *rate = fvsrc->cfg_rate > 0 ? fvsrc->cfg_rate : fvsrc->rate;
+    if (!fvsrc->cfg_realtime || *rate <= 0) {
+        *rate = 0;
+        return (fvsrc->index + 1) % fvsrc->num_frames;
+    }
+
+    elapsed = (double) (p1_get_time() - fvsrc->start_time) * ctxf->timebase_num / ctxf->timebase_den;
+    return (int) ((uint64_t) (elapsed * *rate / 1000000000.0) % fvsrc->num_frames);
+}
+
+// The main loop of the conversion thread. Converts each frame as it becomes
+// due, and sleeps until the next, or for a frame period when not realtime.
+static void *p1_file_video_source_main(void *data)
+{
+    P1FileVideoSource *fvsrc = (P1FileVideoSource *) data;
+    P1VideoSource *vsrc = (P1VideoSource *) data;
+    P1Object *obj = (P1Object *) data;
+    P1ContextFull *ctxf = (P1ContextFull *) obj->ctx;
+    P1VideoClock *vclock = obj->ctx->video->clock;
+    const uint8_t *in;
+    uint8_t *out;
+    struct timespec ts;
+    int64_t now, wait;
+    double elapsed, rate;
+    uint64_t produced, consumed, skipped;
+    uint64_t produced_end, consumed_end, skipped_end;
+    int index;
+
+    // The statistics count over the lifetime of the source, log this run.
+    p1_video_source_latch_stats(vsrc, &produced, &consumed, &skipped);
+
+    p1_object_lock(obj);
+
+    while (obj->state.current == P1_STATE_RUNNING) {
+        index = p1_file_video_source_position(fvsrc, &rate);
+
+        if (index != fvsrc->index) {
+            fvsrc->index = index;
+            in = fvsrc->map->data + fvsrc->offsets[index];
+
+            p1_object_unlock(obj);
+            out = p1_video_source_latch_acquire(vsrc, fvsrc->width, fvsrc->height);
+            if (out != NULL) {
+                p1_file_video_source_convert(fvsrc, out, in);
+                p1_video_source_latch_publish(vsrc);
+            }
+            p1_object_lock(obj);
+
+            if (out == NULL) {
+                obj->state.flags |= P1_FLAG_ERROR;
+                break;
+            }
+        }
+
+        // Time until the next frame is due, in nanoseconds.
+        now = p1_get_time();
+        if (rate > 0) {
+            elapsed = (double) (now - fvsrc->start_time) * ctxf->timebase_num / ctxf->timebase_den;
+            wait = (int64_t) ((floor(elapsed * rate / 1000000000.0) + 1) * 1000000000.0 / rate - elapsed);
+        }
+        else if (vclock != NULL && vclock->fps_num != 0) {
+            wait = (int64_t) vclock->fps_den * 1000000000 / vclock->fps_num;
+        }
+        else {
+            wait = max_sleep;
+        }
+        if (wait > max_sleep)
+            wait = max_sleep;
+
+        p1_object_unlock(obj);
+        ts.tv_sec = wait / 1000000000;
+        ts.tv_nsec = wait % 1000000000;
+        nanosleep(&ts, NULL);
+        p1_object_lock(obj);
+    }
+
+    p1_video_source_latch_stats(vsrc, &produced_end, &consumed_end, &skipped_end);
+    p1_log(obj, P1_LOG_INFO, "Converted %llu frames, of which %llu were shown and %llu replaced before being shown",
+           (unsigned long long) (produced_end - produced), (unsigned long long) (consumed_end - consumed),
+           (unsigned long long) (skipped_end - skipped));
+
+    p1_file_video_source_kill_session(fvsrc);
+    p1_video_source_latch_free(vsrc);
+    fvsrc->threaded = false;
+
+    obj->state.current = P1_STATE_IDLE;
+    p1_object_notify(obj);
+
+    p1_object_unlock(obj);
+
+    return NULL;
+}
+
+// Map the file, and find the frames in it.
+static bool p1_file_video_source_open(P1FileVideoSource *fvsrc)
+{
+    P1Object *obj = (P1Object *) fvsrc;
+    P1FileMapping *map;
+    struct stat st;
+    void *data;
+    int fd;
+
+    fd = open(fvsrc->cfg_file, O_RDONLY);
+    if (fd < 0) {
+        p1_log(obj, P1_LOG_ERROR, "Failed to open '%s': %s", fvsrc->cfg_file, strerror(errno));
+        goto fail;
+    }
+
+    if (fstat(fd, &st) != 0) {
+        p1_log(obj, P1_LOG_ERROR, "Failed to stat '%s': %s", fvsrc->cfg_file, strerror(errno));
+        goto fail_fd;
+    }
+
+    if (st.st_size == 0) {
+        p1_log(obj, P1_LOG_ERROR, "File '%s' is empty", fvsrc->cfg_file);
+        goto fail_fd;
+    }
+
+    data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        p1_log(obj, P1_LOG_ERROR, "Failed to map '%s': %s", fvsrc->cfg_file, strerror(errno));
+        goto fail_fd;
+    }
+
+    // The mapping keeps the file open.
+    close(fd);
+
+    if (madvise(data, (size_t) st.st_size, MADV_SEQUENTIAL) != 0)
+        p1_log(obj, P1_LOG_WARNING, "Failed to set readahead for '%s': %s", fvsrc->cfg_file, strerror(errno));
+
+    map = calloc(1, sizeof(P1FileMapping));
+    if (map == NULL) {
+        p1_log(obj, P1_LOG_ERROR, "Failed to allocate file mapping");
+        munmap(data, (size_t) st.st_size);
+        goto fail;
+    }
+
+    map->refcount = 1;
+    map->data = data;
+    map->size = (size_t) st.st_size;
+    fvsrc->map = map;
+
+    if (map->size > 10 && memcmp(map->data, "YUV4MPEG2 ", 10) == 0) {
+        if (!p1_file_video_source_parse_y4m(fvsrc))
+            goto fail;
+    }
+    else {
+        if (fvsrc->cfg_width == 0 || fvsrc->cfg_height == 0) {
+            p1_log(obj, P1_LOG_ERROR, "Raw video file '%s' needs width and height", fvsrc->cfg_file);
+            goto fail;
+        }
+
+        fvsrc->chroma = P1_CHROMA_NONE;
+        fvsrc->width = fvsrc->cfg_width;
+        fvsrc->height = fvsrc->cfg_height;
+        fvsrc->rate = 0;
+        fvsrc->frame_size = (size_t) fvsrc->width * fvsrc->height * 4;
+
+        if (!p1_file_video_source_index(fvsrc, 0, false))
+            goto fail;
+    }
+
+    p1_log(obj, P1_LOG_INFO, "Playing %d frames of %dx%d %s from '%s'",
+           fvsrc->num_frames, fvsrc->width, fvsrc->height,
+           fvsrc->chroma == P1_CHROMA_NONE ? "BGRA" : "Y4M", fvsrc->cfg_file);
+
+    return true;
+
+fail_fd:
+    close(fd);
+
+fail:
+    return false;
+}
+
+// Parse the stream header of a Y4M file, then index its frames.
+static bool p1_file_video_source_parse_y4m(P1FileVideoSource *fvsrc)
+{
+    P1Object *obj = (P1Object *) fvsrc;
+    P1FileMapping *map = fvsrc->map;
+    const char *p = (const char *) map->data;
+    const char *end;
+    size_t plane_size;
+    int rate_num = 0, rate_den = 0;
+    int len;
+
+    end = memchr(p, '\n', map->size < max_header_size ? map->size : max_header_size);
+    if (end == NULL) {
+        p1_log(obj, P1_LOG_ERROR, "Invalid Y4M header in '%s'", fvsrc->cfg_file);
+        return false;
+    }
+
+    fvsrc->width = 0;
+    fvsrc->height = 0;
+    fvsrc->chroma = P1_CHROMA_420;
+
+    // Parameters are a tag letter followed by a value, separated by spaces.
+    for (p += 9; p < end; p += len) {
+        while (p < end && *p == ' ')
+            p++;
+        for (len = 0; p + len < end && p[len] != ' '; len++);
+        if (len == 0)
+            break;
+
+        switch (p[0]) {
+            case 'W':
+                fvsrc->width = atoi(p + 1);
+                break;
+            case 'H':
+                fvsrc->height = atoi(p + 1);
+                break;
+            case 'F':
+                if (sscanf(p + 1, "%d:%d", &rate_num, &rate_den) != 2)
+                    rate_num = rate_den = 0;
+                break;
+            case 'C':
+                // The 4:2:0 variants differ only in chroma siting.
+                if (p1_file_y4m_value_is(p, len, "420") || p1_file_y4m_value_is(p, len, "420jpeg") ||
+                    p1_file_y4m_value_is(p, len, "420paldv") || p1_file_y4m_value_is(p, len, "420mpeg2"))
+                    fvsrc->chroma = P1_CHROMA_420;
+                else if (p1_file_y4m_value_is(p, len, "444"))
+                    fvsrc->chroma = P1_CHROMA_444;
+                else if (p1_file_y4m_value_is(p, len, "mono"))
+                    fvsrc->chroma = P1_CHROMA_MONO;
+                else {
+                    p1_log(obj, P1_LOG_ERROR, "Unsupported Y4M colorspace '%.*s'", len - 1, p + 1);
+                    return false;
+                }
+                break;
+            case 'I':
+                if (len != 2 || p[1] != 'p')
+                    p1_log(obj, P1_LOG_WARNING, "Interlaced Y4M input is treated as progressive");
+                break;
+        }
+    }
+
+    if (fvsrc->width <= 0 || fvsrc->height <= 0) {
+        p1_log(obj, P1_LOG_ERROR, "Missing Y4M dimensions in '%s'", fvsrc->cfg_file);
+        return false;
+    }
+
+    fvsrc->rate = (rate_num > 0 && rate_den > 0) ? (double) rate_num / rate_den : 0;
+
+    plane_size = (size_t) fvsrc->width * fvsrc->height;
+    switch (fvsrc->chroma) {
+        case P1_CHROMA_420:
+            fvsrc->frame_size = plane_size + 2 * ((size_t) ((fvsrc->width + 1) / 2) * ((fvsrc->height + 1) / 2));
+            break;
+        case P1_CHROMA_444:
+            fvsrc->frame_size = plane_size * 3;
+            break;
+        default:
+            fvsrc->frame_size = plane_size;
+            break;
+    }
+
+    return p1_file_video_source_index(fvsrc, (size_t) (end + 1 - (const char *) map->data), true);
+}
+
+// Check whether a Y4M parameter of the given length has exactly the value.
+static bool p1_file_y4m_value_is(const char *p, int len, const char *value)
+{
+    return (size_t) len == strlen(value) + 1 && memcmp(p + 1, value, len - 1) == 0;
+}
+
+// Find the offset of each frame, starting at the given position. Y4M frames
+// have a header line, raw frames are packed. A truncated last frame is
+// ignored.
+static bool p1_file_video_source_index(P1FileVideoSource *fvsrc, size_t pos, bool y4m)
+{
+    P1Object *obj = (P1Object *) fvsrc;
+    P1FileMapping *map = fvsrc->map;
+    size_t max_frames = (map->size - pos) / fvsrc->frame_size;
+    const uint8_t *end;
+    size_t remaining;
+    int num_frames = 0;
+
+    fvsrc->offsets = malloc((max_frames > 0 ? max_frames : 1) * sizeof(size_t));
+    if (fvsrc->offsets == NULL) {
+        p1_log(obj, P1_LOG_ERROR, "Failed to allocate frame index");
+        return false;
+    }
+
+    while ((size_t) num_frames < max_frames) {
+        if (y4m) {
+            remaining = map->size - pos;
+            if (remaining < 6 || memcmp(map->data + pos, "FRAME", 5) != 0)
+                break;
+            end = memchr(map->data + pos, '\n', remaining < max_header_size ? remaining : max_header_size);
+            if (end == NULL)
+                break;
+            pos = (size_t) (end + 1 - map->data);
+        }
+
+        if (map->size - pos < fvsrc->frame_size)
+            break;
+
+        fvsrc->offsets[num_frames++] = pos;
+        pos += fvsrc->frame_size;
+    }
+
+    if (num_frames == 0) {
+        p1_log(obj, P1_LOG_ERROR, "No complete frames in '%s'", fvsrc->cfg_file);
+        return false;
+    }
+
+    fvsrc->num_frames = num_frames;
+
+    return true;
+}
+
+// Convert a Y4M frame to BGRA, using BT.601 limited range.
+static void p1_file_video_source_convert(P1FileVideoSource *fvsrc, uint8_t *out, const uint8_t *in)
+{
+    int width = fvsrc->width;
+    int height = fvsrc->height;
+    const uint8_t *y_plane = in;
+    const uint8_t *u_plane, *v_plane;
+    const uint8_t *u_row, *v_row;
+    size_t chroma_stride;
+    int x, y, c, d, e, r, g, b;
+
+    if (fvsrc->chroma == P1_CHROMA_420)
+        chroma_stride = (size_t) (width + 1) / 2;
+    else
+        chroma_stride = (size_t) width;
+    u_plane = in + (size_t) width * height;
+    v_plane = u_plane + chroma_stride * (fvsrc->chroma == P1_CHROMA_420 ? (height + 1) / 2 : height);
+
+    for (y = 0; y < height; y++) {
+        if (fvsrc->chroma == P1_CHROMA_420) {
+            u_row = u_plane + chroma_stride * (y / 2);
+            v_row = v_plane + chroma_stride * (y / 2);
+        }
+        else {
+            u_row = u_plane + chroma_stride * y;
+            v_row = v_plane + chroma_stride * y;
+        }
+
+        for (x = 0; x < width; x++) {
+            c = 298 * (y_plane[(size_t) y * width + x] - 16);
+            if (fvsrc->chroma == P1_CHROMA_MONO) {
+                d = e = 0;
+            }
+            else if (fvsrc->chroma == P1_CHROMA_420) {
+                d = u_row[x / 2] - 128;
+                e = v_row[x / 2] - 128;
+            }
+            else {
+                d = u_row[x] - 128;
+                e = v_row[x] - 128;
+            }
+
+            r = (c + 409 * e + 128) >> 8;
+            g = (c - 100 * d - 208 * e + 128) >> 8;
+            b = (c + 516 * d + 128) >> 8;
+
+            out[0] = b < 0 ? 0 : b > 255 ? 255 : b;
+            out[1] = g < 0 ? 0 : g > 255 ? 255 : g;
+            out[2] = r < 0 ? 0 : r > 255 ? 255 : r;
+            out[3] = 255;
+            out += 4;
+        }
+    }
+}
+
+static void p1_file_mapping_release(void *ref)
+{
+    P1FileMapping *map = (P1FileMapping *) ref;
+
+    if (__atomic_sub_fetch(&map->refcount, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    munmap(map->data, map->size);
+    free(map);
+}
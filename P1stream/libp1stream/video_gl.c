@@ -0,0 +1,1002 @@
+#include "p1stream_priv.h"
+
+#if P1_HAVE_GL
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static bool p1_video_gl_start(P1VideoFull *videof);
+static void p1_video_gl_stop(P1VideoFull *videof);
+static bool p1_video_gl_link_source(P1VideoFull *videof, P1VideoSource *vsrc);
+static void p1_video_gl_unlink_source(P1VideoFull *videof, P1VideoSource *vsrc);
+static bool p1_video_gl_upload(P1VideoFull *videof, P1VideoSource *vsrc, int width, int height, size_t stride, const void *data);
+static bool p1_video_gl_begin(P1VideoFull *videof);
+static bool p1_video_gl_clear(P1VideoFull *videof);
+static bool p1_video_gl_draw(P1VideoFull *videof, P1VideoSource *vsrc);
+static bool p1_video_gl_end(P1VideoFull *videof);
+static bool p1_video_gl_convert(P1VideoFull *videof);
+static bool p1_video_gl_finish(P1VideoFull *videof);
+static void p1_video_gl_unmap(P1VideoFull *videof);
+static bool p1_video_gl_grow_quads(P1VideoFull *videof);
+static void p1_video_gl_free_quads(P1VideoFull *videof);
+static char *p1_video_gl_fragment_shader(int num_units);
+static bool p1_video_gl_is_software();
+#if P1_HAVE_CL
+static bool p1_video_gl_init_cl(P1VideoFull *videof);
+static void p1_video_gl_destroy_cl(P1VideoFull *videof);
+static void p1_video_gl_free_cl_outputs(P1VideoFull *videof, int num_slots);
+static bool p1_video_gl_wait_cl(P1VideoFull *videof, cl_event *event);
+#endif
+static GLuint p1_build_shader(P1Object *videoobj, GLuint type, const char *source);
+static bool p1_video_build_program(P1Object *videoobj, GLuint program, const char *vertexShader, const char *fragmentShader);
+
+const P1VideoBackend p1_video_gl_backend = {
+    .name           = "gl",
+    .partial        = false,
+    .start          = p1_video_gl_start,
+    .stop           = p1_video_gl_stop,
+    .link_source    = p1_video_gl_link_source,
+    .unlink_source  = p1_video_gl_unlink_source,
+    .upload         = p1_video_gl_upload,
+    .begin          = p1_video_gl_begin,
+    .clear          = p1_video_gl_clear,
+    .draw           = p1_video_gl_draw,
+    .end            = p1_video_gl_end,
+    .preview        = p1_video_preview,
+    .convert        = p1_video_gl_convert,
+    .finish         = p1_video_gl_finish
+};
+
+// Each vertex carries the texture unit to sample. GLSL 1.50 can't index
+// sampler arrays dynamically, so the fragment shader is generated with a
+// branch for each unit.
+static const char *simple_vertex_shader =
+    "#version 150\n"
+
+    "in vec2 a_Position;\n"
+    "in vec2 a_TexCoords;\n"
+    "in float a_Unit;\n"
+    "out vec2 v_TexCoords;\n"
+    "flat out int v_Unit;\n"
+
+    "void main(void) {\n"
+        "gl_Position = vec4(a_Position.x, a_Position.y, 0.0, 1.0);\n"
+        "v_TexCoords = a_TexCoords;\n"
+        "v_Unit = int(a_Unit);\n"
+    "}\n";
+
+static const char *simple_fragment_shader_head =
+    "#version 150\n"
+
+    "uniform sampler2DRect u_Textures[%d];\n"
+    "in vec2 v_TexCoords;\n"
+    "flat in int v_Unit;\n"
+    "out vec4 o_FragColor;\n"
+
+    "void main(void) {\n";
+
+static const char *simple_fragment_shader_unit =
+        "if (v_Unit == %1$d) o_FragColor = texture(u_Textures[%1$d], v_TexCoords * textureSize(u_Textures[%1$d]));\n";
+
+static const char *simple_fragment_shader_tail =
+    "}\n";
+
+#if P1_HAVE_CL
+static const char *yuv_kernel_source =
+    "const sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_LINEAR;\n"
+
+    "kernel void yuv(read_only image2d_t input, global write_only uchar* output)\n"
+    "{\n"
+        "size_t wUV = get_global_size(0);\n"
+        "size_t hUV = get_global_size(1);\n"
+        "size_t xUV = get_global_id(0);\n"
+        "size_t yUV = get_global_id(1);\n"
+
+        "size_t wY = wUV * 2;\n"
+        "size_t hY = hUV * 2;\n"
+        "size_t xY = xUV * 2;\n"
+        "size_t yY = yUV * 2;\n"
+
+        "float2 xyImg = (float2)(xY, yY);\n"
+        "size_t lenY = wY * hY;\n"
+
+        "float4 s;\n"
+        "size_t base;\n"
+        "float value;\n"
+
+        // Write 2x2 block of Y values.
+        "base = yY * wY + xY;\n"
+        "for (size_t dx = 0; dx < 2; dx++) {\n"
+            "for (size_t dy = 0; dy < 2; dy++) {\n"
+                "s = read_imagef(input, sampler, xyImg + (float2)(dx, dy) + 0.5f);\n"
+                "value = 16 + 65.481f*s.r + 128.553f*s.g + 24.966f*s.b;\n"
+                "output[base + dy * wY + dx] = value;\n"
+            "}\n"
+        "}\n"
+
+        // Write interleaved UV values.
+        "s = read_imagef(input, sampler, xyImg + 1.0f);\n"
+        "base = lenY + yUV * wY + xY;\n"
+        "value = 128 - 37.797f*s.r - 74.203f*s.g + 112.0f*s.b;\n"
+        "output[base] = value;\n"
+        "value = 128 + 112.0f*s.r - 93.786f*s.g - 18.214f*s.b;\n"
+        "output[base + 1] = value;\n"
+    "}\n";
+#endif
+
+// Vertex layout: position, texture coordinates and texture unit. Each quad is
+// a triangle strip of 4 vertices.
+#define P1_VBO_VERTEX_FLOATS 5
+#define P1_VBO_QUAD_FLOATS (4 * P1_VBO_VERTEX_FLOATS)
+static const int vbo_quad_floats = P1_VBO_QUAD_FLOATS;
+static const GLsizei vbo_stride = P1_VBO_VERTEX_FLOATS * sizeof(GLfloat);
+static const GLsizeiptr vbo_quad_size = P1_VBO_QUAD_FLOATS * sizeof(GLfloat);
+static const void *vbo_tex_coord_offset = (void *)(2 * sizeof(GLfloat));
+static const void *vbo_unit_offset = (void *)(4 * sizeof(GLfloat));
+
+// Upper limit of texture units used in a single draw call. Software
+// rasterizers evaluate every branch of the fragment shader, so there we stick
+// to a single unit and only save on buffer updates.
+static const int max_batch_units = 16;
+static const char *software_renderers[] = { "llvmpipe", "softpipe", "Software Rasterizer", NULL };
+
+
+static bool p1_video_gl_start(P1VideoFull *videof)
+{
+    P1Video *video = (P1Video *) videof;
+    P1Object *videoobj = (P1Object *) videof;
+    GLenum gl_err;
+    GLint max_units;
+    GLint units[max_batch_units];
+    char *fragment_shader;
+    bool b_ret;
+    int i;
+
+    b_ret = p1_video_init_platform(videof);
+    if (!b_ret)
+        goto fail;
+
+    glGetIntegerv(GL_MAX_TEXTURE_IMAGE_UNITS, &max_units);
+    if (max_units > max_batch_units)
+        max_units = max_batch_units;
+    if (max_units < 1 || p1_video_gl_is_software())
+        max_units = 1;
+    videof->gl_max_units = max_units;
+    videof->gl_num_quads = 0;
+    videof->gl_vbo_quads = 0;
+    videof->gl_max_quads = 0;
+    videof->gl_vbo_max_quads = 0;
+
+    glGenVertexArrays(1, &videof->vao);
+    glGenBuffers(1, &videof->vbo);
+    videof->program = glCreateProgram();
+    if ((gl_err = glGetError()) != GL_NO_ERROR) {
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to create GL objects: OpenGL error %d", gl_err);
+        goto fail_platform;
+    }
+
+    glBindAttribLocation(videof->program, 0, "a_Position");
+    glBindAttribLocation(videof->program, 1, "a_TexCoords");
+    glBindAttribLocation(videof->program, 2, "a_Unit");
+    glBindFragDataLocation(videof->program, 0, "o_FragColor");
+    fragment_shader = p1_video_gl_fragment_shader(videof->gl_max_units);
+    if (fragment_shader == NULL) {
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to allocate shader source");
+        goto fail_platform;
+    }
+    b_ret = p1_video_build_program(videoobj, videof->program, simple_vertex_shader, fragment_shader);
+    free(fragment_shader);
+    if (!b_ret)
+        goto fail_platform;
+    videof->textures_u = glGetUniformLocation(videof->program, "u_Textures");
+
+    if (videof->cpu_convert) {
+        // Frames are read back into a pixel buffer for each output slot
+        // asynchronously, and mapped once needed.
+        videof->pbo_mapped = -1;
+        videof->pbo_data = NULL;
+        glGenBuffers(videof->latency + 1, videof->pbos);
+        for (i = 0; i <= videof->latency; i++) {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, videof->pbos[i]);
+            glBufferData(GL_PIXEL_PACK_BUFFER, (GLsizeiptr) video->width * video->height * 4, NULL, GL_STREAM_READ);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        if ((gl_err = glGetError()) != GL_NO_ERROR) {
+            p1_log(videoobj, P1_LOG_ERROR, "Failed to create readback buffer: OpenGL error %d", gl_err);
+            goto fail_platform;
+        }
+
+        p1_log(videoobj, P1_LOG_INFO, "Using %s colorspace conversion", p1_video_bgra_to_yuv_isa());
+    }
+#if P1_HAVE_CL
+    else {
+        b_ret = p1_video_gl_init_cl(videof);
+        if (!b_ret)
+            goto fail_platform;
+    }
+#endif
+
+    // GL state init. Most of this is up here because we can.
+    glViewport(0, 0, video->width, video->height);
+    glClearColor(0, 0, 0, 1);
+    glActiveTexture(GL_TEXTURE0);
+    glBindBuffer(GL_ARRAY_BUFFER, videof->vbo);
+    glUseProgram(videof->program);
+    for (i = 0; i < videof->gl_max_units; i++)
+        units[i] = i;
+    glUniform1iv(videof->textures_u, videof->gl_max_units, units);
+    glBindVertexArray(videof->vao);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, vbo_stride, 0);
+    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, vbo_stride, vbo_tex_coord_offset);
+    glVertexAttribPointer(2, 1, GL_FLOAT, GL_FALSE, vbo_stride, vbo_unit_offset);
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+    glEnableVertexAttribArray(2);
+    if ((gl_err = glGetError()) != GL_NO_ERROR) {
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to initialize GL state: OpenGL error %d", gl_err);
+        goto fail_convert;
+    }
+
+    return true;
+
+fail_convert:
+    if (videof->cpu_convert)
+        glDeleteBuffers(videof->latency + 1, videof->pbos);
+#if P1_HAVE_CL
+    else
+        p1_video_gl_destroy_cl(videof);
+#endif
+
+fail_platform:
+    p1_video_destroy_platform(videof);
+
+fail:
+    return false;
+}
+
+static void p1_video_gl_stop(P1VideoFull *videof)
+{
+    P1Video *video = (P1Video *) videof;
+    P1ListNode *head;
+    P1ListNode *node;
+
+    // We don't have to delete textures, they go away with the context. But do
+    // clear the texture names of sources.
+    head = &video->sources;
+    p1_list_iterate(head, node) {
+        P1Source *src = p1_list_get_container(node, P1Source, link);
+        P1VideoSource *vsrc = (P1VideoSource *) src;
+        P1VideoSourcePriv *priv = vsrc->priv;
+
+        priv->texture = 0;
+        priv->texture_width = priv->texture_height = 0;
+        memset(priv->upload_pbos, 0, sizeof(priv->upload_pbos));
+        memset(priv->upload_sizes, 0, sizeof(priv->upload_sizes));
+    }
+
+    p1_video_gl_free_quads(videof);
+
+    if (videof->cpu_convert) {
+        p1_video_gl_unmap(videof);
+        glDeleteBuffers(videof->latency + 1, videof->pbos);
+    }
+#if P1_HAVE_CL
+    else {
+        p1_video_gl_destroy_cl(videof);
+    }
+#endif
+
+    p1_video_destroy_platform(videof);
+}
+
+#if P1_HAVE_CL
+
+// Setup the OpenCL objects used for colorspace conversion.
+static bool p1_video_gl_init_cl(P1VideoFull *videof)
+{
+    P1Video *video = (P1Video *) videof;
+    P1Object *videoobj = (P1Object *) videof;
+    cl_int cl_err;
+    size_t size;
+    int i;
+
+    videof->out_size = video->width * video->height * 1.5;
+    videof->yuv_work_size[0] = video->width / 2;
+    videof->yuv_work_size[1] = video->height / 2;
+
+    cl_device_id device_id;
+    cl_err = clGetContextInfo(videof->cl, CL_CONTEXT_DEVICES, sizeof(cl_device_id), &device_id, &size);
+    if (cl_err != CL_SUCCESS || size == 0) {
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to get CL device info: OpenCL error %d", cl_err);
+        goto fail;
+    }
+
+    videof->clq = clCreateCommandQueue(videof->cl, device_id, 0, &cl_err);
+    if (cl_err != CL_SUCCESS) {
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to create CL command queue: OpenCL error %d", cl_err);
+        goto fail;
+    }
+
+    videof->tex_mem = clCreateFromGLTexture(videof->cl, CL_MEM_READ_ONLY, GL_TEXTURE_RECTANGLE, 0, videof->tex, &cl_err);
+    if (cl_err != CL_SUCCESS) {
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to create CL input buffer: OpenCL error %d", cl_err);
+        goto fail_clq;
+    }
+
+    // Each output slot has a buffer for the kernel to write to, in memory the
+    // host can map without copying. The slot picture describes the NV12
+    // planes within it, and is pointed at the mapping once there is one.
+    videof->tex_event = NULL;
+    for (i = 0; i <= videof->latency; i++) {
+        videof->out_events[i] = NULL;
+        videof->out_maps[i] = NULL;
+
+        videof->out_mems[i] = clCreateBuffer(videof->cl, CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR,
+                                             videof->out_size, NULL, &cl_err);
+        if (cl_err != CL_SUCCESS) {
+            p1_log(videoobj, P1_LOG_ERROR, "Failed to create CL output buffer: OpenCL error %d", cl_err);
+            goto fail_out_mem;
+        }
+
+        x264_picture_init(&videof->out_pics[i]);
+        videof->out_pics[i].img.i_csp = X264_CSP_NV12;
+        videof->out_pics[i].img.i_plane = 2;
+        videof->out_pics[i].img.i_stride[0] = video->width;
+        videof->out_pics[i].img.i_stride[1] = video->width;
+    }
+
+    cl_program yuv_program = clCreateProgramWithSource(videof->cl, 1, &yuv_kernel_source, NULL, &cl_err);
+    if (cl_err != CL_SUCCESS) {
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to create CL program: OpenCL error %d", cl_err);
+        goto fail_out_mem;
+    }
+    cl_err = clBuildProgram(yuv_program, 0, NULL, NULL, NULL, NULL);
+    if (cl_err != CL_SUCCESS) {
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to build CL program: OpenCL error %d", cl_err);
+        clReleaseProgram(yuv_program);
+        goto fail_out_mem;
+    }
+    videof->yuv_kernel = clCreateKernel(yuv_program, "yuv", &cl_err);
+    clReleaseProgram(yuv_program);
+    if (cl_err != CL_SUCCESS) {
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to create CL kernel: OpenCL error %d", cl_err);
+        goto fail_out_mem;
+    }
+
+    cl_err = clSetKernelArg(videof->yuv_kernel, 0, sizeof(cl_mem), &videof->tex_mem);
+    if (cl_err != CL_SUCCESS) {
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to set CL kernel arg: OpenCL error %d", cl_err);
+        goto fail_yuv_kernel;
+    }
+
+    return true;
+
+fail_yuv_kernel:
+    cl_err = clReleaseKernel(videof->yuv_kernel);
+    if (cl_err != CL_SUCCESS)
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to release CL kernel: OpenCL error %d", cl_err);
+
+fail_out_mem:
+    p1_video_gl_free_cl_outputs(videof, i);
+
+    cl_err = clReleaseMemObject(videof->tex_mem);
+    if (cl_err != CL_SUCCESS)
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to release CL input buffer: OpenCL error %d", cl_err);
+
+fail_clq:
+    cl_err = clReleaseCommandQueue(videof->clq);
+    if (cl_err != CL_SUCCESS)
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to release CL command queue: OpenCL error %d", cl_err);
+
+fail:
+    return false;
+}
+
+static void p1_video_gl_destroy_cl(P1VideoFull *videof)
+{
+    P1Object *videoobj = (P1Object *) videof;
+    cl_int cl_err;
+
+    // Let readbacks in flight complete, before freeing their pictures.
+    cl_err = clFinish(videof->clq);
+    if (cl_err != CL_SUCCESS)
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to finish CL command queue: OpenCL error %d", cl_err);
+
+    if (videof->tex_event != NULL) {
+        clReleaseEvent(videof->tex_event);
+        videof->tex_event = NULL;
+    }
+
+    cl_err = clReleaseKernel(videof->yuv_kernel);
+    if (cl_err != CL_SUCCESS)
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to release CL kernel: OpenCL error %d", cl_err);
+
+    p1_video_gl_free_cl_outputs(videof, videof->latency + 1);
+
+    cl_err = clReleaseMemObject(videof->tex_mem);
+    if (cl_err != CL_SUCCESS)
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to release CL input buffer: OpenCL error %d", cl_err);
+
+    cl_err = clReleaseCommandQueue(videof->clq);
+    if (cl_err != CL_SUCCESS)
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to release CL command queue: OpenCL error %d", cl_err);
+}
+
+// Release the buffers, mappings and events of the first output slots. The
+// command queue must be idle.
+static void p1_video_gl_free_cl_outputs(P1VideoFull *videof, int num_slots)
+{
+    P1Object *videoobj = (P1Object *) videof;
+    cl_int cl_err;
+    int i;
+
+    for (i = 0; i < num_slots; i++) {
+        if (videof->out_events[i] != NULL) {
+            clReleaseEvent(videof->out_events[i]);
+            videof->out_events[i] = NULL;
+        }
+
+        if (videof->out_maps[i] != NULL) {
+            cl_err = clEnqueueUnmapMemObject(videof->clq, videof->out_mems[i], videof->out_maps[i], 0, NULL, NULL);
+            if (cl_err == CL_SUCCESS)
+                cl_err = clFinish(videof->clq);
+            if (cl_err != CL_SUCCESS)
+                p1_log(videoobj, P1_LOG_ERROR, "Failed to unmap CL output buffer: OpenCL error %d", cl_err);
+            videof->out_maps[i] = NULL;
+        }
+
+        cl_err = clReleaseMemObject(videof->out_mems[i]);
+        if (cl_err != CL_SUCCESS)
+            p1_log(videoobj, P1_LOG_ERROR, "Failed to release CL output buffer: OpenCL error %d", cl_err);
+    }
+}
+
+// Wait for an event, if set, and release it.
+static bool p1_video_gl_wait_cl(P1VideoFull *videof, cl_event *event)
+{
+    P1Object *videoobj = (P1Object *) videof;
+    cl_int cl_err;
+
+    if (*event == NULL)
+        return true;
+
+    cl_err = clWaitForEvents(1, event);
+    clReleaseEvent(*event);
+    *event = NULL;
+    if (cl_err != CL_SUCCESS) {
+        p1_log(videoobj, P1_LOG_ERROR, "Failure during colorspace conversion: OpenCL error %d", cl_err);
+        return false;
+    }
+
+    return true;
+}
+
+#endif
+
+static bool p1_video_gl_link_source(P1VideoFull *videof, P1VideoSource *vsrc)
+{
+    P1Object *videoobj = (P1Object *) videof;
+    P1VideoSourcePriv *priv = vsrc->priv;
+    GLenum err;
+
+    if (!p1_video_activate_gl(videof))
+        return false;
+
+    glGenTextures(1, &priv->texture);
+    glGenBuffers(P1_VIDEO_UPLOAD_BUFFERS, priv->upload_pbos);
+    err = glGetError();
+    if (err != GL_NO_ERROR) {
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to create texture: OpenGL error %d", err);
+        glDeleteTextures(1, &priv->texture);
+        glDeleteBuffers(P1_VIDEO_UPLOAD_BUFFERS, priv->upload_pbos);
+        priv->texture = 0;
+        memset(priv->upload_pbos, 0, sizeof(priv->upload_pbos));
+        return false;
+    }
+
+    // Storage is allocated on the first upload.
+    priv->texture_width = priv->texture_height = 0;
+    memset(priv->upload_sizes, 0, sizeof(priv->upload_sizes));
+    priv->upload_index = 0;
+
+    return true;
+}
+
+static void p1_video_gl_unlink_source(P1VideoFull *videof, P1VideoSource *vsrc)
+{
+    P1Object *videoobj = (P1Object *) videof;
+    P1VideoSourcePriv *priv = vsrc->priv;
+    GLenum err;
+
+    if (!p1_video_activate_gl(videof))
+        return;
+
+    glDeleteTextures(1, &priv->texture);
+    glDeleteBuffers(P1_VIDEO_UPLOAD_BUFFERS, priv->upload_pbos);
+    priv->texture = 0;
+    priv->texture_width = priv->texture_height = 0;
+    memset(priv->upload_pbos, 0, sizeof(priv->upload_pbos));
+    memset(priv->upload_sizes, 0, sizeof(priv->upload_sizes));
+    err = glGetError();
+    if (err != GL_NO_ERROR)
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to delete texture: OpenGL error %d", err);
+}
+
+// Frames are copied into the next pixel buffer of the ring, from which the
+// texture is updated asynchronously. Texture storage is only reallocated when
+// the frame size changes.
+static bool p1_video_gl_upload(P1VideoFull *videof, P1VideoSource *vsrc, int width, int height, size_t stride, const void *data)
+{
+    P1Object *videoobj = (P1Object *) videof;
+    P1VideoSourcePriv *priv = vsrc->priv;
+    size_t row_size = (size_t) width * 4;
+    size_t size = row_size * height;
+    int index = priv->upload_index;
+    const uint8_t *src;
+    uint8_t *dst;
+    GLenum gl_err;
+    int y;
+
+    glBindTexture(GL_TEXTURE_RECTANGLE, priv->texture);
+    if (priv->texture_width != width || priv->texture_height != height) {
+        glTexImage2D(GL_TEXTURE_RECTANGLE, 0, GL_RGBA8, width, height, 0,
+                     GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, NULL);
+        priv->texture_width = width;
+        priv->texture_height = height;
+    }
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, priv->upload_pbos[index]);
+    if (priv->upload_sizes[index] != size) {
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, (GLsizeiptr) size, NULL, GL_STREAM_DRAW);
+        priv->upload_sizes[index] = size;
+    }
+
+    // Invalidating lets the driver hand us fresh memory if the buffer is
+    // still in use by an earlier upload.
+    dst = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, (GLsizeiptr) size,
+                           GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    if (dst == NULL) {
+        gl_err = glGetError();
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to map upload buffer: OpenGL error %d", gl_err);
+        return false;
+    }
+
+    if (stride == row_size) {
+        memcpy(dst, data, size);
+    }
+    else {
+        src = data;
+        for (y = 0; y < height; y++)
+            memcpy(dst + y * row_size, src + y * stride, row_size);
+    }
+
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    glTexSubImage2D(GL_TEXTURE_RECTANGLE, 0, 0, 0, width, height,
+                    GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, NULL);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    if ((gl_err = glGetError()) != GL_NO_ERROR) {
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to upload frame: OpenGL error %d", gl_err);
+        priv->texture_width = priv->texture_height = 0;
+        return false;
+    }
+
+    priv->upload_index = (index + 1) % P1_VIDEO_UPLOAD_BUFFERS;
+
+    return true;
+}
+
+static bool p1_video_gl_begin(P1VideoFull *videof)
+{
+    return p1_video_activate_gl(videof);
+}
+
+static bool p1_video_gl_clear(P1VideoFull *videof)
+{
+    // Release the previous readback before rendering over it. OpenCL must be
+    // done reading the previous frame.
+    if (videof->cpu_convert)
+        p1_video_gl_unmap(videof);
+#if P1_HAVE_CL
+    else if (!p1_video_gl_wait_cl(videof, &videof->tex_event))
+        return false;
+#endif
+
+    glClear(GL_COLOR_BUFFER_BIT);
+
+    videof->gl_num_quads = 0;
+
+    return true;
+}
+
+// Drawing is deferred until the end of the frame, so that quads can be
+// batched into few draw calls.
+static bool p1_video_gl_draw(P1VideoFull *videof, P1VideoSource *vsrc)
+{
+    GLfloat *v;
+    GLfloat unit;
+
+    if (videof->gl_num_quads == videof->gl_max_quads) {
+        if (!p1_video_gl_grow_quads(videof))
+            return false;
+    }
+
+    v = videof->gl_verts + (size_t) videof->gl_num_quads * vbo_quad_floats;
+    unit = videof->gl_num_quads % videof->gl_max_units;
+    memcpy(v, (GLfloat []) {
+        vsrc->x1, vsrc->y1, vsrc->u1, vsrc->v1, unit,
+        vsrc->x1, vsrc->y2, vsrc->u1, vsrc->v2, unit,
+        vsrc->x2, vsrc->y1, vsrc->u2, vsrc->v1, unit,
+        vsrc->x2, vsrc->y2, vsrc->u2, vsrc->v2, unit
+    }, vbo_quad_size);
+    videof->gl_textures[videof->gl_num_quads] = vsrc->priv->texture;
+    videof->gl_num_quads++;
+
+    return true;
+}
+
+static bool p1_video_gl_end(P1VideoFull *videof)
+{
+    P1Video *video = (P1Video *) videof;
+    P1Object *videoobj = (P1Object *) videof;
+    size_t size = (size_t) videof->gl_num_quads * vbo_quad_size;
+    int first, count, i;
+    GLenum gl_err;
+
+    // Only rewrite the vertex buffer if the layout changed.
+    if (videof->gl_num_quads != videof->gl_vbo_quads ||
+        memcmp(videof->gl_verts, videof->gl_vbo_verts, size) != 0) {
+        if (videof->gl_vbo_max_quads != videof->gl_max_quads) {
+            glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr) videof->gl_max_quads * vbo_quad_size,
+                         NULL, GL_DYNAMIC_DRAW);
+            videof->gl_vbo_max_quads = videof->gl_max_quads;
+        }
+        glBufferSubData(GL_ARRAY_BUFFER, 0, (GLsizeiptr) size, videof->gl_verts);
+        memcpy(videof->gl_vbo_verts, videof->gl_verts, size);
+        videof->gl_vbo_quads = videof->gl_num_quads;
+    }
+
+    // Draw a batch of quads for each set of texture units. Quads are
+    // rasterized in order, so overlapping sources stack the same.
+    for (first = 0; first < videof->gl_num_quads; first += count) {
+        count = videof->gl_num_quads - first;
+        if (count > videof->gl_max_units)
+            count = videof->gl_max_units;
+
+        for (i = 0; i < count; i++) {
+            glActiveTexture(GL_TEXTURE0 + i);
+            glBindTexture(GL_TEXTURE_RECTANGLE, videof->gl_textures[first + i]);
+        }
+        glMultiDrawArrays(GL_TRIANGLE_STRIP, videof->gl_firsts + first, videof->gl_counts + first, count);
+    }
+    glActiveTexture(GL_TEXTURE0);
+
+    // Start the readback for CPU conversion, into the buffer of the output
+    // slot. Mapping the buffer waits for it. OpenCL instead needs rendering to
+    // be complete.
+    if (videof->cpu_convert) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, videof->pbos[videof->out_write]);
+        glReadPixels(0, 0, video->width, video->height,
+                     GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, NULL);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+    else {
+        glFinish();
+    }
+
+    if ((gl_err = glGetError()) != GL_NO_ERROR) {
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to render frame: OpenGL error %d", gl_err);
+        return false;
+    }
+
+    return true;
+}
+
+const uint8_t *p1_video_gl_readback(P1VideoFull *videof, int slot)
+{
+    P1Video *video = (P1Video *) videof;
+    P1Object *videoobj = (P1Object *) videof;
+    GLenum gl_err;
+
+    if (videof->pbo_mapped == slot)
+        return videof->pbo_data;
+    p1_video_gl_unmap(videof);
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, videof->pbos[slot]);
+    videof->pbo_data = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, (GLsizeiptr) video->width * video->height * 4,
+                                        GL_MAP_READ_BIT);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    if ((gl_err = glGetError()) != GL_NO_ERROR || videof->pbo_data == NULL) {
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to read back frame: OpenGL error %d", gl_err);
+        videof->pbo_data = NULL;
+        return NULL;
+    }
+
+    videof->pbo_mapped = slot;
+    return videof->pbo_data;
+}
+
+static void p1_video_gl_unmap(P1VideoFull *videof)
+{
+    if (videof->pbo_mapped < 0)
+        return;
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, videof->pbos[videof->pbo_mapped]);
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    videof->pbo_mapped = -1;
+    videof->pbo_data = NULL;
+}
+
+// Grow the quad list and the vertex storage.
+static bool p1_video_gl_grow_quads(P1VideoFull *videof)
+{
+    P1Object *videoobj = (P1Object *) videof;
+    int max_quads = videof->gl_max_quads ? videof->gl_max_quads * 2 : 8;
+    size_t verts_size = (size_t) max_quads * vbo_quad_size;
+    GLfloat *verts;
+    GLuint *textures;
+    GLint *firsts;
+    GLsizei *counts;
+    int i;
+
+    verts = realloc(videof->gl_verts, verts_size);
+    if (verts == NULL)
+        goto fail;
+    videof->gl_verts = verts;
+
+    verts = realloc(videof->gl_vbo_verts, verts_size);
+    if (verts == NULL)
+        goto fail;
+    videof->gl_vbo_verts = verts;
+
+    textures = realloc(videof->gl_textures, max_quads * sizeof(GLuint));
+    if (textures == NULL)
+        goto fail;
+    videof->gl_textures = textures;
+
+    firsts = realloc(videof->gl_firsts, max_quads * sizeof(GLint));
+    if (firsts == NULL)
+        goto fail;
+    videof->gl_firsts = firsts;
+
+    counts = realloc(videof->gl_counts, max_quads * sizeof(GLsizei));
+    if (counts == NULL)
+        goto fail;
+    videof->gl_counts = counts;
+
+    for (i = videof->gl_max_quads; i < max_quads; i++) {
+        firsts[i] = i * 4;
+        counts[i] = 4;
+    }
+
+    videof->gl_max_quads = max_quads;
+    return true;
+
+fail:
+    p1_log(videoobj, P1_LOG_ERROR, "Failed to allocate draw list");
+    return false;
+}
+
+static void p1_video_gl_free_quads(P1VideoFull *videof)
+{
+    free(videof->gl_verts);
+    free(videof->gl_vbo_verts);
+    free(videof->gl_textures);
+    free(videof->gl_firsts);
+    free(videof->gl_counts);
+    videof->gl_verts = videof->gl_vbo_verts = NULL;
+    videof->gl_textures = NULL;
+    videof->gl_firsts = NULL;
+    videof->gl_counts = NULL;
+    videof->gl_num_quads = videof->gl_vbo_quads = 0;
+    videof->gl_max_quads = videof->gl_vbo_max_quads = 0;
+}
+
+// Start conversion of the frame in output slot out_write. Readback for CPU
+// conversion was already started when rendering ended.
+static bool p1_video_gl_convert(P1VideoFull *videof)
+{
+    if (videof->cpu_convert)
+        return true;
+
+#if P1_HAVE_CL
+    P1Video *video = (P1Video *) videof;
+    P1Object *videoobj = (P1Object *) videof;
+    int slot = videof->out_write;
+    uint8_t *map;
+    cl_int cl_err;
+
+    // The previous mapping of this slot has been streamed, and the connection
+    // is done with it.
+    if (videof->out_maps[slot] != NULL) {
+        if (videof->stream_pic == &videof->out_pics[slot])
+            videof->stream_pic = &videof->out_pic;
+        cl_err = clEnqueueUnmapMemObject(videof->clq, videof->out_mems[slot], videof->out_maps[slot], 0, NULL, NULL);
+        videof->out_maps[slot] = NULL;
+        if (cl_err != CL_SUCCESS) goto fail;
+    }
+
+    cl_err = clSetKernelArg(videof->yuv_kernel, 1, sizeof(cl_mem), &videof->out_mems[slot]);
+    if (cl_err != CL_SUCCESS) goto fail;
+    cl_err = clEnqueueAcquireGLObjects(videof->clq, 1, &videof->tex_mem, 0, NULL, NULL);
+    if (cl_err != CL_SUCCESS) goto fail;
+    cl_err = clEnqueueNDRangeKernel(videof->clq, videof->yuv_kernel, 2, NULL, videof->yuv_work_size, NULL, 0, NULL, NULL);
+    if (cl_err != CL_SUCCESS) goto fail;
+    cl_err = clEnqueueReleaseGLObjects(videof->clq, 1, &videof->tex_mem, 0, NULL, &videof->tex_event);
+    if (cl_err != CL_SUCCESS) goto fail;
+    map = clEnqueueMapBuffer(videof->clq, videof->out_mems[slot], CL_FALSE, CL_MAP_READ, 0, videof->out_size,
+                             0, NULL, &videof->out_events[slot], &cl_err);
+    if (cl_err != CL_SUCCESS) goto fail;
+    videof->out_maps[slot] = map;
+    videof->out_pics[slot].img.plane[0] = map;
+    videof->out_pics[slot].img.plane[1] = map + (size_t) video->width * video->height;
+    cl_err = clFlush(videof->clq);
+    if (cl_err != CL_SUCCESS) goto fail;
+
+    return true;
+
+fail:
+    p1_log(videoobj, P1_LOG_ERROR, "Failure during colorspace conversion: OpenCL error %d", cl_err);
+#endif
+    return false;
+}
+
+// Complete conversion of the frame in output slot out_read.
+static bool p1_video_gl_finish(P1VideoFull *videof)
+{
+    P1Video *video = (P1Video *) videof;
+    int slot = videof->out_read;
+    const uint8_t *data;
+
+    if (videof->cpu_convert) {
+        data = p1_video_gl_readback(videof, slot);
+        if (data == NULL)
+            return false;
+
+        p1_video_convert_full(videof, data, (size_t) video->width * 4);
+        return true;
+    }
+
+#if P1_HAVE_CL
+    if (!p1_video_gl_wait_cl(videof, &videof->out_events[slot]))
+        return false;
+
+    // Stream straight from the mapped buffer.
+    videof->stream_pic = &videof->out_pics[slot];
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+
+// Check if the current context renders in software.
+static bool p1_video_gl_is_software()
+{
+    const char *renderer = (const char *) glGetString(GL_RENDERER);
+    int i;
+
+    if (renderer == NULL)
+        return false;
+
+    for (i = 0; software_renderers[i] != NULL; i++) {
+        if (strstr(renderer, software_renderers[i]) != NULL)
+            return true;
+    }
+
+    return false;
+}
+
+// Build the fragment shader source for a number of texture units. The result
+// must be freed by the caller.
+static char *p1_video_gl_fragment_shader(int num_units)
+{
+    size_t size = 512 + (size_t) num_units * 128;
+    char *source;
+    size_t len;
+    int i;
+
+    source = malloc(size);
+    if (source == NULL)
+        return NULL;
+
+    len = snprintf(source, size, simple_fragment_shader_head, num_units);
+    for (i = 0; i < num_units; i++)
+        len += snprintf(source + len, size - len, simple_fragment_shader_unit, i);
+    snprintf(source + len, size - len, "%s", simple_fragment_shader_tail);
+
+    return source;
+}
+
+static GLuint p1_build_shader(P1Object *videoobj, GLuint type, const char *source)
+{
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, NULL);
+    glCompileShader(shader);
+
+    GLint log_size = 0;
+    glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &log_size);
+    if (log_size) {
+        GLchar *log = malloc(log_size);
+        if (log) {
+            glGetShaderInfoLog(shader, log_size, NULL, log);
+            p1_log(videoobj, P1_LOG_INFO, "Shader compiler log:\n%s", log);
+            free(log);
+        }
+    }
+
+    GLint success = GL_FALSE;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
+
+    GLenum err = glGetError();
+    if (err != GL_NO_ERROR) {
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to build shader: OpenGL error %d", err);
+        return 0;
+    }
+    if (success != GL_TRUE) {
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to build shader");
+        return 0;
+    }
+
+    return shader;
+}
+
+static bool p1_video_build_program(P1Object *videoobj, GLuint program, const char *vertex_source, const char *fragment_source)
+{
+    GLuint vertex_shader = p1_build_shader(videoobj, GL_VERTEX_SHADER, vertex_source);
+    if (vertex_shader == 0)
+        return false;
+
+    GLuint fragment_shader = p1_build_shader(videoobj, GL_FRAGMENT_SHADER, fragment_source);
+    if (fragment_shader == 0)
+        return false;
+
+    glAttachShader(program, vertex_shader);
+    glAttachShader(program, fragment_shader);
+    glLinkProgram(program);
+    glDetachShader(program, vertex_shader);
+    glDetachShader(program, fragment_shader);
+
+    glDeleteShader(vertex_shader);
+    glDeleteShader(fragment_shader);
+
+    GLint log_size = 0;
+    glGetProgramiv(program, GL_INFO_LOG_LENGTH, &log_size);
+    if (log_size) {
+        GLchar *log = malloc(log_size);
+        if (log) {
+            glGetProgramInfoLog(program, log_size, NULL, log);
+            p1_log(videoobj, P1_LOG_INFO, "Shader linker log:\n%s", log);
+            free(log);
+        }
+    }
+
+    GLint success = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &success);
+
+    GLenum err = glGetError();
+    if (err != GL_NO_ERROR) {
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to link shaders: OpenGL error %d", err);
+        return false;
+    }
+    if (success != GL_TRUE) {
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to link shaders");
+        return false;
+    }
+
+    return true;
+}
+
+#if P1_HAVE_CL
+void p1_video_cl_notify_callback(const char *errstr, const void *private_info, size_t cb, void *user_data)
+{
+    P1Object *videoobj = (P1Object *) user_data;
+    p1_log(videoobj, P1_LOG_INFO, "%s", errstr);
+}
+#endif
+
+#endif
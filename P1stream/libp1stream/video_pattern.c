@@ -0,0 +1,362 @@
+#include "p1stream_priv.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Frames are rendered into a ring when the source starts, and passed to the
+// mixer by reference, so producing a frame costs nothing. The ring is
+// reference counted, because the mixer may hold on to a frame after the
+// source stops or restarts with a new ring.
+
+typedef enum _P1Pattern P1Pattern;
+typedef struct _P1PatternRing P1PatternRing;
+typedef struct _P1PatternVideoSource P1PatternVideoSource;
+
+enum _P1Pattern {
+    P1_PATTERN_BARS         = 0,
+    P1_PATTERN_GRADIENT     = 1,
+    P1_PATTERN_NOISE        = 2
+};
+
+static const char *pattern_names[] = { "bars", "gradient", "noise", NULL };
+
+// Color bars, at 75% intensity, in BGRA.
+static const uint32_t bar_colors[] = {
+    0xffbfbfbf, 0xffbfbf00, 0xff00bfbf, 0xff00bf00,
+    0xffbf00bf, 0xffbf0000, 0xff0000bf
+};
+static const int num_bars = sizeof(bar_colors) / sizeof(bar_colors[0]);
+
+struct _P1PatternRing {
+    int refcount;
+
+    // Parameters the ring was rendered with.
+    P1Pattern pattern;
+    int width;
+    int height;
+    int num_frames;
+    int entropy;
+    uint32_t seed;
+
+    size_t frame_size;
+    uint8_t *data;
+};
+
+struct _P1PatternVideoSource {
+    P1VideoSource super;
+
+    P1Pattern cfg_pattern;
+    int cfg_width;
+    int cfg_height;
+    int cfg_frames;
+    int cfg_entropy;
+    uint32_t cfg_seed;
+    float cfg_rate;
+
+    P1PatternRing *ring;
+    int64_t start_time;
+    int index;
+};
+
+static bool p1_pattern_video_source_init(P1PatternVideoSource *pvsrc, P1Context *ctx);
+static void p1_pattern_video_source_config(P1Plugin *pel, P1Config *cfg);
+static void p1_pattern_video_source_free(P1Plugin *pel);
+static void p1_pattern_video_source_start(P1Plugin *pel);
+static void p1_pattern_video_source_stop(P1Plugin *pel);
+static bool p1_pattern_video_source_frame(P1VideoSource *vsrc);
+static bool p1_pattern_ring_matches(P1PatternVideoSource *pvsrc);
+static P1PatternRing *p1_pattern_ring_create(P1PatternVideoSource *pvsrc);
+static void p1_pattern_ring_render(P1PatternRing *ring);
+static void p1_pattern_ring_release(void *ref);
+
+
+P1VideoSource *p1_pattern_video_source_create(P1Context *ctx)
+{
+    P1PatternVideoSource *pvsrc = calloc(1, sizeof(P1PatternVideoSource));
+
+    if (pvsrc != NULL) {
+        if (!p1_pattern_video_source_init(pvsrc, ctx)) {
+            free(pvsrc);
+            pvsrc = NULL;
+        }
+    }
+
+    return (P1VideoSource *) pvsrc;
+}
+
+static bool p1_pattern_video_source_init(P1PatternVideoSource *pvsrc, P1Context *ctx)
+{
+    P1VideoSource *vsrc = (P1VideoSource *) pvsrc;
+    P1Plugin *pel = (P1Plugin *) pvsrc;
+
+    if (!p1_video_source_init(vsrc, ctx))
+        return false;
+
+    pel->config = p1_pattern_video_source_config;
+    pel->free = p1_pattern_video_source_free;
+    pel->start = p1_pattern_video_source_start;
+    pel->stop = p1_pattern_video_source_stop;
+    vsrc->frame = p1_pattern_video_source_frame;
+
+    return true;
+}
+
+static void p1_pattern_video_source_config(P1Plugin *pel, P1Config *cfg)
+{
+    P1PatternVideoSource *pvsrc = (P1PatternVideoSource *) pel;
+    P1Object *obj = (P1Object *) pel;
+    char s_tmp[16];
+    int i;
+
+    pvsrc->cfg_pattern = P1_PATTERN_BARS;
+    if (cfg->get_string(cfg, "pattern", s_tmp, sizeof(s_tmp))) {
+        for (i = 0; pattern_names[i] != NULL; i++) {
+            if (strcmp(s_tmp, pattern_names[i]) == 0)
+                break;
+        }
+        if (pattern_names[i] == NULL) {
+            p1_log(obj, P1_LOG_ERROR, "Unknown pattern '%s'", s_tmp);
+            p1_object_clear_flag(obj, P1_FLAG_CONFIG_VALID);
+            return;
+        }
+        pvsrc->cfg_pattern = (P1Pattern) i;
+    }
+
+    if (!cfg->get_int(cfg, "width", &pvsrc->cfg_width))
+        pvsrc->cfg_width = 1280;
+    if (!cfg->get_int(cfg, "height", &pvsrc->cfg_height))
+        pvsrc->cfg_height = 720;
+    if (!cfg->get_int(cfg, "frames", &pvsrc->cfg_frames))
+        pvsrc->cfg_frames = 30;
+    if (!cfg->get_int(cfg, "entropy", &pvsrc->cfg_entropy))
+        pvsrc->cfg_entropy = 8;
+    if (!cfg->get_uint32(cfg, "seed", &pvsrc->cfg_seed))
+        pvsrc->cfg_seed = 1;
+    if (!cfg->get_float(cfg, "rate", &pvsrc->cfg_rate))
+        pvsrc->cfg_rate = 0;
+
+    if (pvsrc->cfg_width <= 0 || pvsrc->cfg_height <= 0 || pvsrc->cfg_frames <= 0) {
+        p1_log(obj, P1_LOG_ERROR, "Invalid pattern dimensions %dx%d with %d frames",
+               pvsrc->cfg_width, pvsrc->cfg_height, pvsrc->cfg_frames);
+        p1_object_clear_flag(obj, P1_FLAG_CONFIG_VALID);
+        return;
+    }
+
+    if (pvsrc->cfg_entropy < 0 || pvsrc->cfg_entropy > 8) {
+        p1_log(obj, P1_LOG_ERROR, "Pattern entropy must be between 0 and 8 bits");
+        p1_object_clear_flag(obj, P1_FLAG_CONFIG_VALID);
+        return;
+    }
+
+    // The rate applies immediately, everything else needs a new ring.
+    if (pvsrc->ring != NULL && !p1_pattern_ring_matches(pvsrc))
+        p1_object_set_flag(obj, P1_FLAG_NEEDS_RESTART);
+}
+
+static void p1_pattern_video_source_free(P1Plugin *pel)
+{
+    P1PatternVideoSource *pvsrc = (P1PatternVideoSource *) pel;
+
+    if (pvsrc->ring != NULL)
+        p1_pattern_ring_release(pvsrc->ring);
+
+    free(pvsrc);
+}
+
+static void p1_pattern_video_source_start(P1Plugin *pel)
+{
+    P1PatternVideoSource *pvsrc = (P1PatternVideoSource *) pel;
+    P1Object *obj = (P1Object *) pel;
+
+    if (pvsrc->ring != NULL && !p1_pattern_ring_matches(pvsrc)) {
+        p1_pattern_ring_release(pvsrc->ring);
+        pvsrc->ring = NULL;
+    }
+
+    if (pvsrc->ring == NULL) {
+        pvsrc->ring = p1_pattern_ring_create(pvsrc);
+        if (pvsrc->ring == NULL) {
+            obj->state.current = P1_STATE_IDLE;
+            obj->state.flags |= P1_FLAG_ERROR;
+            p1_object_notify(obj);
+            return;
+        }
+    }
+
+    pvsrc->start_time = p1_get_time();
+    pvsrc->index = -1;
+
+    obj->state.current = P1_STATE_RUNNING;
+    p1_object_notify(obj);
+}
+
+static void p1_pattern_video_source_stop(P1Plugin *pel)
+{
+    P1Object *obj = (P1Object *) pel;
+
+    // The ring is kept for the next start.
+    obj->state.current = P1_STATE_IDLE;
+    p1_object_notify(obj);
+}
+
+static bool p1_pattern_video_source_frame(P1VideoSource *vsrc)
+{
+    P1PatternVideoSource *pvsrc = (P1PatternVideoSource *) vsrc;
+    P1ContextFull *ctxf = (P1ContextFull *) ((P1Object *) vsrc)->ctx;
+    P1PatternRing *ring = pvsrc->ring;
+    double elapsed;
+    int index;
+
+    // Without a rate, advance a frame every tick.
+    if (pvsrc->cfg_rate > 0) {
+        elapsed = (double) (p1_get_time() - pvsrc->start_time) * ctxf->timebase_num / ctxf->timebase_den;
+        index = (int) ((uint64_t) (elapsed * pvsrc->cfg_rate / 1000000000.0) % ring->num_frames);
+    }
+    else {
+        index = (pvsrc->index + 1) % ring->num_frames;
+    }
+
+    if (index == pvsrc->index && p1_video_source_frame_unchanged(vsrc))
+        return true;
+
+    pvsrc->index = index;
+    __atomic_add_fetch(&ring->refcount, 1, __ATOMIC_RELAXED);
+    p1_video_source_frame_ref(vsrc, ring->width, ring->height, (size_t) ring->width * 4,
+                              ring->data + ring->frame_size * index, p1_pattern_ring_release, ring);
+
+    return true;
+}
+
+// Check whether the ring was rendered with the current configuration.
+static bool p1_pattern_ring_matches(P1PatternVideoSource *pvsrc)
+{
+    P1PatternRing *ring = pvsrc->ring;
+
+    return (ring->pattern == pvsrc->cfg_pattern &&
+            ring->width == pvsrc->cfg_width &&
+            ring->height == pvsrc->cfg_height &&
+            ring->num_frames == pvsrc->cfg_frames &&
+            ring->entropy == pvsrc->cfg_entropy &&
+            ring->seed == pvsrc->cfg_seed);
+}
+
+// Allocate and render a ring, with a single reference.
+static P1PatternRing *p1_pattern_ring_create(P1PatternVideoSource *pvsrc)
+{
+    P1Object *obj = (P1Object *) pvsrc;
+    P1PatternRing *ring;
+    int ret;
+
+    ring = calloc(1, sizeof(P1PatternRing));
+    if (ring == NULL) {
+        p1_log(obj, P1_LOG_ERROR, "Failed to allocate pattern ring");
+        goto fail_ring;
+    }
+
+    ring->refcount = 1;
+    ring->pattern = pvsrc->cfg_pattern;
+    ring->width = pvsrc->cfg_width;
+    ring->height = pvsrc->cfg_height;
+    ring->num_frames = pvsrc->cfg_frames;
+    ring->entropy = pvsrc->cfg_entropy;
+    ring->seed = pvsrc->cfg_seed;
+    ring->frame_size = (size_t) ring->width * ring->height * 4;
+
+    ret = posix_memalign((void **) &ring->data, 64, ring->frame_size * ring->num_frames);
+    if (ret != 0) {
+        p1_log(obj, P1_LOG_ERROR, "Failed to allocate pattern frames: %s", strerror(ret));
+        goto fail_data;
+    }
+
+    p1_pattern_ring_render(ring);
+
+    p1_log(obj, P1_LOG_INFO, "Rendered %d frames of %s pattern at %dx%d (%.1f MiB)",
+           ring->num_frames, pattern_names[ring->pattern], ring->width, ring->height,
+           ring->frame_size * ring->num_frames / 1048576.0);
+
+    return ring;
+
+fail_data:
+    free(ring);
+
+fail_ring:
+    return NULL;
+}
+
+// Render all frames. Each pattern moves by a fraction of the frame per step,
+// so that the last frame wraps around to the first without a jump.
+static void p1_pattern_ring_render(P1PatternRing *ring)
+{
+    int width = ring->width;
+    int height = ring->height;
+    uint32_t *frame;
+    uint32_t *noise = NULL;
+    uint32_t state, mask, base;
+    int shift;
+    int i, x, y, tx, ty;
+
+    for (i = 0; i < ring->num_frames; i++) {
+        frame = (uint32_t *) (ring->data + ring->frame_size * i);
+
+        switch (ring->pattern) {
+            case P1_PATTERN_BARS:
+                shift = (int) ((int64_t) width * i / ring->num_frames);
+                for (y = 0; y < height; y++) {
+                    for (x = 0; x < width; x++) {
+                        tx = (x + shift) % width;
+                        frame[y * width + x] = bar_colors[(int64_t) tx * num_bars / width];
+                    }
+                }
+                break;
+
+            case P1_PATTERN_GRADIENT:
+                // Triangle waves, so the moving edge stays smooth.
+                shift = (int) ((int64_t) 512 * i / ring->num_frames);
+                for (y = 0; y < height; y++) {
+                    ty = (int) ((int64_t) y * 255 / (height > 1 ? height - 1 : 1));
+                    for (x = 0; x < width; x++) {
+                        tx = ((int) ((int64_t) x * 512 / width) + shift) & 511;
+                        if (tx > 255)
+                            tx = 511 - tx;
+                        frame[y * width + x] = 0xff000000 | tx << 16 | ty << 8 | (255 - tx);
+                    }
+                }
+                break;
+
+            case P1_PATTERN_NOISE:
+                // Noise is generated once with xorshift, so it is the same on
+                // every run, keeping the top entropy bits of each channel.
+                // Later frames scroll the first one up.
+                if (i == 0) {
+                    state = ring->seed != 0 ? ring->seed : 1;
+                    shift = 8 - ring->entropy;
+                    mask = (uint32_t) (0xff >> shift << shift) * 0x010101;
+                    base = (uint32_t) (0x80 >> ring->entropy) * 0x010101;
+                    for (x = 0; x < width * height; x++) {
+                        state ^= state << 13;
+                        state ^= state >> 17;
+                        state ^= state << 5;
+                        frame[x] = 0xff000000 | (state & mask) | base;
+                    }
+                    noise = frame;
+                }
+                else {
+                    shift = (int) ((int64_t) height * i / ring->num_frames);
+                    memcpy(frame, noise + (size_t) shift * width, (size_t) (height - shift) * width * 4);
+                    memcpy(frame + (size_t) (height - shift) * width, noise, (size_t) shift * width * 4);
+                }
+                break;
+        }
+    }
+}
+
+static void p1_pattern_ring_release(void *ref)
+{
+    P1PatternRing *ring = (P1PatternRing *) ref;
+
+    if (__atomic_sub_fetch(&ring->refcount, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    free(ring->data);
+    free(ring);
+}
@@ -0,0 +1,324 @@
+#include "p1stream_priv.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Scaled previews are decimated in time and size on the mixer thread, which
+// is cheap compared to compositing. Delivery happens on a separate thread, so
+// the callback can take as long as it likes without delaying encoding.
+//
+// The preview size may change at any time. The mixer thread only ever writes
+// the back buffer, so it resizes that one as needed, and the preview thread
+// delivers each buffer at the size it was scaled to.
+
+static bool p1_video_preview_start(P1VideoFull *videof);
+static bool p1_video_preview_resize(P1VideoFull *videof, int width, int height);
+static void p1_video_preview_scale_job(void *data, int job, int worker);
+static void *p1_video_preview_main(void *data);
+
+
+// Check whether the preview hook should be called for the current tick.
+// Scaled previews are limited to the preview rate, other types are always
+// due.
+bool p1_video_preview_due(P1VideoFull *videof)
+{
+    P1Video *video = (P1Video *) videof;
+    P1Object *videoobj = (P1Object *) videof;
+    P1ContextFull *ctxf = (P1ContextFull *) videoobj->ctx;
+    P1VideoPreview *preview = &videof->preview;
+    int64_t now, interval;
+
+    if (video->preview_type != P1_PREVIEW_SCALED)
+        return true;
+
+    // Drop a frame meant for a previous callback.
+    if (preview->started) {
+        p1_lock(videoobj, &preview->lock);
+        if (preview->fn != video->preview_fn || preview->user_data != video->preview_user_data)
+            preview->pending_valid = false;
+        p1_unlock(videoobj, &preview->lock);
+    }
+
+    if (video->preview_rate <= 0)
+        return true;
+
+    now = preview->tick_time * ctxf->timebase_num / ctxf->timebase_den;
+    if (now < preview->next_time)
+        return false;
+
+    // Stay on a fixed grid, unless we fell behind by more than a frame.
+    interval = (int64_t) (1000000000.0 / video->preview_rate);
+    preview->next_time += interval;
+    if (preview->next_time <= now)
+        preview->next_time = now + interval;
+
+    return true;
+}
+
+// Scale a frame into the back buffer, and hand it to the preview thread.
+bool p1_video_preview_scaled(P1VideoFull *videof, const uint8_t *in, size_t in_stride)
+{
+    P1Video *video = (P1Video *) videof;
+    P1Object *videoobj = (P1Object *) videof;
+    P1VideoPreview *preview = &videof->preview;
+    P1VideoPreviewBuffer *back;
+    int width = video->preview_width > 0 ? video->preview_width : video->width;
+    int height = video->preview_height > 0 ? video->preview_height : video->height;
+    size_t size;
+    int tmp;
+    int ret;
+
+    if (!preview->started && !p1_video_preview_start(videof))
+        return false;
+
+    if ((width != preview->width || height != preview->height) &&
+        !p1_video_preview_resize(videof, width, height))
+        return false;
+
+    // Buffers only grow, so switching back and forth doesn't reallocate.
+    back = &preview->buffers[preview->back];
+    size = (size_t) width * height * 4;
+    if (back->size < size) {
+        free(back->data);
+        back->data = malloc(size);
+        if (back->data == NULL) {
+            back->size = 0;
+            p1_log(videoobj, P1_LOG_ERROR, "Failed to allocate preview buffer");
+            return false;
+        }
+        back->size = size;
+    }
+    back->width = width;
+    back->height = height;
+
+    preview->in = in;
+    preview->in_stride = in_stride;
+    tmp = videof->workers.num_workers;
+    if (tmp > height)
+        tmp = height;
+    p1_worker_pool_run(&videof->workers, tmp, p1_video_preview_scale_job, videof);
+
+    p1_lock(videoobj, &preview->lock);
+
+    if (preview->pending_valid)
+        preview->skipped++;
+
+    tmp = preview->pending;
+    preview->pending = preview->back;
+    preview->back = tmp;
+    preview->pending_valid = true;
+    preview->fn = video->preview_fn;
+    preview->user_data = video->preview_user_data;
+
+    ret = pthread_cond_signal(&preview->cond);
+    if (ret != 0)
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to signal preview thread: %s", strerror(ret));
+    p1_unlock(videoobj, &preview->lock);
+
+    return true;
+}
+
+void p1_video_preview_stop(P1VideoFull *videof)
+{
+    P1Object *videoobj = (P1Object *) videof;
+    P1VideoPreview *preview = &videof->preview;
+    int ret;
+    int i;
+
+    if (!preview->started)
+        return;
+
+    p1_lock(videoobj, &preview->lock);
+    preview->stop = true;
+    ret = pthread_cond_signal(&preview->cond);
+    if (ret != 0)
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to signal preview thread: %s", strerror(ret));
+    p1_unlock(videoobj, &preview->lock);
+
+    ret = pthread_join(preview->thread, NULL);
+    if (ret != 0)
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to stop preview thread: %s", strerror(ret));
+
+    p1_log(videoobj, P1_LOG_DEBUG, "Preview delivered %llu frames, skipped %llu",
+           (unsigned long long) preview->delivered, (unsigned long long) preview->skipped);
+
+    ret = pthread_cond_destroy(&preview->cond);
+    if (ret != 0)
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to destroy condition variable: %s", strerror(ret));
+
+    ret = pthread_mutex_destroy(&preview->lock);
+    if (ret != 0)
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to destroy mutex: %s", strerror(ret));
+
+    for (i = 0; i < 3; i++)
+        free(preview->buffers[i].data);
+    free(preview->rows);
+    p1_video_scale_axis_free(&preview->scaler.x);
+    p1_video_scale_axis_free(&preview->scaler.y);
+
+    memset(preview, 0, sizeof(P1VideoPreview));
+}
+
+
+static bool p1_video_preview_start(P1VideoFull *videof)
+{
+    P1Object *videoobj = (P1Object *) videof;
+    P1VideoPreview *preview = &videof->preview;
+    int ret;
+
+    ret = pthread_mutex_init(&preview->lock, NULL);
+    if (ret != 0) {
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to initialize mutex: %s", strerror(ret));
+        goto fail;
+    }
+
+    ret = pthread_cond_init(&preview->cond, NULL);
+    if (ret != 0) {
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to initialize condition variable: %s", strerror(ret));
+        goto fail_lock;
+    }
+
+    preview->back = 0;
+    preview->pending = 1;
+    preview->front = 2;
+    preview->pending_valid = false;
+    preview->stop = false;
+
+    ret = pthread_create(&preview->thread, NULL, p1_video_preview_main, videof);
+    if (ret != 0) {
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to start preview thread: %s", strerror(ret));
+        goto fail_cond;
+    }
+
+    preview->started = true;
+
+    return true;
+
+fail_cond:
+    ret = pthread_cond_destroy(&preview->cond);
+    if (ret != 0)
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to destroy condition variable: %s", strerror(ret));
+
+fail_lock:
+    ret = pthread_mutex_destroy(&preview->lock);
+    if (ret != 0)
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to destroy mutex: %s", strerror(ret));
+
+fail:
+    return false;
+}
+
+// Point the scaler at new dimensions. This runs on the mixer thread, and
+// doesn't touch buffers the preview thread may be delivering.
+static bool p1_video_preview_resize(P1VideoFull *videof, int width, int height)
+{
+    P1Video *video = (P1Video *) videof;
+    P1Object *videoobj = (P1Object *) videof;
+    P1VideoPreview *preview = &videof->preview;
+    size_t row_size;
+    uint8_t *rows;
+    int ret;
+
+    preview->width = 0;
+    preview->height = 0;
+
+    if (width <= 0 || height <= 0) {
+        p1_log(videoobj, P1_LOG_ERROR, "Invalid preview dimensions %dx%d", width, height);
+        return false;
+    }
+
+    // The filter widens when shrinking, so this averages all input pixels.
+    if (!p1_video_scale_axis_update(&preview->scaler.x, P1_FILTER_BILINEAR, video->width, width,
+                                    0, width, -1, 1, 0, 1) ||
+        !p1_video_scale_axis_update(&preview->scaler.y, P1_FILTER_BILINEAR, video->height, height,
+                                    0, height, -1, 1, 0, 1)) {
+        p1_log(videoobj, P1_LOG_ERROR, "Failed to allocate filter coefficients");
+        return false;
+    }
+
+    row_size = (p1_video_scale_scratch_size(&preview->scaler) + 63) & ~(size_t) 63;
+    if (row_size != preview->row_size) {
+        ret = posix_memalign((void **) &rows, 64, row_size * videof->workers.num_workers);
+        if (ret != 0) {
+            p1_log(videoobj, P1_LOG_ERROR, "Failed to allocate scratch rows: %s", strerror(ret));
+            return false;
+        }
+
+        free(preview->rows);
+        preview->rows = rows;
+        preview->row_size = row_size;
+    }
+
+    preview->width = width;
+    preview->height = height;
+
+    return true;
+}
+
+// Scale a band of rows into the back buffer. Each worker takes one band.
+static void p1_video_preview_scale_job(void *data, int job, int worker)
+{
+    P1VideoFull *videof = (P1VideoFull *) data;
+    P1VideoPreview *preview = &videof->preview;
+    int num_jobs = videof->workers.num_workers;
+    int y1, y2;
+
+    if (num_jobs > preview->height)
+        num_jobs = preview->height;
+    y1 = preview->height * job / num_jobs;
+    y2 = preview->height * (job + 1) / num_jobs;
+
+    p1_video_scale_rows(&preview->scaler, preview->buffers[preview->back].data, (size_t) preview->width * 4,
+                        preview->in, preview->in_stride, y1, y2,
+                        preview->rows + worker * preview->row_size);
+}
+
+// The main loop of the preview thread.
+static void *p1_video_preview_main(void *data)
+{
+    P1VideoFull *videof = (P1VideoFull *) data;
+    P1Object *videoobj = (P1Object *) videof;
+    P1VideoPreview *preview = &videof->preview;
+    P1VideoPreviewBuffer *buffer;
+    P1VideoPreviewCallback fn;
+    void *user_data;
+    int tmp;
+    int ret;
+
+    p1_lock(videoobj, &preview->lock);
+
+    while (!preview->stop) {
+        if (!preview->pending_valid) {
+            ret = pthread_cond_wait(&preview->cond, &preview->lock);
+            if (ret != 0) {
+                p1_log(videoobj, P1_LOG_ERROR, "Failed to wait on condition: %s", strerror(ret));
+                break;
+            }
+            continue;
+        }
+
+        tmp = preview->front;
+        preview->front = preview->pending;
+        preview->pending = tmp;
+        preview->pending_valid = false;
+        preview->delivered++;
+        fn = preview->fn;
+        user_data = preview->user_data;
+        buffer = &preview->buffers[preview->front];
+
+        p1_unlock(videoobj, &preview->lock);
+
+        P1PreviewRawData info = {
+            .width = buffer->width,
+            .height = buffer->height,
+            .data = buffer->data
+        };
+        fn(&info, user_data);
+
+        p1_lock(videoobj, &preview->lock);
+    }
+
+    p1_unlock(videoobj, &preview->lock);
+
+    return NULL;
+}
@@ -0,0 +1,553 @@
+#include "p1stream_priv.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if __x86_64__ || __i386__
+#   include <immintrin.h>
+#   define P1_HAVE_SSE2 1
+#   define P1_HAVE_AVX2 1
+#elif __ARM_NEON
+#   include <arm_neon.h>
+#   define P1_HAVE_NEON 1
+#endif
+
+// Separable scaling of BGRA frames with a choice of filters. Output rows are
+// produced by first filtering input rows vertically into a scratch row, then
+// filtering that horizontally.
+//
+// Filter coefficients are computed once for each axis, and kept until the
+// input size or placement changes. Weights are 14-bit fixed point, and sum
+// to exactly one for every output pixel, so flat areas stay flat. Filters
+// with negative lobes clamp to the range of a byte after each pass.
+//
+// There are SIMD implementations of both passes for x86 and NEON, selected
+// at runtime based on CPU features. All produce the exact same output as the
+// plain C implementation.
+
+#define P1_SCALE_BITS   14
+#define P1_SCALE_ONE    (1 << P1_SCALE_BITS)
+#define P1_SCALE_ROUND  (1 << (P1_SCALE_BITS - 1))
+
+// Bytes of padding the scratch row needs past the input span. The SIMD
+// horizontal pass reads a pixel past the last tap.
+static const size_t scratch_padding = 64;
+
+// Vertical pass. Filters bytes [0, len) of the given rows into out.
+typedef void (*P1VideoScaleVFn)(uint8_t *out, const uint8_t *in, size_t in_stride, size_t len,
+                                const int16_t *weights, int taps);
+// Horizontal pass. Filters pixels [0, n) of out from the scratch row.
+typedef void (*P1VideoScaleHFn)(uint32_t *out, const uint8_t *in, int n,
+                                const int *first, const int16_t *weights, int taps);
+
+typedef struct _P1VideoScaleImpl P1VideoScaleImpl;
+
+struct _P1VideoScaleImpl {
+    const char *name;
+    P1VideoScaleVFn v;
+    P1VideoScaleHFn h;
+};
+
+static double p1_video_filter_weight(P1VideoFilter filter, double x);
+static void p1_video_scale_v_c(uint8_t *out, const uint8_t *in, size_t in_stride, size_t len,
+                               const int16_t *weights, int taps);
+static void p1_video_scale_h_c(uint32_t *out, const uint8_t *in, int n,
+                               const int *first, const int16_t *weights, int taps);
+#if P1_HAVE_SSE2
+static void p1_video_scale_v_sse2(uint8_t *out, const uint8_t *in, size_t in_stride, size_t len,
+                                  const int16_t *weights, int taps);
+static void p1_video_scale_h_sse2(uint32_t *out, const uint8_t *in, int n,
+                                  const int *first, const int16_t *weights, int taps);
+#endif
+#if P1_HAVE_AVX2
+static void p1_video_scale_v_avx2(uint8_t *out, const uint8_t *in, size_t in_stride, size_t len,
+                                  const int16_t *weights, int taps);
+#endif
+#if P1_HAVE_NEON
+static void p1_video_scale_v_neon(uint8_t *out, const uint8_t *in, size_t in_stride, size_t len,
+                                  const int16_t *weights, int taps);
+static void p1_video_scale_h_neon(uint32_t *out, const uint8_t *in, int n,
+                                  const int *first, const int16_t *weights, int taps);
+#endif
+static void p1_video_select_scaler();
+
+static const P1VideoScaleImpl c_impl = { "C", p1_video_scale_v_c, p1_video_scale_h_c };
+#if P1_HAVE_SSE2
+static const P1VideoScaleImpl sse2_impl = { "SSE2", p1_video_scale_v_sse2, p1_video_scale_h_sse2 };
+#endif
+#if P1_HAVE_AVX2
+static const P1VideoScaleImpl avx2_impl = { "AVX2", p1_video_scale_v_avx2, p1_video_scale_h_sse2 };
+#endif
+#if P1_HAVE_NEON
+static const P1VideoScaleImpl neon_impl = { "NEON", p1_video_scale_v_neon, p1_video_scale_h_neon };
+#endif
+
+static pthread_once_t impl_once = PTHREAD_ONCE_INIT;
+static const P1VideoScaleImpl *impl = &c_impl;
+
+
+bool p1_video_scale_axis_update(P1VideoScaleAxis *axis, P1VideoFilter filter, int in_size, int out_size,
+                                int begin, int end, float p1, float p2, float t1, float t2)
+{
+    double a, b, scale, stretch, radius, c, t, sum;
+    double *w = NULL;
+    int taps, n, i, k, j, first, start, largest;
+    int16_t *weights;
+    int total;
+
+    // Reuse the coefficients if nothing changed.
+    if (axis->valid && axis->filter == filter && axis->in_size == in_size && axis->out_size == out_size &&
+        axis->begin == begin && axis->end == end &&
+        axis->p1 == p1 && axis->p2 == p2 && axis->t1 == t1 && axis->t2 == t2)
+        return true;
+
+    axis->valid = false;
+    if (in_size <= 0 || begin >= end)
+        return false;
+
+    a = (p1 + 1) * 0.5 * out_size;
+    b = (p2 + 1) * 0.5 * out_size;
+    if (a == b)
+        return false;
+
+    // When shrinking, the filter is stretched to cover all input samples.
+    scale = fabs((t2 - t1) * in_size / (b - a));
+    stretch = scale > 1 ? scale : 1;
+    radius = p1_video_filter_radius(filter) * stretch;
+    taps = (int) ceil(radius * 2) + 1;
+    if (taps > in_size)
+        taps = in_size;
+
+    n = end - begin;
+    if (n > axis->max_pixels || taps > axis->max_taps) {
+        free(axis->first);
+        free(axis->weights);
+        axis->first = malloc(n * sizeof(int));
+        axis->weights = malloc((size_t) n * taps * sizeof(int16_t));
+        if (axis->first == NULL || axis->weights == NULL) {
+            free(axis->first);
+            free(axis->weights);
+            axis->first = NULL;
+            axis->weights = NULL;
+            axis->max_pixels = axis->max_taps = 0;
+            return false;
+        }
+        axis->max_pixels = n;
+        axis->max_taps = taps;
+    }
+
+    w = malloc(taps * sizeof(double));
+    if (w == NULL)
+        return false;
+
+    axis->in_begin = in_size;
+    axis->in_end = 0;
+
+    for (i = 0; i < n; i++) {
+        // Input position of the output pixel center, relative to texel
+        // centers. This matches the bilinear sample mapping.
+        t = (begin + i + 0.5 - a) / (b - a);
+        c = (t1 + t * (t2 - t1)) * in_size - 0.5;
+
+        // Window of taps around the center, kept within the input. Samples
+        // past the edges are clamped, so their weight folds onto the edge.
+        first = (int) floor(c - radius) + 1;
+        start = first;
+        if (start > in_size - taps)
+            start = in_size - taps;
+        if (start < 0)
+            start = 0;
+
+        memset(w, 0, taps * sizeof(double));
+        sum = 0;
+        for (k = 0; k < taps; k++) {
+            double weight = p1_video_filter_weight(filter, (first + k - c) / stretch);
+
+            j = first + k;
+            if (j < 0)
+                j = 0;
+            else if (j >= in_size)
+                j = in_size - 1;
+            w[j - start] += weight;
+            sum += weight;
+        }
+
+        // Normalize and quantize. Rounding error goes to the largest weight.
+        weights = axis->weights + (size_t) i * taps;
+        total = 0;
+        largest = 0;
+        for (k = 0; k < taps; k++) {
+            weights[k] = (int16_t) lround(sum != 0 ? w[k] / sum * P1_SCALE_ONE : 0);
+            total += weights[k];
+            if (abs(weights[k]) > abs(weights[largest]))
+                largest = k;
+        }
+        weights[largest] += P1_SCALE_ONE - total;
+
+        axis->first[i] = start;
+        if (start < axis->in_begin)
+            axis->in_begin = start;
+        if (start + taps > axis->in_end)
+            axis->in_end = start + taps;
+    }
+
+    free(w);
+
+    // Taps are relative to the first input sample used.
+    for (i = 0; i < n; i++)
+        axis->first[i] -= axis->in_begin;
+
+    axis->filter = filter;
+    axis->in_size = in_size;
+    axis->out_size = out_size;
+    axis->begin = begin;
+    axis->end = end;
+    axis->p1 = p1;
+    axis->p2 = p2;
+    axis->t1 = t1;
+    axis->t2 = t2;
+    axis->taps = taps;
+    axis->valid = true;
+
+    return true;
+}
+
+void p1_video_scale_axis_free(P1VideoScaleAxis *axis)
+{
+    free(axis->first);
+    free(axis->weights);
+    memset(axis, 0, sizeof(P1VideoScaleAxis));
+}
+
+size_t p1_video_scale_scratch_size(const P1VideoScaler *scaler)
+{
+    return (size_t) (scaler->x.in_end - scaler->x.in_begin) * 4 + scratch_padding;
+}
+
+void p1_video_scale_rows(const P1VideoScaler *scaler, uint8_t *out, size_t out_stride,
+                         const uint8_t *in, size_t in_stride, int y1, int y2, uint8_t *scratch)
+{
+    const P1VideoScaleAxis *x = &scaler->x;
+    const P1VideoScaleAxis *y = &scaler->y;
+    size_t len = (size_t) (x->in_end - x->in_begin) * 4;
+    int row, i;
+
+    pthread_once(&impl_once, p1_video_select_scaler);
+
+    in += (size_t) y->in_begin * in_stride + (size_t) x->in_begin * 4;
+    for (row = y1; row < y2; row++) {
+        i = row - y->begin;
+        impl->v(scratch, in + (size_t) y->first[i] * in_stride, in_stride, len,
+                y->weights + (size_t) i * y->taps, y->taps);
+        impl->h((uint32_t *) (out + (size_t) row * out_stride) + x->begin, scratch,
+                x->end - x->begin, x->first, x->weights, x->taps);
+    }
+}
+
+const char *p1_video_scale_isa()
+{
+    pthread_once(&impl_once, p1_video_select_scaler);
+
+    return impl->name;
+}
+
+static void p1_video_select_scaler()
+{
+#if P1_HAVE_SSE2 || P1_HAVE_AVX2
+    __builtin_cpu_init();
+#endif
+
+#if P1_HAVE_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        impl = &avx2_impl;
+        return;
+    }
+#endif
+
+#if P1_HAVE_SSE2
+    if (__builtin_cpu_supports("sse2")) {
+        impl = &sse2_impl;
+        return;
+    }
+#endif
+
+#if P1_HAVE_NEON
+    impl = &neon_impl;
+#endif
+}
+
+
+double p1_video_filter_radius(P1VideoFilter filter)
+{
+    switch (filter) {
+        case P1_FILTER_BICUBIC: return 2;
+        case P1_FILTER_LANCZOS: return 3;
+        default:                return 1;
+    }
+}
+
+// Filter kernels, in units of input samples at 1:1 scale.
+static double p1_video_filter_weight(P1VideoFilter filter, double x)
+{
+    x = fabs(x);
+
+    switch (filter) {
+        // Catmull-Rom spline.
+        case P1_FILTER_BICUBIC:
+            if (x < 1)
+                return (1.5 * x - 2.5) * x * x + 1;
+            if (x < 2)
+                return ((-0.5 * x + 2.5) * x - 4) * x + 2;
+            return 0;
+
+        // Three lobed Lanczos window.
+        case P1_FILTER_LANCZOS:
+            if (x < 1e-8)
+                return 1;
+            if (x < 3)
+                return 3 * sin(M_PI * x) * sin(M_PI * x / 3) / (M_PI * M_PI * x * x);
+            return 0;
+
+        // Tent, which is plain bilinear interpolation at 1:1 scale and up.
+        default:
+            return x < 1 ? 1 - x : 0;
+    }
+}
+
+static inline uint8_t p1_video_scale_clamp(int v)
+{
+    v = (v + P1_SCALE_ROUND) >> P1_SCALE_BITS;
+    return (uint8_t) (v < 0 ? 0 : v > 255 ? 255 : v);
+}
+
+static void p1_video_scale_v_c(uint8_t *out, const uint8_t *in, size_t in_stride, size_t len,
+                               const int16_t *weights, int taps)
+{
+    size_t i;
+    int k, sum;
+
+    for (i = 0; i < len; i++) {
+        sum = 0;
+        for (k = 0; k < taps; k++)
+            sum += in[k * in_stride + i] * weights[k];
+        out[i] = p1_video_scale_clamp(sum);
+    }
+}
+
+static void p1_video_scale_h_c(uint32_t *out, const uint8_t *in, int n,
+                               const int *first, const int16_t *weights, int taps)
+{
+    int x, k, c, sum;
+
+    for (x = 0; x < n; x++) {
+        const uint8_t *p = in + first[x] * 4;
+        const int16_t *w = weights + (size_t) x * taps;
+        uint8_t *o = (uint8_t *) &out[x];
+
+        for (c = 0; c < 4; c++) {
+            sum = 0;
+            for (k = 0; k < taps; k++)
+                sum += p[k * 4 + c] * w[k];
+            o[c] = p1_video_scale_clamp(sum);
+        }
+    }
+}
+
+
+#if P1_HAVE_SSE2
+
+// The SIMD implementations multiply pairs of taps at once, with the last tap
+// of an odd count paired with a zero weight. Sums are 32-bit, like the plain
+// C implementation.
+
+#define P1_SSE2_ATTR __attribute__((target("sse2")))
+
+static inline P1_SSE2_ATTR __m128i p1_sse2_weight_pair(const int16_t *weights, int k, int taps)
+{
+    uint16_t w0 = (uint16_t) weights[k];
+    uint16_t w1 = (uint16_t) (k + 1 < taps ? weights[k + 1] : 0);
+
+    return _mm_set1_epi32((int) ((uint32_t) w1 << 16 | w0));
+}
+
+static inline P1_SSE2_ATTR __m128i p1_sse2_round(__m128i sum)
+{
+    return _mm_srai_epi32(_mm_add_epi32(sum, _mm_set1_epi32(P1_SCALE_ROUND)), P1_SCALE_BITS);
+}
+
+static P1_SSE2_ATTR void p1_video_scale_v_sse2(uint8_t *out, const uint8_t *in, size_t in_stride, size_t len,
+                                               const int16_t *weights, int taps)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    int k;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i s0 = zero, s1 = zero, s2 = zero, s3 = zero;
+
+        for (k = 0; k < taps; k += 2) {
+            const uint8_t *r0 = in + k * in_stride + i;
+            const uint8_t *r1 = k + 1 < taps ? r0 + in_stride : r0;
+            __m128i w = p1_sse2_weight_pair(weights, k, taps);
+            __m128i a = _mm_loadu_si128((const __m128i *) r0);
+            __m128i b = _mm_loadu_si128((const __m128i *) r1);
+            __m128i lo = _mm_unpacklo_epi8(a, b);
+            __m128i hi = _mm_unpackhi_epi8(a, b);
+
+            s0 = _mm_add_epi32(s0, _mm_madd_epi16(_mm_unpacklo_epi8(lo, zero), w));
+            s1 = _mm_add_epi32(s1, _mm_madd_epi16(_mm_unpackhi_epi8(lo, zero), w));
+            s2 = _mm_add_epi32(s2, _mm_madd_epi16(_mm_unpacklo_epi8(hi, zero), w));
+            s3 = _mm_add_epi32(s3, _mm_madd_epi16(_mm_unpackhi_epi8(hi, zero), w));
+        }
+
+        __m128i lo = _mm_packs_epi32(p1_sse2_round(s0), p1_sse2_round(s1));
+        __m128i hi = _mm_packs_epi32(p1_sse2_round(s2), p1_sse2_round(s3));
+        _mm_storeu_si128((__m128i *) (out + i), _mm_packus_epi16(lo, hi));
+    }
+
+    if (i < len)
+        p1_video_scale_v_c(out + i, in + i, in_stride, len - i, weights, taps);
+}
+
+static P1_SSE2_ATTR void p1_video_scale_h_sse2(uint32_t *out, const uint8_t *in, int n,
+                                               const int *first, const int16_t *weights, int taps)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int x, k;
+
+    for (x = 0; x < n; x++) {
+        const uint8_t *p = in + first[x] * 4;
+        const int16_t *w = weights + (size_t) x * taps;
+        __m128i sum = zero;
+
+        // Interleave the channels of two pixels, and multiply with the pair
+        // of weights. The second pixel of an odd tap has zero weight.
+        for (k = 0; k < taps; k += 2) {
+            __m128i v = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (p + k * 4)), zero);
+            v = _mm_unpacklo_epi16(v, _mm_srli_si128(v, 8));
+            sum = _mm_add_epi32(sum, _mm_madd_epi16(v, p1_sse2_weight_pair(w, k, taps)));
+        }
+
+        sum = _mm_packs_epi32(p1_sse2_round(sum), zero);
+        out[x] = (uint32_t) _mm_cvtsi128_si32(_mm_packus_epi16(sum, zero));
+    }
+}
+
+#endif
+
+
+#if P1_HAVE_AVX2
+
+#define P1_AVX2_ATTR __attribute__((target("avx2")))
+
+static inline P1_AVX2_ATTR __m256i p1_avx2_round(__m256i sum)
+{
+    return _mm256_srai_epi32(_mm256_add_epi32(sum, _mm256_set1_epi32(P1_SCALE_ROUND)), P1_SCALE_BITS);
+}
+
+static P1_AVX2_ATTR void p1_video_scale_v_avx2(uint8_t *out, const uint8_t *in, size_t in_stride, size_t len,
+                                               const int16_t *weights, int taps)
+{
+    size_t i = 0;
+    int k;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i s0 = _mm256_setzero_si256(), s1 = s0, s2 = s0, s3 = s0;
+
+        for (k = 0; k < taps; k += 2) {
+            const uint8_t *r0 = in + k * in_stride + i;
+            const uint8_t *r1 = k + 1 < taps ? r0 + in_stride : r0;
+            uint16_t w0 = (uint16_t) weights[k];
+            uint16_t w1 = (uint16_t) (k + 1 < taps ? weights[k + 1] : 0);
+            __m256i w = _mm256_set1_epi32((int) ((uint32_t) w1 << 16 | w0));
+            __m128i a, b;
+
+            a = _mm_loadu_si128((const __m128i *) r0);
+            b = _mm_loadu_si128((const __m128i *) r1);
+            s0 = _mm256_add_epi32(s0, _mm256_madd_epi16(_mm256_cvtepu8_epi16(_mm_unpacklo_epi8(a, b)), w));
+            s1 = _mm256_add_epi32(s1, _mm256_madd_epi16(_mm256_cvtepu8_epi16(_mm_unpackhi_epi8(a, b)), w));
+
+            a = _mm_loadu_si128((const __m128i *) (r0 + 16));
+            b = _mm_loadu_si128((const __m128i *) (r1 + 16));
+            s2 = _mm256_add_epi32(s2, _mm256_madd_epi16(_mm256_cvtepu8_epi16(_mm_unpacklo_epi8(a, b)), w));
+            s3 = _mm256_add_epi32(s3, _mm256_madd_epi16(_mm256_cvtepu8_epi16(_mm_unpackhi_epi8(a, b)), w));
+        }
+
+        // Packing works within 128-bit lanes, so restore the order after.
+        __m256i lo = _mm256_permute4x64_epi64(_mm256_packs_epi32(p1_avx2_round(s0), p1_avx2_round(s1)), 0xd8);
+        __m256i hi = _mm256_permute4x64_epi64(_mm256_packs_epi32(p1_avx2_round(s2), p1_avx2_round(s3)), 0xd8);
+        __m256i v = _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xd8);
+        _mm256_storeu_si256((__m256i *) (out + i), v);
+    }
+
+    if (i < len)
+        p1_video_scale_v_c(out + i, in + i, in_stride, len - i, weights, taps);
+}
+
+#endif
+
+
+#if P1_HAVE_NEON
+
+static inline int32x4_t p1_neon_mla(int32x4_t sum, int16x4_t v, int16_t w)
+{
+    return vmlal_n_s16(sum, v, w);
+}
+
+static inline int16x4_t p1_neon_round(int32x4_t sum)
+{
+    return vqmovn_s32(vrshrq_n_s32(sum, P1_SCALE_BITS));
+}
+
+static void p1_video_scale_v_neon(uint8_t *out, const uint8_t *in, size_t in_stride, size_t len,
+                                  const int16_t *weights, int taps)
+{
+    size_t i = 0;
+    int k;
+
+    for (; i + 16 <= len; i += 16) {
+        int32x4_t s0 = vdupq_n_s32(0), s1 = s0, s2 = s0, s3 = s0;
+
+        for (k = 0; k < taps; k++) {
+            uint8x16_t v = vld1q_u8(in + k * in_stride + i);
+            int16x8_t lo = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(v)));
+            int16x8_t hi = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(v)));
+
+            s0 = p1_neon_mla(s0, vget_low_s16(lo), weights[k]);
+            s1 = p1_neon_mla(s1, vget_high_s16(lo), weights[k]);
+            s2 = p1_neon_mla(s2, vget_low_s16(hi), weights[k]);
+            s3 = p1_neon_mla(s3, vget_high_s16(hi), weights[k]);
+        }
+
+        int16x8_t lo = vcombine_s16(p1_neon_round(s0), p1_neon_round(s1));
+        int16x8_t hi = vcombine_s16(p1_neon_round(s2), p1_neon_round(s3));
+        vst1q_u8(out + i, vcombine_u8(vqmovun_s16(lo), vqmovun_s16(hi)));
+    }
+
+    if (i < len)
+        p1_video_scale_v_c(out + i, in + i, in_stride, len - i, weights, taps);
+}
+
+static void p1_video_scale_h_neon(uint32_t *out, const uint8_t *in, int n,
+                                  const int *first, const int16_t *weights, int taps)
+{
+    int x, k;
+
+    for (x = 0; x < n; x++) {
+        const uint8_t *p = in + first[x] * 4;
+        const int16_t *w = weights + (size_t) x * taps;
+        int32x4_t sum = vdupq_n_s32(0);
+
+        for (k = 0; k < taps; k++) {
+            uint8x8_t v = vreinterpret_u8_u32(vld1_dup_u32((const uint32_t *) (p + k * 4)));
+            sum = p1_neon_mla(sum, vget_low_s16(vreinterpretq_s16_u16(vmovl_u8(v))), w[k]);
+        }
+
+        uint8x8_t v = vqmovun_s16(vcombine_s16(p1_neon_round(sum), vdup_n_s16(0)));
+        out[x] = vget_lane_u32(vreinterpret_u32_u8(v), 0);
+    }
+}
+
+#endif
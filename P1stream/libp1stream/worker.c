@@ -0,0 +1,221 @@
+#include "p1stream_priv.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// A small pool of persistent threads that run a batch of independent jobs.
+// The calling thread also takes jobs, and waits for the batch to complete.
+// Jobs are taken in order, but the thread that runs a job is arbitrary, so
+// results should only depend on the job index.
+
+struct _P1Worker {
+    P1WorkerPool *pool;
+    int index;
+    pthread_t thread;
+};
+
+static void *p1_worker_main(void *data);
+static void p1_worker_pool_work(P1WorkerPool *pool, int worker);
+
+
+bool p1_worker_pool_init(P1WorkerPool *pool, P1Object *obj, int num_workers)
+{
+    int ret;
+    int i;
+
+    pool->obj = obj;
+    pool->num_workers = num_workers;
+    pool->num_threads = 0;
+    pool->generation = 0;
+    pool->stop = false;
+    pool->num_jobs = pool->next_job = pool->jobs_left = 0;
+
+    ret = pthread_mutex_init(&pool->lock, NULL);
+    if (ret != 0) {
+        p1_log(obj, P1_LOG_ERROR, "Failed to initialize mutex: %s", strerror(ret));
+        goto fail;
+    }
+
+    ret = pthread_cond_init(&pool->work_cond, NULL);
+    if (ret != 0) {
+        p1_log(obj, P1_LOG_ERROR, "Failed to initialize condition variable: %s", strerror(ret));
+        goto fail_lock;
+    }
+
+    ret = pthread_cond_init(&pool->done_cond, NULL);
+    if (ret != 0) {
+        p1_log(obj, P1_LOG_ERROR, "Failed to initialize condition variable: %s", strerror(ret));
+        goto fail_work_cond;
+    }
+
+    // Worker 0 is the calling thread.
+    pool->workers = calloc(num_workers, sizeof(P1Worker));
+    if (pool->workers == NULL) {
+        p1_log(obj, P1_LOG_ERROR, "Failed to allocate workers");
+        goto fail_done_cond;
+    }
+
+    for (i = 1; i < num_workers; i++) {
+        P1Worker *worker = &pool->workers[i];
+
+        worker->pool = pool;
+        worker->index = i;
+        ret = pthread_create(&worker->thread, NULL, p1_worker_main, worker);
+        if (ret != 0) {
+            p1_log(obj, P1_LOG_ERROR, "Failed to start worker thread: %s", strerror(ret));
+            goto fail_threads;
+        }
+
+        pool->num_threads++;
+    }
+
+    return true;
+
+fail_threads:
+    p1_worker_pool_destroy(pool);
+    return false;
+
+fail_done_cond:
+    ret = pthread_cond_destroy(&pool->done_cond);
+    if (ret != 0)
+        p1_log(obj, P1_LOG_ERROR, "Failed to destroy condition variable: %s", strerror(ret));
+
+fail_work_cond:
+    ret = pthread_cond_destroy(&pool->work_cond);
+    if (ret != 0)
+        p1_log(obj, P1_LOG_ERROR, "Failed to destroy condition variable: %s", strerror(ret));
+
+fail_lock:
+    ret = pthread_mutex_destroy(&pool->lock);
+    if (ret != 0)
+        p1_log(obj, P1_LOG_ERROR, "Failed to destroy mutex: %s", strerror(ret));
+
+fail:
+    return false;
+}
+
+void p1_worker_pool_destroy(P1WorkerPool *pool)
+{
+    P1Object *obj = pool->obj;
+    int ret;
+    int i;
+
+    p1_lock(obj, &pool->lock);
+    pool->stop = true;
+    ret = pthread_cond_broadcast(&pool->work_cond);
+    if (ret != 0)
+        p1_log(obj, P1_LOG_ERROR, "Failed to signal worker threads: %s", strerror(ret));
+    p1_unlock(obj, &pool->lock);
+
+    for (i = 1; i <= pool->num_threads; i++) {
+        ret = pthread_join(pool->workers[i].thread, NULL);
+        if (ret != 0)
+            p1_log(obj, P1_LOG_ERROR, "Failed to stop worker thread: %s", strerror(ret));
+    }
+
+    free(pool->workers);
+    pool->workers = NULL;
+
+    ret = pthread_cond_destroy(&pool->done_cond);
+    if (ret != 0)
+        p1_log(obj, P1_LOG_ERROR, "Failed to destroy condition variable: %s", strerror(ret));
+
+    ret = pthread_cond_destroy(&pool->work_cond);
+    if (ret != 0)
+        p1_log(obj, P1_LOG_ERROR, "Failed to destroy condition variable: %s", strerror(ret));
+
+    ret = pthread_mutex_destroy(&pool->lock);
+    if (ret != 0)
+        p1_log(obj, P1_LOG_ERROR, "Failed to destroy mutex: %s", strerror(ret));
+}
+
+void p1_worker_pool_run(P1WorkerPool *pool, int num_jobs, P1WorkerFn fn, void *data)
+{
+    P1Object *obj = pool->obj;
+    int ret;
+    int i;
+
+    // Without threads, simply run everything here.
+    if (pool->num_threads == 0) {
+        for (i = 0; i < num_jobs; i++)
+            fn(data, i, 0);
+        return;
+    }
+
+    p1_lock(obj, &pool->lock);
+
+    pool->fn = fn;
+    pool->data = data;
+    pool->num_jobs = pool->jobs_left = num_jobs;
+    pool->next_job = 0;
+    pool->generation++;
+
+    ret = pthread_cond_broadcast(&pool->work_cond);
+    if (ret != 0)
+        p1_log(obj, P1_LOG_ERROR, "Failed to signal worker threads: %s", strerror(ret));
+
+    p1_worker_pool_work(pool, 0);
+
+    while (pool->jobs_left != 0) {
+        ret = pthread_cond_wait(&pool->done_cond, &pool->lock);
+        if (ret != 0) {
+            p1_log(obj, P1_LOG_ERROR, "Failed to wait on condition: %s", strerror(ret));
+            break;
+        }
+    }
+
+    p1_unlock(obj, &pool->lock);
+}
+
+// Take jobs until there are none left. Called with the lock held.
+static void p1_worker_pool_work(P1WorkerPool *pool, int worker)
+{
+    P1Object *obj = pool->obj;
+    int ret;
+    int job;
+
+    while (pool->next_job < pool->num_jobs) {
+        job = pool->next_job++;
+
+        p1_unlock(obj, &pool->lock);
+        pool->fn(pool->data, job, worker);
+        p1_lock(obj, &pool->lock);
+
+        if (--pool->jobs_left == 0) {
+            ret = pthread_cond_signal(&pool->done_cond);
+            if (ret != 0)
+                p1_log(obj, P1_LOG_ERROR, "Failed to signal completion: %s", strerror(ret));
+        }
+    }
+}
+
+static void *p1_worker_main(void *data)
+{
+    P1Worker *worker = (P1Worker *) data;
+    P1WorkerPool *pool = worker->pool;
+    P1Object *obj = pool->obj;
+    unsigned int generation = 0;
+    int ret;
+
+    p1_lock(obj, &pool->lock);
+
+    while (true) {
+        while (!pool->stop && pool->generation == generation) {
+            ret = pthread_cond_wait(&pool->work_cond, &pool->lock);
+            if (ret != 0) {
+                p1_log(obj, P1_LOG_ERROR, "Failed to wait on condition: %s", strerror(ret));
+                break;
+            }
+        }
+
+        if (pool->stop)
+            break;
+
+        generation = pool->generation;
+        p1_worker_pool_work(pool, worker->index);
+    }
+
+    p1_unlock(obj, &pool->lock);
+
+    return NULL;
+}